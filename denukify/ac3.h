@@ -23,7 +23,10 @@
 #ifndef find_ac3_h
 #define find_ac3_h
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 #include "../libexfat/compiler.h"
 
 struct ac3_syncinfo
@@ -85,4 +88,20 @@ struct ac3_syncframe
 PACKED;
 //STATIC_ASSERT(sizeof(struct ac3_errorcheck) == 40);
 
+#define AC3_MAX_FRAME_BYTES 3840   // 640 kbps at 32 kHz
+#define DTS_MAX_FRAME_BYTES 16384
+#define DTS_HEADER_BYTES 9          // up to and including SFREQ
+
+int getBytesPerSyncframe(uint8_t fs_frmsize_code);
+uint16_t ac3_crc16(uint16_t crc, const uint8_t *buf, size_t len);
+
+// The *_frame_length() functions return the length of the frame whose header
+// is at p, 0 if there is no frame there and -1 if avail is too short to tell.
+// The *_check_frame() functions also verify the frame itself and return its
+// length, 0 if it is damaged or -n if n bytes are needed to find out.
+int ac3_frame_length(const uint8_t *p, size_t avail);
+int ac3_check_frame(const uint8_t *p, size_t avail);
+int dts_frame_length(const uint8_t *p, size_t avail);
+int dts_check_frame(const uint8_t *p, size_t avail);
+
 #endif /* find_ac3_h */
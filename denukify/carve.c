@@ -0,0 +1,340 @@
+//
+//  carve.c
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// One pass over the device for every kind of file we know how to recognise.
+// Each worker streams its part of the device through a CARVE_WINDOW buffer,
+// carrying the last CARVE_LOOKAHEAD bytes over so every candidate sees at
+// least that much after it. At each offset a table indexed by the byte at
+// each detector's anchor says which detectors could possibly match there, so
+// most offsets cost a lookup or two and only real candidates get parsed.
+//
+
+#include "carve.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static const struct carve_detector *const carve_registry[] = {
+    &ac3_detector,
+    &dts_detector,
+    &jpeg_detector,
+    &mp4_detector,
+    &mkv_detector,
+};
+
+struct carve_part
+{
+    off_t start;                // hits starting in [start, end) belong here
+    off_t end;
+    struct carve_hit *hits;
+    size_t count;
+    size_t capacity;
+    int error;
+};
+
+struct carve_scanner
+{
+    struct carve_source src;
+    const struct carve_detector *const *detectors;
+    uint32_t candidates[CARVE_MAX_ANCHOR + 1][256];    // detectors by anchor and byte
+    uint8_t anchors[CARVE_MAX_ANCHOR + 1];
+    size_t anchor_count;
+    int only_byte;              // the one anchor byte all detectors share, or -1
+    struct carve_part *parts;
+    size_t part_count;
+    size_t next_part;
+    pthread_mutex_t lock;
+};
+
+static bool skips(const struct carve_hit *hit) {
+    return hit->length != 0 && (hit->detector->framed || hit->confidence >= CARVE_SKIP_CONFIDENCE);
+}
+
+static int add_hit(struct carve_part *part, const struct carve_hit *hit) {
+    struct carve_hit *last = part->count != 0 ? &part->hits[part->count - 1] : NULL;
+
+    if (hit->detector->framed && last != NULL && last->detector == hit->detector &&
+        last->offset + last->length == hit->offset) {
+        last->length += hit->length;
+        last->confidence = hit->detector->run_confidence;
+        return 0;
+    }
+    if (part->count == part->capacity) {
+        const size_t capacity = part->capacity != 0 ? 2 * part->capacity : 64;
+        struct carve_hit *hits = realloc(part->hits, capacity * sizeof(struct carve_hit));
+        if (hits == NULL) {
+            return -ENOMEM;
+        }
+        part->hits = hits;
+        part->capacity = capacity;
+    }
+    part->hits[part->count++] = *hit;
+    return 0;
+}
+
+static void scan_part(const struct carve_scanner *scanner, struct carve_part *part, uint8_t *buf) {
+    const size_t size = CARVE_WINDOW + CARVE_LOOKAHEAD;
+    const off_t dev_size = scanner->src.dev_size;
+    off_t pos = part->start;    // device offset of buf[0]
+    size_t len = 0;
+    bool eof = false;
+
+    while (pos < part->end) {
+        uint64_t i = 0;
+        size_t limit;
+
+        if (!eof) {
+            const size_t want = (size_t) MIN((off_t) (size - len), dev_size - (pos + (off_t) len));
+            const ssize_t rd = want != 0 ? exfat_pread(scanner->src.dev, buf + len, want, pos + len) : 0;
+            if (rd < 0) {
+                part->error = errno;
+                return;
+            }
+            len += rd;
+            eof = rd == 0 || pos + (off_t) len >= dev_size;
+        }
+        limit = eof ? len : (len > CARVE_LOOKAHEAD ? len - CARVE_LOOKAHEAD : 0);
+
+        while (i < limit && pos + (off_t) i < part->end) {
+            uint32_t bits = 0;
+            uint64_t advance = 1;
+            if (scanner->only_byte >= 0) {
+                // one kind of candidate, let memchr() find the next one
+                const size_t at = i + scanner->anchors[0];
+                const uint8_t *next = at < len ? memchr(buf + at, scanner->only_byte, len - at) : NULL;
+                if (next == NULL) {
+                    i = limit;
+                    break;
+                }
+                i = next - buf - scanner->anchors[0];
+                if (i >= limit || pos + (off_t) i >= part->end) {
+                    break;
+                }
+            }
+            for (size_t a = 0; a < scanner->anchor_count; ++a) {
+                const size_t at = i + scanner->anchors[a];
+                if (at < len) {
+                    bits |= scanner->candidates[scanner->anchors[a]][buf[at]];
+                }
+            }
+            while (bits != 0) {
+                const struct carve_detector *detector = scanner->detectors[__builtin_ctz(bits)];
+                struct carve_hit hit = {detector, detector->name, pos + i, 0, 0};
+                bits &= bits - 1;
+                if (!detector->match(&scanner->src, buf + i, len - i, pos + i, &hit)) {
+                    continue;
+                }
+                if (add_hit(part, &hit) != 0) {
+                    part->error = ENOMEM;
+                    return;
+                }
+                if (skips(&hit)) {
+                    advance = hit.length;
+                    break;
+                }
+            }
+            i += advance;
+        }
+
+        if (i == 0 && eof) {
+            break;
+        }
+        if (i >= len) {
+            // skipped past everything in memory
+            pos += i;
+            len = 0;
+            eof = false;
+        } else {
+            memmove(buf, buf + i, len - i);
+            pos += i;
+            len -= i;
+        }
+    }
+}
+
+static void *carve_worker(void *arg) {
+    struct carve_scanner *scanner = arg;
+    uint8_t *buf = malloc(CARVE_WINDOW + CARVE_LOOKAHEAD);
+
+    for (;;) {
+        struct carve_part *part;
+        pthread_mutex_lock(&scanner->lock);
+        part = scanner->next_part < scanner->part_count ? &scanner->parts[scanner->next_part++] : NULL;
+        pthread_mutex_unlock(&scanner->lock);
+        if (part == NULL) {
+            break;
+        }
+        if (buf == NULL) {
+            part->error = ENOMEM;
+            continue;
+        }
+        scan_part(scanner, part, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+size_t carve_select(const char *names, const struct carve_detector **detectors, size_t max) {
+    const size_t registered = sizeof(carve_registry) / sizeof(carve_registry[0]);
+    size_t count = 0;
+
+    if (names == NULL || strcasecmp(names, "all") == 0) {
+        for (size_t i = 0; i < registered && count < max; ++i) {
+            detectors[count++] = carve_registry[i];
+        }
+        return count;
+    }
+    while (*names != '\0') {
+        const size_t n = strcspn(names, ",");
+        size_t i;
+        for (i = 0; i < registered; ++i) {
+            if (strlen(carve_registry[i]->name) == n && strncasecmp(carve_registry[i]->name, names, n) == 0) {
+                break;
+            }
+        }
+        if (i == registered || count == max) {
+            return 0;
+        }
+        detectors[count++] = carve_registry[i];
+        names += n + (names[n] == ',');
+    }
+    return count;
+}
+
+// Scans the given byte ranges of the device with the given detectors,
+// splitting them into CARVE_PART_BYTES parts that the threads take in turn,
+// and prints one line per hit in disk order. A range ending at 0 runs to the
+// end of the device.
+int carve(const char *devpath, const struct carve_range *ranges, size_t range_count,
+          const struct carve_detector *const *detectors, size_t detector_count, unsigned threads) {
+    struct carve_scanner scanner;
+    struct carve_hit *last = NULL;
+    off_t skip_end = 0;
+    pthread_t tids[threads != 0 ? threads : 1];
+    unsigned started = 0;
+    int ret = 0;
+
+    memset(&scanner, 0, sizeof(scanner));
+    if (detector_count > CARVE_MAX_DETECTORS) {
+        return EINVAL;
+    }
+    scanner.detectors = detectors;
+    for (size_t d = 0; d < detector_count; ++d) {
+        const uint8_t anchor = detectors[d]->anchor;
+        size_t a;
+        if (anchor > CARVE_MAX_ANCHOR) {
+            return EINVAL;
+        }
+        for (a = 0; a < scanner.anchor_count && scanner.anchors[a] != anchor; ++a) {
+        }
+        if (a == scanner.anchor_count) {
+            scanner.anchors[scanner.anchor_count++] = anchor;
+        }
+        scanner.candidates[anchor][detectors[d]->anchor_byte] |= 1u << d;
+        if (d == 0) {
+            scanner.only_byte = detectors[d]->anchor_byte;
+        } else if (scanner.anchor_count != 1 || scanner.only_byte != detectors[d]->anchor_byte) {
+            scanner.only_byte = -1;
+        }
+    }
+
+    scanner.src.dev = exfat_open(devpath, EXFAT_MODE_RO);
+    if (scanner.src.dev == NULL) {
+        return errno;
+    }
+    scanner.src.dev_size = exfat_get_size(scanner.src.dev);
+    pthread_mutex_init(&scanner.lock, NULL);
+
+    for (size_t r = 0; r < range_count; ++r) {
+        const off_t end = ranges[r].end != 0 ? MIN(ranges[r].end, scanner.src.dev_size) : scanner.src.dev_size;
+        scanner.part_count += ranges[r].start < end ? DIV_ROUND_UP(end - ranges[r].start, CARVE_PART_BYTES) : 0;
+    }
+    scanner.parts = calloc(scanner.part_count, sizeof(struct carve_part));
+    if (scanner.parts == NULL && scanner.part_count != 0) {
+        ret = ENOMEM;
+        goto out;
+    }
+    scanner.part_count = 0;
+    for (size_t r = 0; r < range_count; ++r) {
+        const off_t end = ranges[r].end != 0 ? MIN(ranges[r].end, scanner.src.dev_size) : scanner.src.dev_size;
+        for (off_t start = ranges[r].start; start < end; start += CARVE_PART_BYTES) {
+            scanner.parts[scanner.part_count].start = start;
+            scanner.parts[scanner.part_count].end = MIN(start + CARVE_PART_BYTES, end);
+            ++scanner.part_count;
+        }
+    }
+
+    for (unsigned t = 1; t < threads; ++t) {
+        if (pthread_create(&tids[started], NULL, carve_worker, &scanner) == 0) {
+            ++started;
+        }
+    }
+    carve_worker(&scanner);
+    for (unsigned t = 0; t < started; ++t) {
+        pthread_join(tids[t], NULL);
+    }
+
+    // A hit running over the end of its part was searched inside again by
+    // the next part: drop what that found and glue frame streams back
+    // together.
+    for (size_t p = 0; p < scanner.part_count; ++p) {
+        struct carve_part *part = &scanner.parts[p];
+        if (part->error != 0) {
+            fprintf(stderr, "scanning %jx-%jx failed: %s\n", (intmax_t) part->start, (intmax_t) part->end,
+                    strerror(part->error));
+            ret = part->error;
+        }
+        for (size_t i = 0; i < part->count; ++i) {
+            struct carve_hit *hit = &part->hits[i];
+            if (last != NULL && hit->detector->framed && last->detector == hit->detector &&
+                last->offset + last->length == hit->offset) {
+                last->length += hit->length;
+                last->confidence = hit->detector->run_confidence;
+                skip_end = last->offset + last->length;
+                continue;
+            }
+            if (hit->offset < skip_end) {
+                continue;
+            }
+            if (last != NULL) {
+                printf(CARVE_LOG_FMT, last->type, (intmax_t) last->offset, (intmax_t) last->length, last->confidence);
+            }
+            last = hit;
+            if (skips(hit)) {
+                skip_end = hit->offset + hit->length;
+            }
+        }
+    }
+    if (last != NULL) {
+        printf(CARVE_LOG_FMT, last->type, (intmax_t) last->offset, (intmax_t) last->length, last->confidence);
+    }
+
+out:
+    for (size_t p = 0; p < scanner.part_count; ++p) {
+        free(scanner.parts[p].hits);
+    }
+    free(scanner.parts);
+    pthread_mutex_destroy(&scanner.lock);
+    exfat_close(scanner.src.dev);
+    return ret;
+}
@@ -0,0 +1,88 @@
+//
+//  carve.h
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#ifndef carve_h
+#define carve_h
+
+#include <exfat.h>
+
+#define CARVE_WINDOW ((size_t) 4 * 1024 * 1024)
+#define CARVE_LOOKAHEAD ((size_t) 1024 * 1024)      // always in memory after a candidate
+#define CARVE_PART_BYTES ((off_t) 256 * 1024 * 1024)
+#define CARVE_MAX_DETECTORS 32
+#define CARVE_MAX_ANCHOR 15
+#define CARVE_SKIP_CONFIDENCE 80    // hits this sure of themselves are not searched inside
+#define CARVE_LOG_FMT "%s %016jx %016jx %u\n"   // type, offset, length, confidence
+
+struct carve_range
+{
+    off_t start;
+    off_t end;                  // 0 for the end of the device
+};
+
+struct carve_detector;
+
+struct carve_hit
+{
+    const struct carve_detector *detector;
+    const char *type;           // detector name unless it knows better, e.g. MOV
+    off_t offset;
+    off_t length;               // 0 if the end could not be found
+    unsigned confidence;        // percent
+};
+
+// What a detector may look at besides the bytes in memory, for formats whose
+// length is spread out over the device, like the boxes of an MP4.
+struct carve_source
+{
+    struct exfat_dev *dev;
+    off_t dev_size;
+};
+
+struct carve_detector
+{
+    const char *name;
+    // Candidates are only tried where the byte at anchor is anchor_byte.
+    uint8_t anchor;
+    uint8_t anchor_byte;
+    // Back-to-back hits are one stream of frames: they are reported as one
+    // hit, with run_confidence once there is more than one frame.
+    bool framed;
+    unsigned run_confidence;
+    // p is a candidate at offset on the device. At least CARVE_LOOKAHEAD
+    // bytes are available, or everything up to the end of the device if that
+    // is less. Fills in hit and returns true if there is something there.
+    bool (*match)(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                  struct carve_hit *hit);
+};
+
+extern const struct carve_detector ac3_detector;
+extern const struct carve_detector dts_detector;
+extern const struct carve_detector jpeg_detector;
+extern const struct carve_detector mp4_detector;
+extern const struct carve_detector mkv_detector;
+
+// names is a comma-separated list of detector names, NULL or "all" for all
+size_t carve_select(const char *names, const struct carve_detector **detectors, size_t max);
+int carve(const char *devpath, const struct carve_range *ranges, size_t range_count,
+          const struct carve_detector *const *detectors, size_t detector_count, unsigned threads);
+
+#endif /* carve_h */
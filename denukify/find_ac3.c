@@ -21,6 +21,12 @@
 //
 
 #include "ac3.h"
+#include "carve.h"
+
+#include <exfat.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
 
 /**
  Table 5.6 Sample Rate Codes
@@ -128,7 +134,7 @@ int getBytesPerSyncframe(uint8_t fs_frmsize_code) {
         case 0:
             return 2 * 2*nbr;
         case 1:
-            return 2 * (2*nbr + addFor44_1 + frmsize_code & 1);
+            return 2 * (2*nbr + addFor44_1 + (frmsize_code & 1));
         case 2:
             return 2 * 3*nbr;
         default:
@@ -136,91 +142,233 @@ int getBytesPerSyncframe(uint8_t fs_frmsize_code) {
     }
 }
 
-static struct ac3_syncinfo info;
-
+// CRC-16 with polynomial x^16 + x^15 + x^2 + 1, most significant bit first,
+// as used for crc1 and crc2. Both are chosen so that the CRC of what they
+// cover comes out zero, which makes the CRC of the whole syncframe after the
+// sync word zero as well.
 static const uint16_t crc_tab16[256] =
 {
-    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
-    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
-    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
-    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
-    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
-    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
-    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
-    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
-    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
-    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
-    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
-    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
-    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
-    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
-    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
-    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
-    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
-    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
-    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
-    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
-    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
-    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
-    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
-    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
-    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
-    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
-    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
-    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
-    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
-    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
-    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
-    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040,
+    0x0000, 0x8005, 0x800F, 0x000A, 0x801B, 0x001E, 0x0014, 0x8011,
+    0x8033, 0x0036, 0x003C, 0x8039, 0x0028, 0x802D, 0x8027, 0x0022,
+    0x8063, 0x0066, 0x006C, 0x8069, 0x0078, 0x807D, 0x8077, 0x0072,
+    0x0050, 0x8055, 0x805F, 0x005A, 0x804B, 0x004E, 0x0044, 0x8041,
+    0x80C3, 0x00C6, 0x00CC, 0x80C9, 0x00D8, 0x80DD, 0x80D7, 0x00D2,
+    0x00F0, 0x80F5, 0x80FF, 0x00FA, 0x80EB, 0x00EE, 0x00E4, 0x80E1,
+    0x00A0, 0x80A5, 0x80AF, 0x00AA, 0x80BB, 0x00BE, 0x00B4, 0x80B1,
+    0x8093, 0x0096, 0x009C, 0x8099, 0x0088, 0x808D, 0x8087, 0x0082,
+    0x8183, 0x0186, 0x018C, 0x8189, 0x0198, 0x819D, 0x8197, 0x0192,
+    0x01B0, 0x81B5, 0x81BF, 0x01BA, 0x81AB, 0x01AE, 0x01A4, 0x81A1,
+    0x01E0, 0x81E5, 0x81EF, 0x01EA, 0x81FB, 0x01FE, 0x01F4, 0x81F1,
+    0x81D3, 0x01D6, 0x01DC, 0x81D9, 0x01C8, 0x81CD, 0x81C7, 0x01C2,
+    0x0140, 0x8145, 0x814F, 0x014A, 0x815B, 0x015E, 0x0154, 0x8151,
+    0x8173, 0x0176, 0x017C, 0x8179, 0x0168, 0x816D, 0x8167, 0x0162,
+    0x8123, 0x0126, 0x012C, 0x8129, 0x0138, 0x813D, 0x8137, 0x0132,
+    0x0110, 0x8115, 0x811F, 0x011A, 0x810B, 0x010E, 0x0104, 0x8101,
+    0x8303, 0x0306, 0x030C, 0x8309, 0x0318, 0x831D, 0x8317, 0x0312,
+    0x0330, 0x8335, 0x833F, 0x033A, 0x832B, 0x032E, 0x0324, 0x8321,
+    0x0360, 0x8365, 0x836F, 0x036A, 0x837B, 0x037E, 0x0374, 0x8371,
+    0x8353, 0x0356, 0x035C, 0x8359, 0x0348, 0x834D, 0x8347, 0x0342,
+    0x03C0, 0x83C5, 0x83CF, 0x03CA, 0x83DB, 0x03DE, 0x03D4, 0x83D1,
+    0x83F3, 0x03F6, 0x03FC, 0x83F9, 0x03E8, 0x83ED, 0x83E7, 0x03E2,
+    0x83A3, 0x03A6, 0x03AC, 0x83A9, 0x03B8, 0x83BD, 0x83B7, 0x03B2,
+    0x0390, 0x8395, 0x839F, 0x039A, 0x838B, 0x038E, 0x0384, 0x8381,
+    0x0280, 0x8285, 0x828F, 0x028A, 0x829B, 0x029E, 0x0294, 0x8291,
+    0x82B3, 0x02B6, 0x02BC, 0x82B9, 0x02A8, 0x82AD, 0x82A7, 0x02A2,
+    0x82E3, 0x02E6, 0x02EC, 0x82E9, 0x02F8, 0x82FD, 0x82F7, 0x02F2,
+    0x02D0, 0x82D5, 0x82DF, 0x02DA, 0x82CB, 0x02CE, 0x02C4, 0x82C1,
+    0x8243, 0x0246, 0x024C, 0x8249, 0x0258, 0x825D, 0x8257, 0x0252,
+    0x0270, 0x8275, 0x827F, 0x027A, 0x826B, 0x026E, 0x0264, 0x8261,
+    0x0220, 0x8225, 0x822F, 0x022A, 0x823B, 0x023E, 0x0234, 0x8231,
+    0x8213, 0x0216, 0x021C, 0x8219, 0x0208, 0x820D, 0x8207, 0x0202,
 };
 
-void find_ac3(const char *devpath)
+static uint16_t crc16_bytewise(uint16_t crc, const uint8_t *buf, size_t len)
 {
-    struct exfat_dev *dev = exfat_open(devpath, EXFAT_MODE_RO);
-    size_t cluster = 0x0010b4e8;
-    size_t offset = cluster * 0x20000;
-    uint8_t maxframe[1920*2];
-    //exfat_seek(dev, offset, SEEK_SET);
-    info.syncword[0] = 0x0b;
-    info.syncword[1] = 0x77;
-    uint8_t ch, ch2, *ptr;
-    while (true) {
-        exfat_seek(dev, offset, SEEK_SET);
-        ssize_t rd = exfat_read(dev, maxframe, sizeof(maxframe));
-        //ssize_t rd = read(0, &ch, 1);
-        if (rd != sizeof(maxframe)) {
-            return errno;
-        }
-        ptr = maxframe;
-        while (ptr < maxframe + sizeof(maxframe) - sizeof(struct ac3_syncinfo)) {
-            if (ptr[0] == 0x0b && ptr[1] == 0x77) {
-                int frmSize = getBytesPerSyncframe(ptr[4]);
-                if (frmSize > 2) {
-                    exfat_seek(dev, offset, SEEK_SET);
-                    exfat_read(dev, maxframe, sizeof(maxframe));
-                    int crc_bytes = (frmSize>>2) + (frmSize>>4);
-                    uint16_t crc = 0xFFFF;
-                    for (uint8_t *crc_ptr = maxframe + 4; crc_ptr < maxframe + crc_bytes; ++crc_ptr) {
-                        crc = (crc >> 8) ^ crc_tab16[(uint8_t)(crc ^ *crc_ptr)];
-                    }
-                    if ((crc & 0xFF) == maxframe[3] && ((crc & 0xFF00) >> 8) == maxframe[2]) {
-                        //if (crc == 0x0000) {
-                        printf("found good crc [%d] %04x vs %02x%02x at frame offset %zx\n", frmSize, crc, maxframe[2], maxframe[3], offset);
-                        offset += frmSize;
-                    } else {
-                        //printf("bad crc [%d] %04x vs. %02x%02x\n", crc_bytes, crc, maxframe[4], maxframe[3]);
-                        offset += sizeof(struct ac3_syncinfo);
-                    }
-                    break;
-                } else {
-                    ptr += 2;
-                    offset += 2;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (uint16_t) (crc << 8) ^ crc_tab16[(uint8_t) (crc >> 8) ^ buf[i]];
+    }
+    return crc;
+}
+
+// crc_slice[k][b] is the CRC of byte b followed by k zero bytes, so N bytes
+// can be folded in with N independent lookups instead of a chain of N.
+static uint16_t crc_slice[8][256];
+
+static uint16_t crc16_slice4(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    for (; len >= 4; buf += 4, len -= 4) {
+        crc = crc_slice[3][(crc >> 8) ^ buf[0]] ^ crc_slice[2][(uint8_t) crc ^ buf[1]] ^
+              crc_slice[1][buf[2]] ^ crc_slice[0][buf[3]];
+    }
+    return crc16_bytewise(crc, buf, len);
+}
+
+static uint16_t crc16_slice8(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    for (; len >= 8; buf += 8, len -= 8) {
+        crc = crc_slice[7][(crc >> 8) ^ buf[0]] ^ crc_slice[6][(uint8_t) crc ^ buf[1]] ^
+              crc_slice[5][buf[2]] ^ crc_slice[4][buf[3]] ^
+              crc_slice[3][buf[4]] ^ crc_slice[2][buf[5]] ^
+              crc_slice[1][buf[6]] ^ crc_slice[0][buf[7]];
+    }
+    return crc16_bytewise(crc, buf, len);
+}
+
+static uint16_t (*crc16_impl)(uint16_t crc, const uint8_t *buf, size_t len) = crc16_bytewise;
+static pthread_once_t crc16_once = PTHREAD_ONCE_INIT;
+
+// Checks an implementation against the byte-wise table over every length and
+// alignment up to a couple of blocks, starting from a few initial values.
+static bool crc16_self_test(uint16_t (*impl)(uint16_t, const uint8_t *, size_t))
+{
+    static const uint16_t seeds[] = {0x0000, 0xFFFF, 0x8005, 0x1234};
+    uint8_t data[64 + 8];
+    uint32_t x = 0x2545F491;
+
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = (uint8_t) x;
+    }
+    for (size_t s = 0; s < sizeof(seeds) / sizeof(seeds[0]); ++s) {
+        for (size_t align = 0; align < 8; ++align) {
+            for (size_t len = 0; len + align <= sizeof(data); ++len) {
+                if (impl(seeds[s], data + align, len) != crc16_bytewise(seeds[s], data + align, len)) {
+                    return false;
                 }
-            } else {
-                ++ptr;
-                ++offset;
             }
         }
+    }
+    return true;
+}
 
+// Builds the slicing tables and picks the widest implementation that agrees
+// with the byte-wise one.
+static void crc16_init(void)
+{
+    for (int b = 0; b < 256; ++b) {
+        crc_slice[0][b] = crc_tab16[b];
+    }
+    for (int k = 1; k < 8; ++k) {
+        for (int b = 0; b < 256; ++b) {
+            const uint16_t prev = crc_slice[k - 1][b];
+            crc_slice[k][b] = (uint16_t) (prev << 8) ^ crc_tab16[prev >> 8];
+        }
     }
+    if (crc16_self_test(crc16_slice8)) {
+        crc16_impl = crc16_slice8;
+    } else if (crc16_self_test(crc16_slice4)) {
+        crc16_impl = crc16_slice4;
+    } else {
+        exfat_warn("sliced CRC16 failed its self-test, using the byte-wise one");
+    }
+}
+
+uint16_t ac3_crc16(uint16_t crc, const uint8_t *buf, size_t len)
+{
+    pthread_once(&crc16_once, crc16_init);
+    return crc16_impl(crc, buf, len);
 }
+
+int ac3_frame_length(const uint8_t *p, size_t avail)
+{
+    if (avail < sizeof(struct ac3_syncinfo)) {
+        return -1;
+    }
+    if (p[0] != 0x0b || p[1] != 0x77) {
+        return 0;
+    }
+    const int len = getBytesPerSyncframe(p[4]);
+    return len > 0 ? len : 0;
+}
+
+int ac3_check_frame(const uint8_t *p, size_t avail)
+{
+    const int len = ac3_frame_length(p, avail);
+    if (len <= 0) {
+        return len == 0 ? 0 : -(int) sizeof(struct ac3_syncinfo);
+    }
+    if (avail < (size_t) len) {
+        return -len;
+    }
+    return ac3_crc16(0, p + 2, len - 2) == 0 ? len : 0;
+}
+
+// Core substream header: 32 bit sync, FTYPE(1) SHORT(5) CPF(1) NBLKS(7)
+// FSIZE(14) AMODE(6) SFREQ(4) ...
+int dts_frame_length(const uint8_t *p, size_t avail)
+{
+    static const uint16_t valid_sfreq = 0x39CE; // 1, 2, 3, 6, 7, 8, 11, 12, 13
+    if (avail < DTS_HEADER_BYTES) {
+        return -1;
+    }
+    if (p[0] != 0x7f || p[1] != 0xfe || p[2] != 0x80 || p[3] != 0x01) {
+        return 0;
+    }
+    const unsigned nblks = ((p[4] & 0x01) << 6) | (p[5] >> 2);
+    const unsigned fsize = (((p[5] & 0x03) << 12) | (p[6] << 4) | (p[7] >> 4)) + 1;
+    const unsigned sfreq = (p[8] >> 2) & 0x0f;
+    if (!(p[4] & 0x80) || nblks < 5 || fsize < 96 || fsize > DTS_MAX_FRAME_BYTES ||
+        !(valid_sfreq & (1 << sfreq))) {
+        return 0;
+    }
+    return fsize;
+}
+
+// The core has no mandatory CRC, so a frame only counts as intact if the next
+// one starts right after it with the same size, channel layout and sample rate.
+int dts_check_frame(const uint8_t *p, size_t avail)
+{
+    const int len = dts_frame_length(p, avail);
+    if (len <= 0) {
+        return len == 0 ? 0 : -DTS_HEADER_BYTES;
+    }
+    if (avail < (size_t) len + DTS_HEADER_BYTES) {
+        return -(len + DTS_HEADER_BYTES);
+    }
+    return memcmp(p, p + len, DTS_HEADER_BYTES) == 0 ? len : 0;
+}
+
+static bool match_ac3(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                      struct carve_hit *hit)
+{
+    const int len = ac3_check_frame(p, avail);
+    if (len <= 0) {
+        return false;
+    }
+    // a lone frame with a good CRC is a 1 in 65536 chance at any sync word
+    hit->length = len;
+    hit->confidence = 60;
+    return true;
+}
+
+static bool match_dts(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                      struct carve_hit *hit)
+{
+    const int len = dts_check_frame(p, avail);
+    if (len <= 0) {
+        return false;
+    }
+    hit->length = len;
+    hit->confidence = 40;
+    return true;
+}
+
+const struct carve_detector ac3_detector = {
+    .name = "AC3",
+    .anchor = 0,
+    .anchor_byte = 0x0b,
+    .framed = true,
+    .run_confidence = 99,
+    .match = match_ac3,
+};
+
+const struct carve_detector dts_detector = {
+    .name = "DTS",
+    .anchor = 0,
+    .anchor_byte = 0x7f,
+    .framed = true,
+    .run_confidence = 95,
+    .match = match_dts,
+};
@@ -30,13 +30,60 @@
 #include <fcntl.h>
 #include <errno.h>
 
+#include "carve.h"
+#include "stitch.h"
+
 static void usage(const char* prog)
 {
-    fprintf(stderr, "Usage: %s <device> <logfile>\n", prog);
+    fprintf(stderr, "Usage: %s [-o output-dir [-f filter] [-j workers]] <device> <logfile>\n", prog);
+    fprintf(stderr, "       %s -J journal [-n] [-j workers] <device> <logfile>\n", prog);
+    fprintf(stderr, "       %s -R journal <device>\n", prog);
+    fprintf(stderr, "       %s -a start-end[,start-end...] [-t type[,type...]] [-j workers] <device>\n", prog);
     fprintf(stderr, "       %s -V\n", prog);
     exit(1);
 }
 
+static off_t parse_offset(const char *s, char **end)
+{
+    off_t value = strtoull(s, end, 0);
+    switch (**end) {
+        case 'T': case 't': value <<= 10; /* fall through */
+        case 'G': case 'g': value <<= 10; /* fall through */
+        case 'M': case 'm': value <<= 10; /* fall through */
+        case 'K': case 'k': value <<= 10; ++*end; break;
+    }
+    return value;
+}
+
+/* "start-end,start-end,...", either end of a range may be left out */
+static size_t parse_ranges(const char *s, struct carve_range **ranges)
+{
+    size_t count = 1;
+    char *end;
+
+    for (const char *p = s; *p != '\0'; ++p) {
+        count += *p == ',';
+    }
+    *ranges = calloc(count, sizeof(struct carve_range));
+    if (*ranges == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        (*ranges)[i].start = parse_offset(s, &end);
+        if (*end != '-') {
+            free(*ranges);
+            return 0;
+        }
+        (*ranges)[i].end = parse_offset(end + 1, &end);
+        if (*end != (i + 1 < count ? ',' : '\0')) {
+            free(*ranges);
+            return 0;
+        }
+        s = end + 1;
+    }
+    return count;
+}
+
 int main(int argc, char* argv[])
 {
     int opt, ret = 0;
@@ -44,13 +91,53 @@ int main(int argc, char* argv[])
     const char* spec = NULL;
     struct exfat_dev *dev = NULL;
     FILE *logfile = NULL;
+    const char *output_dir = NULL;
+    const char *journal = NULL;
+    const char *replay = NULL;
+    bool dry_run = false;
+    const char *filter = "*";
+    unsigned workers = 4;
+    struct carve_range *ranges = NULL;
+    size_t range_count = 0;
+    const struct carve_detector *detectors[CARVE_MAX_DETECTORS];
+    size_t detector_count = carve_select(NULL, detectors, CARVE_MAX_DETECTORS);
 
     fprintf(stderr, "%s %s\n", argv[0], VERSION);
 
-    while ((opt = getopt(argc, argv, "V")) != -1)
+    while ((opt = getopt(argc, argv, "a:t:o:f:j:J:nR:V")) != -1)
     {
         switch (opt)
         {
+            case 'a':
+                range_count = parse_ranges(optarg, &ranges);
+                if (range_count == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                detector_count = carve_select(optarg, detectors, CARVE_MAX_DETECTORS);
+                if (detector_count == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'j':
+                workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'J':
+                journal = optarg;
+                break;
+            case 'n':
+                dry_run = true;
+                break;
+            case 'R':
+                replay = optarg;
+                break;
             case 'V':
                 fprintf(stderr, "Copyright (C) 2011-2018  Andrew Nayenko\n");
                 fprintf(stderr, "Copyright (C) 2018-2019  Paul Ciarlo\n");
@@ -60,9 +147,72 @@ int main(int argc, char* argv[])
                 break;
         }
     }
+    if (range_count != 0) {
+        if (argc - optind != 1)
+            usage(argv[0]);
+        ret = carve(argv[optind], ranges, range_count, detectors, detector_count, workers);
+        free(ranges);
+        return ret;
+    }
+    if (replay != NULL) {
+        int fd;
+        if (argc - optind != 1)
+            usage(argv[0]);
+        fd = open(replay, O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "open(%s) failed: %s\n", replay, strerror(errno));
+            return errno;
+        }
+        dev = exfat_open(argv[optind], EXFAT_MODE_RW);
+        if (dev == NULL) {
+            close(fd);
+            return EIO;
+        }
+        fprintf(stderr, "Replaying %s onto %s.\n", replay, argv[optind]);
+        ret = exfat_journal_replay(dev, fd);
+        exfat_close(dev);
+        close(fd);
+        return ret;
+    }
     if (argc - optind != 2)
         usage(argv[0]);
     spec = argv[optind];
+
+    if (output_dir != NULL || journal != NULL) {
+        exfat_filesystem_t fs;
+        struct stitch_engine *stitcher = make_stitch_engine(workers, STITCH_DEFAULT_WINDOW);
+        fs = reconstruct_filesystem_from_scan_logfile(spec, argv[optind+1]);
+        if (fs == NULL) {
+            free_stitch_engine(stitcher);
+            return EIO;
+        }
+        if (stitcher != NULL) {
+            set_chain_resolver(fs, stitch_media_chain, stitcher);
+        }
+        if (output_dir != NULL) {
+            fprintf(stderr, "Restoring files from nuked file system on %s.\n", spec);
+            ret = restore_files_from_scan_logfile(fs, filter, output_dir, workers);
+        } else {
+            int fd = open(journal, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1) {
+                ret = errno;
+                fprintf(stderr, "open(%s) failed: %s\n", journal, strerror(ret));
+            } else if (dry_run) {
+                fprintf(stderr, "Journaling reconstruction of %s into %s.\n", spec, journal);
+                ret = write_fs_reconstruct_journal(fs, fd);
+            } else {
+                fprintf(stderr, "Reconstructing nuked file system on %s through %s.\n", spec, journal);
+                ret = reconstruct_live_fs(fs, fd);
+            }
+            if (fd != -1) {
+                close(fd);
+            }
+        }
+        free_filesystem(fs);
+        free_stitch_engine(stitcher);
+        return ret;
+    }
+
     fprintf(stderr, "Reconstructing nuked file system on %s.\n", spec);
     dev = exfat_open(spec, EXFAT_MODE_RW);
 
@@ -0,0 +1,282 @@
+//
+//  signatures.c
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// Detectors for container formats: JPEG, MP4/MOV and Matroska/WebM.
+//
+
+#include "carve.h"
+
+#include <string.h>
+
+#define MP4_MAX_BOXES 256
+#define EBML_MAX_HEADER 64
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const uint8_t *p) {
+    return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+// JPEG: SOI, then marker segments up to the first SOS, then entropy-coded
+// data in which a marker can only appear as FF followed by something other
+// than 00 or a restart marker. Progressive files have more segments and scans
+// after that, so keep walking until EOI or the lookahead runs out.
+static bool match_jpeg(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                       struct carve_hit *hit) {
+    bool frame = false, tables = false;
+    size_t pos = 2;
+
+    if (avail < 4 || p[1] != 0xd8 || p[2] != 0xff) {
+        return false;
+    }
+    while (pos + 4 <= avail) {
+        uint8_t marker;
+        size_t seglen;
+
+        if (p[pos] != 0xff) {
+            return false;
+        }
+        while (pos < avail && p[pos] == 0xff) {
+            ++pos;  // fill bytes
+        }
+        if (pos + 3 > avail) {
+            break;
+        }
+        marker = p[pos++];
+        if (marker == 0xd9) {
+            if (!frame) {
+                return false;
+            }
+            hit->length = pos;
+            hit->confidence = 90;
+            return true;
+        }
+        if (marker == 0x00 || marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+            return false;   // no standalone markers before the first scan
+        }
+        seglen = (size_t) p[pos] << 8 | p[pos + 1];
+        if (seglen < 2) {
+            return false;
+        }
+        if ((marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)) {
+            frame = true;
+        } else if (marker == 0xdb || marker == 0xc4) {
+            tables = true;
+        }
+        pos += seglen;
+        if (marker == 0xda) {
+            if (!frame || !tables) {
+                return false;
+            }
+            // entropy-coded data up to the next real marker
+            while (pos + 1 < avail && !(p[pos] == 0xff && p[pos + 1] != 0x00 &&
+                                        (p[pos + 1] < 0xd0 || p[pos + 1] > 0xd7))) {
+                const uint8_t *ff = memchr(p + pos + 1, 0xff, avail - pos - 1);
+                pos = ff != NULL ? (size_t) (ff - p) : avail;
+            }
+        }
+    }
+    // ran out of lookahead, the headers alone will have to do
+    if (!frame || !tables) {
+        return false;
+    }
+    hit->confidence = 50;
+    return true;
+}
+
+static bool is_box_type(const uint8_t *t) {
+    static const char known[][5] = {
+        "ftyp", "moov", "mdat", "free", "skip", "wide", "uuid", "moof", "mfra",
+        "pdin", "meta", "styp", "sidx", "pnot", "udta", "junk",
+    };
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); ++i) {
+        if (memcmp(t, known[i], 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// MP4 and QuickTime: a top level of boxes starting with ftyp. The boxes are
+// walked to find the end of the file, reading their headers off the device
+// once they are past the lookahead, since mdat can be gigabytes.
+static bool match_mp4(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                      struct carve_hit *hit) {
+    const uint32_t ftyp_size = get_be32(p);
+    bool moov = false, mdat = false;
+    uint64_t pos = 0;
+
+    if (avail < 16 || memcmp(p + 4, "ftyp", 4) != 0 || ftyp_size < 16 || ftyp_size > 4096) {
+        return false;
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (p[8 + i] < 0x20 || p[8 + i] > 0x7e) {
+            return false;
+        }
+    }
+    hit->type = memcmp(p + 8, "qt  ", 4) == 0 ? "MOV" : "MP4";
+
+    for (int boxes = 0; boxes < MP4_MAX_BOXES && offset + (off_t) pos + 8 <= src->dev_size; ++boxes) {
+        uint8_t header[16];
+        uint64_t size;
+        const size_t want = (size_t) MIN((off_t) sizeof(header), src->dev_size - offset - (off_t) pos);
+
+        if (pos + want <= avail) {
+            memcpy(header, p + pos, want);
+        } else if (exfat_pread(src->dev, header, want, offset + pos) != (ssize_t) want) {
+            break;
+        }
+        if (!is_box_type(header + 4)) {
+            break;
+        }
+        size = get_be32(header);
+        if (size == 1) {
+            if (want < 16) {
+                break;
+            }
+            size = get_be64(header + 8);
+        } else if (size == 0) {
+            size = src->dev_size - offset - pos;    // runs to the end
+        }
+        // in unsigned arithmetic, or a garbage 64-bit size wraps and passes
+        if (size < 8 || size > (uint64_t) (src->dev_size - offset) - pos) {
+            break;
+        }
+        moov |= memcmp(header + 4, "moov", 4) == 0;
+        mdat |= memcmp(header + 4, "mdat", 4) == 0;
+        pos += size;
+    }
+    if (moov && mdat) {
+        hit->length = pos;
+        hit->confidence = 95;
+    } else {
+        // just the start of one; the length is only as far as it made sense
+        hit->length = 0;
+        hit->confidence = 40;
+    }
+    return true;
+}
+
+// EBML variable-length integer: the number of leading zeros in the first
+// byte gives the length. Returns the length, 0 if invalid; *unknown is set
+// for the all-ones "size unknown" value.
+static size_t read_vint(const uint8_t *p, size_t avail, uint64_t *value, bool *unknown) {
+    size_t len = 1;
+    uint64_t v;
+    uint64_t ones;
+
+    if (avail == 0 || p[0] == 0) {
+        return 0;
+    }
+    while (!(p[0] & (0x80 >> (len - 1)))) {
+        ++len;
+    }
+    if (len > avail) {
+        return 0;
+    }
+    v = p[0] & (0xff >> len);
+    for (size_t i = 1; i < len; ++i) {
+        v = v << 8 | p[i];
+    }
+    ones = ((uint64_t) 1 << (7 * len)) - 1;
+    *unknown = v == ones;
+    *value = v;
+    return len;
+}
+
+// Matroska and WebM: an EBML header naming the DocType, then the Segment
+// whose size covers the rest of the file. Live recordings leave the Segment
+// size unknown, and then so is the length.
+static bool match_mkv(const struct carve_source *src, const uint8_t *p, size_t avail, off_t offset,
+                      struct carve_hit *hit) {
+    static const uint8_t ebml_id[] = {0x1a, 0x45, 0xdf, 0xa3};
+    static const uint8_t segment_id[] = {0x18, 0x53, 0x80, 0x67};
+    uint64_t header_size, segment_size;
+    size_t pos = sizeof(ebml_id), n, body;
+    bool unknown;
+
+    if (avail < 8 || memcmp(p, ebml_id, sizeof(ebml_id)) != 0) {
+        return false;
+    }
+    n = read_vint(p + pos, avail - pos, &header_size, &unknown);
+    if (n == 0 || unknown || header_size > EBML_MAX_HEADER || pos + n + header_size + 12 > avail) {
+        return false;
+    }
+    pos += n;
+    body = pos;
+    pos += header_size;
+
+    // DocType (0x4282) is a string element somewhere in the header
+    hit->type = NULL;
+    for (size_t i = body; i + 3 < pos; ++i) {
+        if (p[i] == 0x42 && p[i + 1] == 0x82) {
+            uint64_t len;
+            const size_t m = read_vint(p + i + 2, pos - i - 2, &len, &unknown);
+            if (m != 0 && i + 2 + m + len <= pos) {
+                const char *doctype = (const char *) p + i + 2 + m;
+                if (len == 8 && memcmp(doctype, "matroska", 8) == 0) {
+                    hit->type = "MKV";
+                } else if (len == 4 && memcmp(doctype, "webm", 4) == 0) {
+                    hit->type = "WEBM";
+                }
+            }
+            break;
+        }
+    }
+    if (hit->type == NULL || memcmp(p + pos, segment_id, sizeof(segment_id)) != 0) {
+        return false;
+    }
+    pos += sizeof(segment_id);
+    n = read_vint(p + pos, avail - pos, &segment_size, &unknown);
+    if (n == 0) {
+        return false;
+    }
+    if (unknown || segment_size > (uint64_t) (src->dev_size - offset) - (pos + n)) {
+        hit->length = 0;
+        hit->confidence = 60;
+    } else {
+        hit->length = pos + n + segment_size;
+        hit->confidence = 90;
+    }
+    return true;
+}
+
+const struct carve_detector jpeg_detector = {
+    .name = "JPEG",
+    .anchor = 0,
+    .anchor_byte = 0xff,
+    .match = match_jpeg,
+};
+
+const struct carve_detector mp4_detector = {
+    .name = "MP4",
+    .anchor = 4,
+    .anchor_byte = 'f',
+    .match = match_mp4,
+};
+
+const struct carve_detector mkv_detector = {
+    .name = "MKV",
+    .anchor = 0,
+    .anchor_byte = 0x1a,
+    .match = match_mkv,
+};
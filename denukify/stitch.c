@@ -0,0 +1,462 @@
+//
+//  stitch.c
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// Puts fragmented AC3 and DTS streams back together without a FAT. The
+// clusters of a file are chosen one at a time: the next one is whichever
+// cluster lets the syncframe left unfinished at the end of the previous one
+// complete with a good CRC (or, for DTS, be followed by a matching header),
+// and then goes on to hold the most intact frames. The cluster right after
+// the previous one is tried first, since that is almost always it; only when
+// the stream breaks there are the clusters within a window either side
+// searched, in parallel, probing a sector or two of each before parsing it.
+// Parsing a cluster from a given frame offset does not depend on anything
+// before it, so those results are remembered across steps and files.
+//
+
+#include "stitch.h"
+#include "ac3.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum media_codec
+{
+    MEDIA_NONE,
+    MEDIA_AC3,
+    MEDIA_DTS,
+};
+
+struct stitch_memo
+{
+    uint64_t key;       // cluster << 32 | offset of the first whole frame, 0 if empty
+    uint32_t frames;    // intact frames from there on
+    uint32_t tail;      // start of the frame left unfinished at the end
+    bool broken;        // stopped at something that is not a frame
+};
+
+struct stitch_engine
+{
+    unsigned threads;
+    cluster_t window;
+    pthread_mutex_t memo_lock;
+    struct stitch_memo *memo;
+};
+
+// What a step knows about the stream so far; shared read-only by the threads
+// evaluating candidates.
+struct stitch_step
+{
+    struct stitch_engine *engine;
+    struct exfat_dev *dev;
+    const struct exfat_geometry *geo;
+    enum media_codec codec;
+    const uint8_t *pending;     // unfinished frame from the previous cluster
+    size_t pending_len;
+    size_t limit;               // bytes of this cluster that belong to the file
+    bool last;
+    int next_frame;             // where the next frame starts if known, else -1
+    const cluster_t *candidates;
+    size_t candidate_count;
+    cluster_t previous;
+};
+
+struct stitch_result
+{
+    cluster_t cluster;          // 0 if nothing fits
+    uint32_t frames;
+    size_t tail;
+};
+
+struct stitch_worker
+{
+    const struct stitch_step *step;
+    unsigned index;
+    struct stitch_result best;
+};
+
+static int check_frame(enum media_codec codec, const uint8_t *p, size_t avail) {
+    return codec == MEDIA_AC3 ? ac3_check_frame(p, avail) : dts_check_frame(p, avail);
+}
+
+static int frame_length(enum media_codec codec, const uint8_t *p, size_t avail) {
+    return codec == MEDIA_AC3 ? ac3_frame_length(p, avail) : dts_frame_length(p, avail);
+}
+
+static size_t max_frame_need(enum media_codec codec) {
+    return codec == MEDIA_AC3 ? AC3_MAX_FRAME_BYTES : DTS_MAX_FRAME_BYTES + DTS_HEADER_BYTES;
+}
+
+static size_t sync_length(enum media_codec codec) {
+    return codec == MEDIA_AC3 ? 2 : 4;
+}
+
+static bool has_sync(enum media_codec codec, const uint8_t *p) {
+    static const uint8_t ac3_sync[] = {0x0b, 0x77};
+    static const uint8_t dts_sync[] = {0x7f, 0xfe, 0x80, 0x01};
+    return memcmp(p, codec == MEDIA_AC3 ? ac3_sync : dts_sync, sync_length(codec)) == 0;
+}
+
+static uint32_t parse_frames(enum media_codec codec, const uint8_t *buf, size_t len, size_t *tail, bool *broken) {
+    uint32_t frames = 0;
+    size_t pos = 0;
+
+    *broken = false;
+    while (pos < len) {
+        const int r = check_frame(codec, buf + pos, len - pos);
+        if (r <= 0) {
+            *broken = r == 0;
+            break;
+        }
+        pos += r;
+        ++frames;
+    }
+    *tail = pos;
+    return frames;
+}
+
+static uint64_t memo_key(cluster_t cluster, size_t offset) {
+    return (uint64_t) cluster << 32 | offset;
+}
+
+static bool memo_find(struct stitch_engine *engine, uint64_t key, struct stitch_memo *out) {
+    struct stitch_memo *slot = &engine->memo[(key * 0x9E3779B97F4A7C15ULL) >> 48 & (STITCH_MEMO_SLOTS - 1)];
+    bool found;
+
+    pthread_mutex_lock(&engine->memo_lock);
+    found = slot->key == key;
+    if (found) {
+        *out = *slot;
+    }
+    pthread_mutex_unlock(&engine->memo_lock);
+    return found;
+}
+
+static void memo_store(struct stitch_engine *engine, const struct stitch_memo *memo) {
+    struct stitch_memo *slot = &engine->memo[(memo->key * 0x9E3779B97F4A7C15ULL) >> 48 & (STITCH_MEMO_SLOTS - 1)];
+
+    pthread_mutex_lock(&engine->memo_lock);
+    *slot = *memo;
+    pthread_mutex_unlock(&engine->memo_lock);
+}
+
+// Reads the sectors holding the next frame's sync word. Cheap enough to run
+// over thousands of candidates before reading any of them in full.
+static bool probe_cluster(const struct stitch_step *step, cluster_t cluster, uint8_t *sectors) {
+    const size_t ss = GEOMETRY_SECTOR_SIZE(*step->geo);
+    const size_t at = (size_t) step->next_frame;
+    const size_t first = at / ss * ss;
+    const size_t len = ROUND_UP(at + sync_length(step->codec), ss) - first;
+
+    if (at + sync_length(step->codec) > step->limit) {
+        return true;
+    }
+    if (exfat_pread(step->dev, sectors, len, exfat_geometry_c2o(step->geo, cluster) + first) != (ssize_t) len) {
+        return false;
+    }
+    return has_sync(step->codec, sectors + at - first);
+}
+
+// Checks that cluster carries the stream on. Fails unless the unfinished
+// frame completes in it and what follows parses cleanly, except that the
+// file's last cluster may end in anything.
+static bool evaluate_cluster(const struct stitch_step *step, cluster_t cluster, uint8_t *buf, uint8_t *join,
+                             struct stitch_result *result) {
+    const size_t ss = GEOMETRY_SECTOR_SIZE(*step->geo);
+    struct stitch_memo memo;
+    size_t start = 0;
+    uint32_t frames = 0;
+
+    if (exfat_pread(step->dev, buf, ROUND_UP(step->limit, ss), exfat_geometry_c2o(step->geo, cluster)) <
+        (ssize_t) step->limit) {
+        return false;
+    }
+    if (step->pending_len != 0) {
+        const size_t head = MIN(step->limit, max_frame_need(step->codec));
+        size_t at = 0;
+        memcpy(join, step->pending, step->pending_len);
+        memcpy(join + step->pending_len, buf, head);
+        // A DTS frame that is whole but whose successor's header is not can
+        // be pending too, so go on until a frame reaches into this cluster.
+        while (at < step->pending_len) {
+            const int r = check_frame(step->codec, join + at, step->pending_len + head - at);
+            if (r <= 0) {
+                if (r < 0 && step->last) {
+                    // the file ends before its last frame does
+                    *result = (struct stitch_result) {cluster, frames, step->limit};
+                    return true;
+                }
+                return false;
+            }
+            at += r;
+            ++frames;
+        }
+        start = at - step->pending_len;
+    }
+
+    memo.key = memo_key(cluster, start);
+    if (step->last || !memo_find(step->engine, memo.key, &memo)) {
+        size_t tail;
+        memo.frames = parse_frames(step->codec, buf + start, step->limit - MIN(start, step->limit), &tail, &memo.broken);
+        memo.tail = start + tail;
+        if (!step->last) {
+            memo_store(step->engine, &memo);
+        }
+    }
+    if (memo.broken && !step->last) {
+        return false;
+    }
+    *result = (struct stitch_result) {cluster, frames + memo.frames, memo.tail};
+    return result->frames != 0 || (step->last && !memo.broken);
+}
+
+static bool better_result(const struct stitch_result *a, const struct stitch_result *b, cluster_t previous) {
+    const cluster_t da = a->cluster > previous ? a->cluster - previous : previous - a->cluster;
+    const cluster_t db = b->cluster > previous ? b->cluster - previous : previous - b->cluster;
+    if (b->cluster == 0) {
+        return true;
+    }
+    return a->frames > b->frames || (a->frames == b->frames && da < db);
+}
+
+static void *search_worker(void *arg) {
+    struct stitch_worker *worker = arg;
+    const struct stitch_step *step = worker->step;
+    const size_t cs = GEOMETRY_CLUSTER_SIZE(*step->geo);
+    uint8_t *buf = malloc(cs + 2 * GEOMETRY_SECTOR_SIZE(*step->geo));
+    uint8_t *join = malloc(step->pending_len + max_frame_need(step->codec));
+
+    worker->best.cluster = 0;
+    if (buf == NULL || join == NULL) {
+        free(buf);
+        free(join);
+        return NULL;
+    }
+    for (size_t i = worker->index; i < step->candidate_count; i += step->engine->threads) {
+        struct stitch_result result;
+        const cluster_t cluster = step->candidates[i];
+        if (step->next_frame >= 0 && !probe_cluster(step, cluster, buf)) {
+            continue;
+        }
+        if (evaluate_cluster(step, cluster, buf, join, &result) && better_result(&result, &worker->best, step->previous)) {
+            worker->best = result;
+        }
+    }
+    free(buf);
+    free(join);
+    return NULL;
+}
+
+static void search_window(const struct stitch_step *step, struct stitch_result *best) {
+    const unsigned threads = step->engine->threads;
+    struct stitch_worker workers[threads];
+    pthread_t tids[threads];
+    bool started[threads];
+
+    best->cluster = 0;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers[t] = (struct stitch_worker) {step, t, {0, 0, 0}};
+        started[t] = t != 0 && pthread_create(&tids[t], NULL, search_worker, &workers[t]) == 0;
+    }
+    for (unsigned t = 0; t < threads; ++t) {
+        // whatever could not get its own thread runs here
+        if (!started[t]) {
+            search_worker(&workers[t]);
+        }
+    }
+    for (unsigned t = 0; t < threads; ++t) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+        if (workers[t].best.cluster != 0 && better_result(&workers[t].best, best, step->previous)) {
+            *best = workers[t].best;
+        }
+    }
+}
+
+// Clusters placed in the chain so far, in an open addressing hash set sized
+// for the whole chain: candidates are checked against it in constant time
+// however long the file gets. Cluster 0 marks an empty slot.
+struct stitch_claimed
+{
+    cluster_t *slots;
+    size_t mask;
+};
+
+static bool init_claimed(struct stitch_claimed *claimed, cluster_t clusters) {
+    size_t capacity = 16;
+
+    while (capacity < 2 * (size_t) clusters) {
+        capacity <<= 1;
+    }
+    claimed->slots = calloc(capacity, sizeof(cluster_t));
+    claimed->mask = capacity - 1;
+    return claimed->slots != NULL;
+}
+
+static size_t claimed_slot(const struct stitch_claimed *claimed, cluster_t cluster) {
+    size_t i = (cluster * 0x9E3779B1u) & claimed->mask;
+
+    while (claimed->slots[i] != 0 && claimed->slots[i] != cluster) {
+        i = (i + 1) & claimed->mask;
+    }
+    return i;
+}
+
+static bool is_claimed(const struct stitch_claimed *claimed, cluster_t cluster) {
+    return claimed->slots[claimed_slot(claimed, cluster)] == cluster;
+}
+
+static void claim(struct stitch_claimed *claimed, cluster_t cluster) {
+    claimed->slots[claimed_slot(claimed, cluster)] = cluster;
+}
+
+static size_t collect_candidates(const struct exfat_geometry *geo, cluster_t window, cluster_t previous,
+                                 const struct stitch_claimed *claimed, cluster_t *candidates) {
+    const cluster_t end = geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    size_t n = 0;
+
+    for (cluster_t d = 2; d <= window + 1; ++d) {
+        if (previous + d < end && !is_claimed(claimed, previous + d)) {
+            candidates[n++] = previous + d;
+        }
+        if (previous >= EXFAT_FIRST_DATA_CLUSTER + d - 1 && !is_claimed(claimed, previous - d + 1)) {
+            candidates[n++] = previous - d + 1;
+        }
+    }
+    return n;
+}
+
+struct stitch_engine *make_stitch_engine(unsigned threads, cluster_t window) {
+    struct stitch_engine *engine = malloc(sizeof(struct stitch_engine));
+
+    if (engine == NULL) {
+        return NULL;
+    }
+    engine->threads = threads != 0 ? threads : 1;
+    engine->window = window;
+    engine->memo = calloc(STITCH_MEMO_SLOTS, sizeof(struct stitch_memo));
+    if (engine->memo == NULL) {
+        free(engine);
+        return NULL;
+    }
+    pthread_mutex_init(&engine->memo_lock, NULL);
+    return engine;
+}
+
+void free_stitch_engine(struct stitch_engine *engine) {
+    if (engine != NULL) {
+        pthread_mutex_destroy(&engine->memo_lock);
+        free(engine->memo);
+        free(engine);
+    }
+}
+
+cluster_t stitch_media_chain(struct exfat_dev *dev, const struct exfat_geometry *geo,
+                             const char *name, cluster_t start_cluster, uint64_t size,
+                             cluster_t *chain, cluster_t clusters, void *ctx) {
+    struct stitch_engine *engine = ctx;
+    const size_t cs = GEOMETRY_CLUSTER_SIZE(*geo);
+    const size_t ss = GEOMETRY_SECTOR_SIZE(*geo);
+    struct stitch_step step = {engine, dev, geo, MEDIA_NONE};
+    uint8_t *buf = NULL, *join = NULL, *pending = NULL;
+    cluster_t *candidates = NULL;
+    struct stitch_claimed claimed = {NULL, 0};
+    cluster_t n = 0;
+
+    buf = malloc(cs + ss);
+    if (buf == NULL) {
+        return 0;
+    }
+    if (exfat_pread(dev, buf, ss, exfat_geometry_c2o(geo, start_cluster)) == (ssize_t) ss) {
+        if (ac3_frame_length(buf, ss) > 0) {
+            step.codec = MEDIA_AC3;
+        } else if (dts_frame_length(buf, ss) > 0) {
+            step.codec = MEDIA_DTS;
+        }
+    }
+    if (step.codec == MEDIA_NONE || cs < max_frame_need(step.codec)) {
+        free(buf);
+        return 0;
+    }
+
+    pending = malloc(max_frame_need(step.codec));
+    join = malloc(2 * max_frame_need(step.codec));
+    candidates = malloc(2 * (size_t) engine->window * sizeof(cluster_t));
+    if (pending == NULL || join == NULL || candidates == NULL || !init_claimed(&claimed, clusters)) {
+        goto out;
+    }
+    step.pending = pending;
+    step.candidates = candidates;
+
+    for (cluster_t i = 0; i < clusters; ++i) {
+        struct stitch_result result = {0, 0, 0};
+        step.limit = MIN((uint64_t) cs, size - (uint64_t) i * cs);
+        step.last = i + 1 == clusters;
+        step.next_frame = -1;
+        if (step.pending_len == 0) {
+            step.next_frame = 0;
+        } else {
+            const int len = frame_length(step.codec, pending, step.pending_len);
+            // unknown if the pending frame is whole and the next one starts in it
+            if (len > 0 && (size_t) len >= step.pending_len) {
+                step.next_frame = len - step.pending_len;
+            }
+        }
+
+        if (i == 0) {
+            if (!evaluate_cluster(&step, start_cluster, buf, join, &result)) {
+                break;
+            }
+        } else {
+            step.previous = chain[i - 1];
+            if (step.previous + 1 >= geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER ||
+                is_claimed(&claimed, step.previous + 1) ||
+                !evaluate_cluster(&step, step.previous + 1, buf, join, &result)) {
+                step.candidate_count = collect_candidates(geo, engine->window, step.previous, &claimed, candidates);
+                search_window(&step, &result);
+                if (result.cluster == 0) {
+                    exfat_warn("%s: stream breaks after cluster %u, %u of %u placed", name,
+                               step.previous, i, clusters);
+                    break;
+                }
+            }
+        }
+        chain[n++] = result.cluster;
+        claim(&claimed, result.cluster);
+
+        // carry the unfinished frame over to the next step
+        step.pending_len = step.limit - MIN(result.tail, step.limit);
+        if (step.pending_len > max_frame_need(step.codec) ||
+            (step.pending_len != 0 &&
+             exfat_pread(dev, pending, step.pending_len,
+                         exfat_geometry_c2o(geo, result.cluster) + result.tail) != (ssize_t) step.pending_len)) {
+            break;
+        }
+    }
+
+out:
+    free(claimed.slots);
+    free(candidates);
+    free(join);
+    free(pending);
+    free(buf);
+    return n;
+}
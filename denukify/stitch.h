@@ -0,0 +1,40 @@
+//
+//  stitch.h
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#ifndef stitch_h
+#define stitch_h
+
+#include <exfat.h>
+
+#define STITCH_DEFAULT_WINDOW 16384     // clusters searched either side of a break
+#define STITCH_MEMO_SLOTS 65536
+
+struct stitch_engine;
+
+struct stitch_engine *make_stitch_engine(unsigned threads, cluster_t window);
+void free_stitch_engine(struct stitch_engine *engine);
+
+// exfat_chain_resolver_t for AC3 and DTS streams, ctx is a stitch_engine
+cluster_t stitch_media_chain(struct exfat_dev *dev, const struct exfat_geometry *geo,
+                             const char *name, cluster_t start_cluster, uint64_t size,
+                             cluster_t *chain, cluster_t clusters, void *ctx);
+
+#endif /* stitch_h */
@@ -0,0 +1,132 @@
+//
+//  stitch_test.c
+//  denukify
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// Writes DTS streams with various frame sizes to a scratch image, in two
+// fragments with zeroed clusters between them, and checks that the stitcher
+// puts every cluster back in order. Frame sizes that leave a frame boundary
+// within a header's length of a cluster end are the ones that used to break.
+//
+
+#include "stitch.h"
+#include "ac3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_SECTOR_BITS 9
+#define TEST_SPC_BITS 6                 // 32 KiB clusters
+#define TEST_CLUSTERS 16
+#define TEST_GAP 10                     // zeroed clusters between the fragments
+#define TEST_HEAP_CLUSTERS 64
+
+static void put_dts_header(uint8_t *p, unsigned fsize) {
+    const unsigned nblks = 15, amode = 9, sfreq = 13;
+
+    p[0] = 0x7f;
+    p[1] = 0xfe;
+    p[2] = 0x80;
+    p[3] = 0x01;
+    p[4] = 0x80 | 31 << 2 | nblks >> 6;
+    p[5] = (uint8_t) ((nblks & 0x3f) << 2 | (fsize - 1) >> 12);
+    p[6] = (uint8_t) ((fsize - 1) >> 4);
+    p[7] = (uint8_t) ((fsize - 1) << 4 | amode >> 2);
+    p[8] = (uint8_t) (amode << 6 | sfreq << 2);
+}
+
+static cluster_t file_cluster(cluster_t i) {
+    return EXFAT_FIRST_DATA_CLUSTER + i + (i < TEST_CLUSTERS / 2 ? 0 : TEST_GAP);
+}
+
+// Each run gets its own engine: what it remembers of a cluster would be stale
+// once the next run rewrites the image.
+static bool stitch_dts(const char *path, unsigned fsize) {
+    const struct exfat_geometry geo = {
+        .disk_size = (off_t) TEST_HEAP_CLUSTERS << (TEST_SECTOR_BITS + TEST_SPC_BITS),
+        .cluster_count = TEST_HEAP_CLUSTERS,
+        .sector_bits = TEST_SECTOR_BITS,
+        .spc_bits = TEST_SPC_BITS,
+    };
+    const size_t cs = GEOMETRY_CLUSTER_SIZE(geo);
+    const size_t size = TEST_CLUSTERS * cs;
+    uint8_t *stream = malloc(size + fsize);
+    uint8_t *zero = calloc(1, (size_t) geo.disk_size);
+    cluster_t chain[TEST_CLUSTERS];
+    struct stitch_engine *engine = make_stitch_engine(2, STITCH_DEFAULT_WINDOW);
+    struct exfat_dev *dev;
+    cluster_t placed = 0;
+    bool ok = true;
+    FILE *f;
+
+    if (stream == NULL || zero == NULL || engine == NULL) {
+        exit(99);
+    }
+    srand(fsize);
+    for (size_t pos = 0; pos < size; pos += fsize) {
+        for (size_t i = DTS_HEADER_BYTES; i < fsize; ++i) {
+            stream[pos + i] = (uint8_t) rand();
+        }
+        put_dts_header(stream + pos, fsize);
+    }
+    f = fopen(path, "wb");
+    if (f == NULL || fwrite(zero, geo.disk_size, 1, f) != 1) {
+        perror(path);
+        exit(99);
+    }
+    for (cluster_t i = 0; i < TEST_CLUSTERS; ++i) {
+        fseeko(f, exfat_geometry_c2o(&geo, file_cluster(i)), SEEK_SET);
+        fwrite(stream + i * cs, cs, 1, f);
+    }
+    fclose(f);
+
+    dev = exfat_open(path, EXFAT_MODE_RO);
+    if (dev == NULL) {
+        exit(99);
+    }
+    placed = stitch_media_chain(dev, &geo, "test.dts", file_cluster(0), size, chain, TEST_CLUSTERS, engine);
+    exfat_close(dev);
+    for (cluster_t i = 0; i < TEST_CLUSTERS; ++i) {
+        ok = ok && i < placed && chain[i] == file_cluster(i);
+    }
+    printf("%s: %u byte DTS frames, %u of %u clusters placed\n", ok ? "PASS" : "FAIL", fsize, placed,
+           TEST_CLUSTERS);
+    free_stitch_engine(engine);
+    free(zero);
+    free(stream);
+    return ok;
+}
+
+int main(void) {
+    static const unsigned sizes[] = {2000, 2048, 4681, 8191, 10921, 16384};
+    char path[] = "/tmp/stitch_test.XXXXXX";
+    int fd = mkstemp(path);
+    int failed = 0;
+
+    if (fd == -1) {
+        return 99;
+    }
+    close(fd);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        failed += !stitch_dts(path, sizes[i]);
+    }
+    unlink(path);
+    return failed != 0;
+}
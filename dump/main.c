@@ -26,6 +26,81 @@
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+struct dump_phase
+{
+	uint64_t ns;
+	uint64_t bytes_read;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* dev is NULL for a phase that opens the device */
+static void phase_begin(struct dump_phase* phase, const struct exfat_dev* dev)
+{
+	uint64_t read = 0, written;
+
+	if (dev != NULL)
+		exfat_get_io_bytes(dev, &read, &written);
+	phase->ns = -now_ns();
+	phase->bytes_read = -read;
+}
+
+static void phase_end(struct dump_phase* phase, const struct exfat_dev* dev)
+{
+	uint64_t read = 0, written;
+
+	if (dev != NULL)
+		exfat_get_io_bytes(dev, &read, &written);
+	phase->ns += now_ns();
+	phase->bytes_read += read;
+}
+
+static void print_json_phase(const char* name, const struct dump_phase* phase,
+		const char* separator)
+{
+	printf("\t\t\"%s\": {\"seconds\": %.6f, \"bytes_read\": %"PRIu64"}%s\n",
+			name, phase->ns / 1e9, phase->bytes_read, separator);
+}
+
+static void print_json_errors(void)
+{
+	printf("\t\"errors\": %d,\n", exfat_errors);
+	printf("\t\"errors_fixed\": %d,\n", exfat_errors_fixed);
+}
+
+static void print_json_sb(const char* spec, const struct exfat_super_block* sb)
+{
+	fputs("\t\"device\": ", stdout);
+	exfat_print_json_string(stdout, spec);
+	printf(",\n\t\"volume_serial\": %u,\n", le32_to_cpu(sb->volume_serial));
+	printf("\t\"version\": \"%hhu.%hhu\",\n",
+			sb->version.major, sb->version.minor);
+	printf("\t\"sector_size\": %u,\n", SECTOR_SIZE(*sb));
+	printf("\t\"cluster_size\": %u,\n", CLUSTER_SIZE(*sb));
+	printf("\t\"sectors\": %"PRIu64",\n", le64_to_cpu(sb->sector_count));
+	printf("\t\"clusters\": %u,\n", le32_to_cpu(sb->cluster_count));
+	printf("\t\"first_sector\": %"PRIu64",\n",
+			le64_to_cpu(sb->sector_start));
+	printf("\t\"fat_first_sector\": %u,\n",
+			le32_to_cpu(sb->fat_sector_start));
+	printf("\t\"fat_sectors\": %u,\n", le32_to_cpu(sb->fat_sector_count));
+	printf("\t\"first_cluster_sector\": %u,\n",
+			le32_to_cpu(sb->cluster_sector_start));
+	printf("\t\"root_directory_cluster\": %u,\n",
+			le32_to_cpu(sb->rootdir_cluster));
+	printf("\t\"volume_state\": %hu,\n", le16_to_cpu(sb->volume_state));
+	printf("\t\"fat_count\": %hhu,\n", sb->fat_count);
+	printf("\t\"drive_number\": %hhu,\n", sb->drive_no);
+	printf("\t\"allocated_percent\": %hhu,\n", sb->allocated_percent);
+}
 
 static void print_generic_info(const struct exfat_super_block* sb)
 {
@@ -73,7 +148,7 @@ static void print_other_info(const struct exfat_super_block* sb)
 			sb->allocated_percent);
 }
 
-static int dump_sb(const char* spec)
+static int dump_sb(const char* spec, bool json)
 {
 	struct exfat_dev* dev;
 	struct exfat_super_block sb;
@@ -95,52 +170,106 @@ static int dump_sb(const char* spec)
 		return 1;
 	}
 
-	print_generic_info(&sb);
-	print_sector_info(&sb);
-	print_cluster_info(&sb);
-	print_other_info(&sb);
+	if (json)
+	{
+		puts("{");
+		print_json_sb(spec, &sb);
+		print_json_errors();
+		puts("\t\"phases\": {}\n}");
+	}
+	else
+	{
+		print_generic_info(&sb);
+		print_sector_info(&sb);
+		print_cluster_info(&sb);
+		print_other_info(&sb);
+	}
 
 	exfat_close(dev);
 	return 0;
 }
 
-static void dump_sectors(struct exfat* ef)
+/*
+	Ranges of used sectors, the first one from sector 0 as the boot region
+	and the FAT are in use too.
+*/
+static void dump_sectors(struct exfat* ef, bool json)
 {
-	off_t a = 0, b = 0;
+	const uint64_t heap = le32_to_cpu(ef->sb->cluster_sector_start);
+	cluster_t start = 0;
+	uint32_t count = 0;
+	bool first = true;
 
-	printf("Used sectors ");
-	while (exfat_find_used_sectors(ef, &a, &b) == 0)
-		printf(" %"PRIu64"-%"PRIu64, a, b);
-	puts("");
+	fputs(json ? "\t\"used_sectors\": [" : "Used sectors ", stdout);
+	while (exfat_next_used_range(ef, &start, &count))
+	{
+		const uint64_t a = first ? 0 : heap +
+				((uint64_t) (start - EXFAT_FIRST_DATA_CLUSTER) <<
+				ef->sb->spc_bits);
+		const uint64_t b = heap +
+				((uint64_t) (start + count - EXFAT_FIRST_DATA_CLUSTER) <<
+				ef->sb->spc_bits) - 1;
+
+		if (json)
+			printf("%s[%"PRIu64", %"PRIu64"]", first ? "" : ", ", a, b);
+		else
+			printf(" %"PRIu64"-%"PRIu64, a, b);
+		first = false;
+	}
+	puts(json ? "]," : "");
 }
 
-static int dump_full(const char* spec, bool used_sectors)
+static int dump_full(const char* spec, bool used_sectors, bool json)
 {
 	struct exfat ef;
 	uint32_t free_clusters;
 	uint64_t free_sectors;
+	struct dump_phase mount, bitmap;
 
+	phase_begin(&mount, NULL);
 	if (exfat_mount(&ef, spec, "ro") != 0)
 		return 1;
+	phase_end(&mount, ef.dev);
 
+	phase_begin(&bitmap, ef.dev);
 	free_clusters = exfat_count_free_clusters(&ef);
 	free_sectors = (uint64_t) free_clusters << ef.sb->spc_bits;
+	phase_end(&bitmap, ef.dev);
 
-	printf("Volume label         %15s\n", exfat_get_label(&ef));
-	print_generic_info(ef.sb);
-	print_sector_info(ef.sb);
-	printf("Free sectors              %10"PRIu64"\n", free_sectors);
-	print_cluster_info(ef.sb);
-	printf("Free clusters             %10u\n", free_clusters);
-	print_other_info(ef.sb);
-	if (used_sectors)
-		dump_sectors(&ef);
+	if (json)
+	{
+		puts("{");
+		print_json_sb(spec, ef.sb);
+		fputs("\t\"label\": ", stdout);
+		exfat_print_json_string(stdout, exfat_get_label(&ef));
+		printf(",\n\t\"free_sectors\": %"PRIu64",\n", free_sectors);
+		printf("\t\"free_clusters\": %u,\n", free_clusters);
+		if (used_sectors)
+			dump_sectors(&ef, true);
+		print_json_errors();
+		puts("\t\"phases\":\n\t{");
+		print_json_phase("mount", &mount, ",");
+		print_json_phase("bitmap", &bitmap, "");
+		puts("\t}\n}");
+	}
+	else
+	{
+		printf("Volume label         %15s\n", exfat_get_label(&ef));
+		print_generic_info(ef.sb);
+		print_sector_info(ef.sb);
+		printf("Free sectors              %10"PRIu64"\n", free_sectors);
+		print_cluster_info(ef.sb);
+		printf("Free clusters             %10u\n", free_clusters);
+		print_other_info(ef.sb);
+		if (used_sectors)
+			dump_sectors(&ef, false);
+	}
 
 	exfat_unmount(&ef);
 	return 0;
 }
 
-static int dump_file_fragments(const char* spec, const char* path)
+static int dump_file_fragments(const char* spec, const char* path, bool json)
 {
 	struct exfat ef;
 	struct exfat_node* node;
@@ -150,9 +279,13 @@ static int dump_file_fragments(const char* spec, const char* path)
 	off_t remainder;
 	off_t fragment_size = 0;
 	int rc = 0;
+	struct dump_phase mount, chain;
+	const char* separator = "";
 
+	phase_begin(&mount, NULL);
 	if (exfat_mount(&ef, spec, "ro") != 0)
 		return 1;
+	phase_end(&mount, ef.dev);
 
 	rc = exfat_lookup(&ef, &node, path);
 	if (rc != 0)
@@ -162,6 +295,16 @@ static int dump_file_fragments(const char* spec, const char* path)
 		return 1;
 	}
 
+	if (json)
+	{
+		fputs("{\n\t\"device\": ", stdout);
+		exfat_print_json_string(stdout, spec);
+		fputs(",\n\t\"file\": ", stdout);
+		exfat_print_json_string(stdout, path);
+		fputs(",\n\t\"fragments\": [", stdout);
+	}
+
+	phase_begin(&chain, ef.dev);
 	cluster = fragment_start_cluster = node->start_cluster;
 	remainder = node->size;
 	while (remainder > 0)
@@ -183,23 +326,340 @@ static int dump_file_fragments(const char* spec, const char* path)
 		if (next_cluster != cluster + 1 || remainder == 0)
 		{
 			/* next cluster is not contiguous or this is EOF */
-			printf("%"PRIu64" %"PRIu64"\n",
-					exfat_c2o(&ef, fragment_start_cluster), fragment_size);
+			if (json)
+				printf("%s[%"PRIu64", %"PRIu64"]", separator,
+						exfat_c2o(&ef, fragment_start_cluster), fragment_size);
+			else
+				printf("%"PRIu64" %"PRIu64"\n",
+						exfat_c2o(&ef, fragment_start_cluster), fragment_size);
+			separator = ", ";
 			/* start a new fragment */
 			fragment_start_cluster = next_cluster;
 			fragment_size = 0;
 		}
 		cluster = next_cluster;
 	}
+	phase_end(&chain, ef.dev);
+
+	if (json)
+	{
+		puts("],");
+		print_json_errors();
+		puts("\t\"phases\":\n\t{");
+		print_json_phase("mount", &mount, ",");
+		print_json_phase("chain", &chain, "");
+		puts("\t}\n}");
+	}
 
 	exfat_put_node(&ef, node);
 	exfat_unmount(&ef);
 	return rc;
 }
 
+#define FRAG_BUCKETS 33		/* 1, 2, 3-4, 5-8 and so on up to 2^32 */
+
+struct frag_report
+{
+	struct exfat* ef;
+	le32_t* fat;
+	bool json;
+	const char* separator;		/* between files in JSON */
+	uint64_t files;
+	uint64_t fragmented;
+	uint64_t fragments;
+	uint64_t histogram[FRAG_BUCKETS];		/* files by fragments */
+	uint32_t free_clusters;
+	uint32_t free_extents;
+	uint32_t largest_free;
+	uint64_t free_histogram[FRAG_BUCKETS];	/* free extents by clusters */
+};
+
+static int frag_bucket(uint32_t n)
+{
+	return n <= 1 ? 0 : 32 - __builtin_clz(n - 1);
+}
+
+static void print_buckets(const uint64_t histogram[FRAG_BUCKETS],
+		const char* title, const char* what)
+{
+	int i;
+
+	printf("%-16s%10s\n", title, what);
+	for (i = 0; i < FRAG_BUCKETS; i++)
+	{
+		const uint64_t min = i == 0 ? 1 : (UINT64_C(1) << (i - 1)) + 1;
+		const uint64_t max = UINT64_C(1) << i;
+		char range[32];
+
+		if (histogram[i] == 0)
+			continue;
+		if (min == max)
+			snprintf(range, sizeof(range), "%"PRIu64, min);
+		else
+			snprintf(range, sizeof(range), "%"PRIu64"-%"PRIu64, min, max);
+		printf("%16s%10"PRIu64"\n", range, histogram[i]);
+	}
+}
+
+static void print_json_buckets(const uint64_t histogram[FRAG_BUCKETS],
+		const char* name, const char* what)
+{
+	const char* separator = "";
+	int i;
+
+	printf("\t\"%s\": [", name);
+	for (i = 0; i < FRAG_BUCKETS; i++)
+	{
+		const uint64_t min = i == 0 ? 1 : (UINT64_C(1) << (i - 1)) + 1;
+		const uint64_t max = UINT64_C(1) << i;
+
+		if (histogram[i] == 0)
+			continue;
+		printf("%s{\"min\": %"PRIu64", \"max\": %"PRIu64", \"%s\": %"PRIu64
+				"}", separator, min, max, what, histogram[i]);
+		separator = ", ";
+	}
+	puts("],");
+}
+
+/*
+	Counts the runs of consecutive clusters of a file through the FAT copy.
+	In JSON each run is printed as it is found.
+*/
+static uint32_t count_fragments(struct frag_report* report,
+		const struct exfat_node* node, const char* path)
+{
+	const struct exfat* ef = report->ef;
+	const uint32_t count = DIV_ROUND_UP(node->size, CLUSTER_SIZE(*ef->sb));
+	const char* separator = "";
+	cluster_t start = node->start_cluster;
+	cluster_t c = start;
+	uint32_t fragments = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		cluster_t next;
+
+		if (CLUSTER_INVALID(*ef->sb, c))
+		{
+			exfat_error("'%s' has invalid cluster %#x", path, c);
+			break;
+		}
+		next = node->is_contiguous ? c + 1 : le32_to_cpu(report->fat[c]);
+		if (next != c + 1 || i + 1 == count)
+		{
+			if (report->json)
+				printf("%s[%"PRIu64", %"PRIu64"]", separator,
+						exfat_c2o(ef, start),
+						(uint64_t) (c - start + 1) * CLUSTER_SIZE(*ef->sb));
+			separator = ", ";
+			fragments++;
+			start = next;
+		}
+		c = next;
+	}
+	return fragments;
+}
+
+static void report_node(struct frag_report* report,
+		const struct exfat_node* node, const char* path)
+{
+	const bool is_dir = node->attrib & EXFAT_ATTRIB_DIR;
+	uint32_t fragments;
+
+	if (node->size == 0)
+		return;
+
+	if (report->json)
+	{
+		printf("%s\n\t\t{\"path\": ", report->separator);
+		exfat_print_json_string(stdout, path);
+		printf(", \"directory\": %s, \"size\": %"PRIu64", \"extents\": [",
+				is_dir ? "true" : "false", node->size);
+		report->separator = ",";
+	}
+	fragments = count_fragments(report, node, path);
+	if (report->json)
+		printf("], \"fragments\": %u}", fragments);
+	else
+		printf("%10u %s%s\n", fragments, path, is_dir ? "/" : "");
+
+	report->files++;
+	report->fragments += fragments;
+	if (fragments > 1)
+		report->fragmented++;
+	report->histogram[frag_bucket(fragments)]++;
+}
+
+static void report_directory(struct frag_report* report,
+		struct exfat_node* dir, const char* path)
+{
+	const size_t length = strlen(path);
+	struct exfat_iterator it;
+	struct exfat_node* node;
+	char* subpath;
+
+	subpath = malloc(length + 1 + EXFAT_UTF8_NAME_BUFFER_MAX);
+	if (subpath == NULL)
+	{
+		exfat_error("out of memory");
+		return;
+	}
+	if (exfat_opendir(report->ef, dir, &it) != 0)
+	{
+		exfat_error("failed to read directory '%s'", path);
+		free(subpath);
+		return;
+	}
+	memcpy(subpath, path, length);
+	subpath[length] = '/';
+	while ((node = exfat_readdir(&it)) != NULL)
+	{
+		exfat_get_name(node, subpath + length + 1);
+		report_node(report, node, subpath);
+		if (node->attrib & EXFAT_ATTRIB_DIR)
+			report_directory(report, node, subpath);
+		exfat_put_node(report->ef, node);
+	}
+	exfat_closedir(report->ef, &it);
+	free(subpath);
+}
+
+/* Runs of free clusters in the bitmap. */
+static void report_free_space(struct frag_report* report)
+{
+	const struct exfat* ef = report->ef;
+	size_t start = 0;
+	size_t length = 0;
+
+	while (exfat_bmap_next_run(ef->cmap.chunk, ef->cmap.size, false, &start,
+			&length))
+	{
+		report->free_clusters += length;
+		report->free_extents++;
+		report->largest_free = MAX(report->largest_free, length);
+		report->free_histogram[frag_bucket(length)]++;
+	}
+}
+
+static double free_fragmentation(const struct frag_report* report)
+{
+	if (report->free_clusters == 0)
+		return 0;
+	return 100.0 * (1 - (double) report->largest_free /
+			report->free_clusters);
+}
+
+static void print_frag_summary(const struct frag_report* report)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*report->ef->sb);
+
+	printf("Files and directories     %10"PRIu64"\n", report->files);
+	printf("Fragmented                %10"PRIu64"\n", report->fragmented);
+	printf("Fragments                 %10"PRIu64"\n", report->fragments);
+	printf("Fragments per file        %10.2f\n", report->files != 0 ?
+			(double) report->fragments / report->files : 0);
+	print_buckets(report->histogram, "Fragments", "Files");
+	printf("Free clusters             %10u\n", report->free_clusters);
+	printf("Free extents              %10u\n", report->free_extents);
+	printf("Largest free extent       %10"PRIu64"\n",
+			(uint64_t) report->largest_free * cluster_size);
+	printf("Average free extent       %10"PRIu64"\n",
+			report->free_extents != 0 ? (uint64_t) report->free_clusters *
+			cluster_size / report->free_extents : 0);
+	printf("Free space fragmentation  %9.1f%%\n",
+			free_fragmentation(report));
+	print_buckets(report->free_histogram, "Free clusters", "Extents");
+}
+
+static void print_json_frag_summary(const struct frag_report* report)
+{
+	const uint32_t cluster_size = CLUSTER_SIZE(*report->ef->sb);
+
+	printf("\t\"files_count\": %"PRIu64",\n", report->files);
+	printf("\t\"fragmented_files\": %"PRIu64",\n", report->fragmented);
+	printf("\t\"fragments\": %"PRIu64",\n", report->fragments);
+	print_json_buckets(report->histogram, "fragments_histogram", "files");
+	printf("\t\"cluster_size\": %u,\n", cluster_size);
+	printf("\t\"free_clusters\": %u,\n", report->free_clusters);
+	printf("\t\"free_extents\": %u,\n", report->free_extents);
+	printf("\t\"largest_free_extent\": %"PRIu64",\n",
+			(uint64_t) report->largest_free * cluster_size);
+	printf("\t\"free_space_fragmentation\": %.1f,\n",
+			free_fragmentation(report));
+	print_json_buckets(report->free_histogram, "free_extents_histogram",
+			"extents");
+}
+
+/*
+	Fragmentation of every file and directory of the volume and of its free
+	space, with one mount and one read of the FAT for all of them.
+*/
+static int dump_fragmentation(const char* spec, bool json)
+{
+	struct exfat ef;
+	struct frag_report report;
+	struct dump_phase mount, fat, tree, bitmap;
+
+	memset(&report, 0, sizeof(report));
+	report.ef = &ef;
+	report.json = json;
+	report.separator = "";
+
+	phase_begin(&mount, NULL);
+	if (exfat_mount(&ef, spec, "ro") != 0)
+		return 1;
+	phase_end(&mount, ef.dev);
+
+	phase_begin(&fat, ef.dev);
+	report.fat = exfat_read_fat(&ef);
+	phase_end(&fat, ef.dev);
+	if (report.fat == NULL)
+	{
+		exfat_unmount(&ef);
+		return 1;
+	}
+
+	if (json)
+	{
+		fputs("{\n\t\"device\": ", stdout);
+		exfat_print_json_string(stdout, spec);
+		fputs(",\n\t\"files\": [", stdout);
+	}
+	phase_begin(&tree, ef.dev);
+	report_directory(&report, ef.root, "");
+	phase_end(&tree, ef.dev);
+	if (json)
+		puts("\n\t],");
+
+	phase_begin(&bitmap, ef.dev);
+	report_free_space(&report);
+	phase_end(&bitmap, ef.dev);
+
+	if (json)
+	{
+		print_json_frag_summary(&report);
+		print_json_errors();
+		puts("\t\"phases\":\n\t{");
+		print_json_phase("mount", &mount, ",");
+		print_json_phase("fat", &fat, ",");
+		print_json_phase("tree", &tree, ",");
+		print_json_phase("bitmap", &bitmap, "");
+		puts("\t}\n}");
+	}
+	else
+		print_frag_summary(&report);
+
+	free(report.fat);
+	exfat_unmount(&ef);
+	return exfat_errors != 0;
+}
+
 static void usage(const char* prog)
 {
-	fprintf(stderr, "Usage: %s [-s] [-u] [-f file] [-V] <device>\n", prog);
+	fprintf(stderr, "Usage: %s [-j] [-s] [-u] [-f file | -F] [-V] <device>\n",
+			prog);
 	exit(1);
 }
 
@@ -209,12 +669,17 @@ int main(int argc, char* argv[])
 	const char* spec = NULL;
 	bool sb_only = false;
 	bool used_sectors = false;
+	bool json = false;
+	bool fragmentation = false;
 	const char* file_path = NULL;
 
-	while ((opt = getopt(argc, argv, "suf:V")) != -1)
+	while ((opt = getopt(argc, argv, "jsuf:FV")) != -1)
 	{
 		switch (opt)
 		{
+		case 'j':
+			json = true;
+			break;
 		case 's':
 			sb_only = true;
 			break;
@@ -224,6 +689,9 @@ int main(int argc, char* argv[])
 		case 'f':
 			file_path = optarg;
 			break;
+		case 'F':
+			fragmentation = true;
+			break;
 		case 'V':
 			printf("dumpexfat %s\n", VERSION);
 			puts("Copyright (C) 2011-2018  Andrew Nayenko");
@@ -237,10 +705,13 @@ int main(int argc, char* argv[])
 	spec = argv[optind];
 
 	if (file_path)
-		return dump_file_fragments(spec, file_path);
+		return dump_file_fragments(spec, file_path, json);
+
+	if (fragmentation)
+		return dump_fragmentation(spec, json);
 
 	if (sb_only)
-		return dump_sb(spec);
+		return dump_sb(spec, json);
 
-	return dump_full(spec, used_sectors);
+	return dump_full(spec, used_sectors, json);
 }
@@ -20,129 +20,129 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#include "walk.h"
 #include <exfat.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <errno.h>
 
-#define exfat_debug(format, ...)
+#define FSCK_THREADS_MAX 16
 
-uint64_t files_count, directories_count;
-
-static int nodeck(struct exfat* ef, struct exfat_node* node)
+static unsigned default_threads(void)
 {
-	const cluster_t cluster_size = CLUSTER_SIZE(*ef->sb);
-	cluster_t clusters = DIV_ROUND_UP(node->size, cluster_size);
-	cluster_t c = node->start_cluster;
-	int rc = 0;
-
-	while (clusters--)
-	{
-		if (CLUSTER_INVALID(*ef->sb, c))
-		{
-			char name[EXFAT_UTF8_NAME_BUFFER_MAX];
-
-			exfat_get_name(node, name);
-			exfat_error("file '%s' has invalid cluster 0x%x", name, c);
-			rc = 1;
-			break;
-		}
-		if (BMAP_GET(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER) == 0)
-		{
-			char name[EXFAT_UTF8_NAME_BUFFER_MAX];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-			exfat_get_name(node, name);
-			exfat_error("cluster 0x%x of file '%s' is not allocated", c, name);
-			rc = 1;
-		}
-		c = exfat_next_cluster(ef, node, c);
-	}
-	return rc;
+	return cpus > 0 ? MIN(cpus, FSCK_THREADS_MAX) : 1;
 }
 
-static void dirck(struct exfat* ef, const char* path)
+struct fsck_report
+{
+	bool checked;
+	uint32_t cluster_count;
+	uint32_t cluster_size;
+	uint32_t free_clusters;
+	struct fsck_phase mount;
+	struct fsck_stats stats;
+};
+
+static void fsck(struct exfat* ef, const char* spec, const char* options,
+		bool quick, struct fsck_report* report)
 {
-	struct exfat_node* parent;
-	struct exfat_node* node;
-	struct exfat_iterator it;
-	int rc;
-	size_t path_length;
-	char* entry_path;
-
-	if (exfat_lookup(ef, &parent, path) != 0)
-		exfat_bug("directory '%s' is not found", path);
-	if (!(parent->attrib & EXFAT_ATTRIB_DIR))
-		exfat_bug("'%s' is not a directory (%#hx)", path, parent->attrib);
-	if (nodeck(ef, parent) != 0)
+	memset(report, 0, sizeof(struct fsck_report));
+	fsck_phase_begin(&report->mount, NULL);
+	if (exfat_mount(ef, spec, options) != 0)
 	{
-		exfat_put_node(ef, parent);
+		fsck_phase_end(&report->mount, NULL);
+		fputs("File system checking stopped. ", stdout);
 		return;
 	}
+	fsck_phase_end(&report->mount, ef->dev);
+
+	report->cluster_count = le32_to_cpu(ef->sb->cluster_count);
+	report->cluster_size = CLUSTER_SIZE(*ef->sb);
+	report->free_clusters = exfat_count_free_clusters(ef);
+	exfat_print_info(ef->sb, report->free_clusters);
+	report->checked = fsck_walk(ef, default_threads(), quick,
+			&report->stats) == 0;
+	exfat_unmount(ef);
 
-	path_length = strlen(path);
-	entry_path = malloc(path_length + 1 + EXFAT_UTF8_NAME_BUFFER_MAX);
-	if (entry_path == NULL)
-	{
-		exfat_put_node(ef, parent);
-		exfat_error("out of memory");
-		return;
-	}
-	strcpy(entry_path, path);
-	strcat(entry_path, "/");
+	printf("Totally %"PRIu64" directories and %"PRIu64" files.\n",
+			report->stats.directories, report->stats.files);
+	fputs("File system checking finished. ", stdout);
+}
+
+/*
+	With -j everything meant for people is sent to stderr, prompts
+	included, and stdout gets nothing but the JSON.
+*/
+static FILE* open_json(void)
+{
+	int fd;
+	FILE* json;
 
-	rc = exfat_opendir(ef, parent, &it);
-	if (rc != 0)
+	fflush(stdout);
+	fd = dup(STDOUT_FILENO);
+	if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
 	{
-		free(entry_path);
-		exfat_put_node(ef, parent);
-		return;
+		exfat_error("failed to redirect output: %s", strerror(errno));
+		exit(1);
 	}
-	while ((node = exfat_readdir(&it)))
+	json = fdopen(fd, "w");
+	if (json == NULL)
 	{
-		exfat_get_name(node, entry_path + path_length + 1);
-		exfat_debug("%s: %s, %"PRIu64" bytes, cluster %u", entry_path,
-				node->is_contiguous ? "contiguous" : "fragmented",
-				node->size, node->start_cluster);
-		if (node->attrib & EXFAT_ATTRIB_DIR)
-		{
-			directories_count++;
-			dirck(ef, entry_path);
-		}
-		else
-		{
-			files_count++;
-			nodeck(ef, node);
-		}
-		exfat_flush_node(ef, node);
-		exfat_put_node(ef, node);
+		exfat_error("failed to open JSON output: %s", strerror(errno));
+		exit(1);
 	}
-	exfat_closedir(ef, &it);
-	exfat_flush_node(ef, parent);
-	exfat_put_node(ef, parent);
-	free(entry_path);
+	return json;
 }
 
-static void fsck(struct exfat* ef, const char* spec, const char* options)
+static void print_json_phase(FILE* json, const char* name,
+		const struct fsck_phase* phase, const char* separator)
 {
-	if (exfat_mount(ef, spec, options) != 0)
-	{
-		fputs("File system checking stopped. ", stdout);
-		return;
-	}
-
-	exfat_print_info(ef->sb, exfat_count_free_clusters(ef));
-	dirck(ef, "");
-	exfat_unmount(ef);
+	fprintf(json, "\t\t\"%s\": {\"seconds\": %.6f, \"bytes_read\": %"PRIu64
+			", \"bytes_written\": %"PRIu64"}%s\n", name, phase->ns / 1e9,
+			phase->bytes_read, phase->bytes_written, separator);
+}
 
-	printf("Totally %"PRIu64" directories and %"PRIu64" files.\n",
-			directories_count, files_count);
-	fputs("File system checking finished. ", stdout);
+static void print_json(FILE* json, const char* spec,
+		const struct fsck_report* report)
+{
+	const struct fsck_stats* stats = &report->stats;
+
+	fputs("{\n\t\"device\": ", json);
+	exfat_print_json_string(json, spec);
+	fprintf(json, ",\n\t\"checked\": %s,\n",
+			report->checked ? "true" : "false");
+	fprintf(json, "\t\"cluster_size\": %u,\n", report->cluster_size);
+	fprintf(json, "\t\"clusters\": %u,\n", report->cluster_count);
+	fprintf(json, "\t\"free_clusters\": %u,\n", report->free_clusters);
+	fprintf(json, "\t\"directories\": %"PRIu64",\n", stats->directories);
+	fprintf(json, "\t\"files\": %"PRIu64",\n", stats->files);
+	fprintf(json, "\t\"cross_linked_clusters\": %u,\n",
+			stats->cross_linked);
+	fprintf(json, "\t\"lost_clusters\": %u,\n", stats->leaked);
+	fprintf(json, "\t\"lost_clusters_exact\": %s,\n",
+			stats->incomplete ? "false" : "true");
+	fprintf(json, "\t\"unallocated_clusters\": %u,\n", stats->unallocated);
+	fprintf(json, "\t\"bitmap_rebuilt\": %s,\n",
+			stats->bitmap_rebuilt ? "true" : "false");
+	fprintf(json, "\t\"errors\": %d,\n", exfat_errors);
+	fprintf(json, "\t\"errors_fixed\": %d,\n", exfat_errors_fixed);
+	fputs("\t\"phases\":\n\t{\n", json);
+	print_json_phase(json, "mount", &report->mount, ",");
+	print_json_phase(json, "fat", &stats->fat, ",");
+	print_json_phase(json, "tree", &stats->tree, ",");
+	print_json_phase(json, "bitmap", &stats->bitmap, "");
+	fputs("\t}\n}\n", json);
+	fflush(json);
 }
 
 static void usage(const char* prog)
 {
-	fprintf(stderr, "Usage: %s [-a | -n | -p | -y] <device>\n", prog);
+	fprintf(stderr, "Usage: %s [-a | -n | -p | -q | -y] [-j] <device>\n",
+			prog);
 	fprintf(stderr, "       %s -V\n", prog);
 	exit(1);
 }
@@ -152,16 +152,17 @@ int main(int argc, char* argv[])
 	int opt;
 	const char* options;
 	const char* spec = NULL;
+	bool quick = false;
+	FILE* json = NULL;
 	struct exfat ef;
-
-	printf("exfatfsck %s\n", VERSION);
+	struct fsck_report report;
 
 	if (isatty(STDIN_FILENO))
 		options = "repair=1";
 	else
 		options = "repair=0";
 
-	while ((opt = getopt(argc, argv, "anpVy")) != -1)
+	while ((opt = getopt(argc, argv, "ajnpqVy")) != -1)
 	{
 		switch (opt)
 		{
@@ -170,10 +171,18 @@ int main(int argc, char* argv[])
 		case 'y':
 			options = "repair=2";
 			break;
+		case 'j':
+			json = stdout;
+			break;
 		case 'n':
 			options = "repair=0,ro";
 			break;
+		case 'q':
+			options = "repair=0,ro";
+			quick = true;
+			break;
 		case 'V':
+			printf("exfatfsck %s\n", VERSION);
 			puts("Copyright (C) 2011-2018  Andrew Nayenko");
 			return 0;
 		default:
@@ -185,8 +194,13 @@ int main(int argc, char* argv[])
 		usage(argv[0]);
 	spec = argv[optind];
 
+	if (json != NULL)
+		json = open_json();
+	printf("exfatfsck %s\n", VERSION);
 	printf("Checking file system on %s.\n", spec);
-	fsck(&ef, spec, options);
+	fsck(&ef, spec, options, quick, &report);
+	if (json != NULL)
+		print_json(json, spec, &report);
 	if (exfat_errors != 0)
 	{
 		printf("ERRORS FOUND: %d, FIXED: %d.\n",
@@ -0,0 +1,848 @@
+/*
+	walk.c (10.02.19)
+	Parallel file system tree walk for exfatfsck.
+
+	Free exFAT implementation.
+	Copyright (C) 2011-2018  Andrew Nayenko
+	Copyright (C) 2018-2019  Paul Ciarlo
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	The tree is checked breadth first: directories found are put at the end
+	of a queue that a number of threads take them from. Each thread reads the
+	whole directory with as few reads as its chain allows and parses the
+	entries itself, without the node cache, which is not thread safe. Chains
+	are followed through a copy of the FAT read once at the start, and every
+	cluster they pass is claimed in a bitmap of our own, so that clusters
+	used twice or by nothing at all can be found.
+
+	For a quick check of a disk that seeks slowly the directories are taken
+	in the order they lie on the disk instead, by one thread, sweeping from
+	the start of the clusters heap to its end and then over again for the
+	ones found behind the last position.
+*/
+
+#include "walk.h"
+#include <pthread.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#define DIRECTORY_SIZE_MAX (256 * 1024 * 1024)	/* as the specification says */
+#define ROOT_PATH ""
+#define LEAKED_RANGES_SHOWN 10
+
+struct fsck_dir
+{
+	struct fsck_dir* next;
+	cluster_t start_cluster;
+	uint64_t size;
+	bool is_contiguous;
+	bool is_root;
+	char path[];
+};
+
+struct fsck_heap					/* directories by start cluster */
+{
+	struct fsck_dir** dirs;
+	size_t count;
+	size_t capacity;
+};
+
+struct fsck_walk
+{
+	struct exfat* ef;
+	le32_t* fat;
+	bitmap_t* claimed;
+	bool physical_order;
+	struct fsck_dir* head;		/* breadth first */
+	struct fsck_dir* tail;
+	struct fsck_heap ahead;		/* physical order, not passed yet */
+	struct fsck_heap behind;	/* physical order, for the next sweep */
+	cluster_t position;
+	unsigned busy;				/* directories taken but not finished yet */
+	bool incomplete;			/* something was not followed */
+	pthread_mutex_t lock;		/* guards everything above and messages */
+	pthread_cond_t cond;
+	struct fsck_stats stats;
+};
+
+/* messages from different threads must not mix */
+#define walk_error(walk, ...) \
+	do \
+	{ \
+		pthread_mutex_lock(&(walk)->lock); \
+		exfat_error(__VA_ARGS__); \
+		pthread_mutex_unlock(&(walk)->lock); \
+	} \
+	while (0)
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+	The counters start negative so that the end only has to add. A phase
+	that opens the device begins with dev NULL: its counters start at zero.
+*/
+void fsck_phase_begin(struct fsck_phase* phase, const struct exfat_dev* dev)
+{
+	uint64_t read = 0, written = 0;
+
+	if (dev != NULL)
+		exfat_get_io_bytes(dev, &read, &written);
+	phase->ns = -now_ns();
+	phase->bytes_read = -read;
+	phase->bytes_written = -written;
+}
+
+void fsck_phase_end(struct fsck_phase* phase, const struct exfat_dev* dev)
+{
+	uint64_t read = 0, written = 0;
+
+	if (dev != NULL)
+		exfat_get_io_bytes(dev, &read, &written);
+	phase->ns += now_ns();
+	phase->bytes_read += read;
+	phase->bytes_written += written;
+}
+
+/* Clusters of whatever was skipped are not claimed. */
+static void mark_incomplete(struct fsck_walk* walk)
+{
+	__atomic_store_n(&walk->incomplete, true, __ATOMIC_RELAXED);
+}
+
+/* Returns true if somebody has claimed the cluster already. */
+static bool claim(struct fsck_walk* walk, cluster_t cluster)
+{
+	const size_t index = cluster - EXFAT_FIRST_DATA_CLUSTER;
+	const bitmap_t mask = BMAP_MASK(index);
+
+	return __atomic_fetch_or(&walk->claimed[BMAP_BLOCK(index)], mask,
+			__ATOMIC_RELAXED) & mask;
+}
+
+static bool is_claimed(struct fsck_walk* walk, cluster_t cluster)
+{
+	const size_t index = cluster - EXFAT_FIRST_DATA_CLUSTER;
+
+	return __atomic_load_n(&walk->claimed[BMAP_BLOCK(index)],
+			__ATOMIC_RELAXED) & BMAP_MASK(index);
+}
+
+/*
+	Follows the chain of a file or a directory through the FAT copy, checks
+	that every cluster of it is valid and allocated and claims it. If
+	clusters is not NULL the chain is stored there. Returns false if the
+	chain breaks off before its end.
+*/
+static bool check_chain(struct fsck_walk* walk, const char* path,
+		cluster_t start_cluster, uint64_t size, bool is_contiguous,
+		cluster_t* clusters)
+{
+	const struct exfat* ef = walk->ef;
+	uint32_t count = DIV_ROUND_UP(size, CLUSTER_SIZE(*ef->sb));
+	cluster_t c = start_cluster;
+	uint32_t shared = 0;
+	cluster_t first_shared = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (CLUSTER_INVALID(*ef->sb, c))
+		{
+			walk_error(walk, "file '%s' has invalid cluster 0x%x", path, c);
+			mark_incomplete(walk);
+			return false;
+		}
+		if (BMAP_GET(ef->cmap.chunk, c - EXFAT_FIRST_DATA_CLUSTER) == 0)
+		{
+			walk_error(walk, "cluster 0x%x of file '%s' is not allocated",
+					c, path);
+			__atomic_add_fetch(&walk->stats.unallocated, 1, __ATOMIC_RELAXED);
+		}
+		if (claim(walk, c) && shared++ == 0)
+			first_shared = c;
+		if (clusters != NULL)
+			clusters[i] = c;
+		c = is_contiguous ? c + 1 : le32_to_cpu(walk->fat[c]);
+	}
+	if (shared != 0)
+	{
+		pthread_mutex_lock(&walk->lock);
+		exfat_error("file '%s' shares %u cluster(s) with other files, "
+				"starting with 0x%x", path, shared, first_shared);
+		walk->stats.cross_linked += shared;
+		pthread_mutex_unlock(&walk->lock);
+	}
+	return true;
+}
+
+static int heap_push(struct fsck_heap* heap, struct fsck_dir* dir)
+{
+	size_t i;
+
+	if (heap->count == heap->capacity)
+	{
+		size_t capacity = heap->capacity != 0 ? 2 * heap->capacity : 64;
+		struct fsck_dir** dirs = realloc(heap->dirs,
+				capacity * sizeof(struct fsck_dir*));
+
+		if (dirs == NULL)
+			return 1;
+		heap->dirs = dirs;
+		heap->capacity = capacity;
+	}
+	for (i = heap->count++; i > 0; i = (i - 1) / 2)
+	{
+		struct fsck_dir* parent = heap->dirs[(i - 1) / 2];
+
+		if (parent->start_cluster <= dir->start_cluster)
+			break;
+		heap->dirs[i] = parent;
+	}
+	heap->dirs[i] = dir;
+	return 0;
+}
+
+static struct fsck_dir* heap_pop(struct fsck_heap* heap)
+{
+	struct fsck_dir* top = heap->dirs[0];
+	struct fsck_dir* last = heap->dirs[--heap->count];
+	size_t i = 0;
+
+	for (;;)
+	{
+		size_t child = 2 * i + 1;
+
+		if (child >= heap->count)
+			break;
+		if (child + 1 < heap->count && heap->dirs[child + 1]->start_cluster <
+				heap->dirs[child]->start_cluster)
+			child++;
+		if (last->start_cluster <= heap->dirs[child]->start_cluster)
+			break;
+		heap->dirs[i] = heap->dirs[child];
+		i = child;
+	}
+	if (heap->count != 0)
+		heap->dirs[i] = last;
+	return top;
+}
+
+/* Both of these are called with the lock held. */
+static int queue_push(struct fsck_walk* walk, struct fsck_dir* dir)
+{
+	if (walk->physical_order)
+		return heap_push(dir->start_cluster >= walk->position ?
+				&walk->ahead : &walk->behind, dir);
+
+	dir->next = NULL;
+	if (walk->tail != NULL)
+		walk->tail->next = dir;
+	else
+		walk->head = dir;
+	walk->tail = dir;
+	return 0;
+}
+
+static struct fsck_dir* queue_pop(struct fsck_walk* walk)
+{
+	struct fsck_dir* dir;
+
+	if (walk->physical_order)
+	{
+		if (walk->ahead.count == 0)
+		{
+			/* start the next sweep */
+			struct fsck_heap swap = walk->ahead;
+
+			walk->ahead = walk->behind;
+			walk->behind = swap;
+		}
+		if (walk->ahead.count == 0)
+			return NULL;
+		dir = heap_pop(&walk->ahead);
+		walk->position = dir->start_cluster;
+		return dir;
+	}
+
+	dir = walk->head;
+	if (dir != NULL)
+	{
+		walk->head = dir->next;
+		if (walk->head == NULL)
+			walk->tail = NULL;
+	}
+	return dir;
+}
+
+static int enqueue(struct fsck_walk* walk, const char* path,
+		cluster_t start_cluster, uint64_t size, bool is_contiguous,
+		bool is_root)
+{
+	struct fsck_dir* dir = malloc(sizeof(struct fsck_dir) + strlen(path) + 1);
+
+	if (dir == NULL)
+	{
+		walk_error(walk, "failed to queue directory '%s'", path);
+		mark_incomplete(walk);
+		return 1;
+	}
+	dir->start_cluster = start_cluster;
+	dir->size = size;
+	dir->is_contiguous = is_contiguous;
+	dir->is_root = is_root;
+	strcpy(dir->path, path);
+
+	pthread_mutex_lock(&walk->lock);
+	if (queue_push(walk, dir) != 0)
+	{
+		exfat_error("failed to queue directory '%s'", path);
+		pthread_mutex_unlock(&walk->lock);
+		free(dir);
+		mark_incomplete(walk);
+		return 1;
+	}
+	pthread_cond_signal(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return 0;
+}
+
+static off_t entry_offset(const struct fsck_walk* walk,
+		const cluster_t* clusters, uint32_t index)
+{
+	const uint32_t per_cluster =
+			CLUSTER_SIZE(*walk->ef->sb) / sizeof(struct exfat_entry);
+
+	return exfat_c2o(walk->ef, clusters[index / per_cluster]) +
+			(off_t) (index % per_cluster) * sizeof(struct exfat_entry);
+}
+
+static bool fix_entry(struct fsck_walk* walk, const cluster_t* clusters,
+		uint32_t index, const struct exfat_entry* entry)
+{
+	if (!exfat_ask_to_fix(walk->ef))
+		return false;
+	if (exfat_pwrite(walk->ef->dev, entry, sizeof(struct exfat_entry),
+			entry_offset(walk, clusters, index)) !=
+			sizeof(struct exfat_entry))
+	{
+		exfat_error("failed to write fixed entry");
+		return false;
+	}
+	exfat_errors_fixed++;
+	return true;
+}
+
+/* Number of entries in the set starting at entries[0], at least 1. */
+static uint32_t entry_set_length(const struct exfat_entry* entries,
+		uint32_t available)
+{
+	const struct exfat_entry_meta1* meta1 =
+			(const struct exfat_entry_meta1*) entries;
+	uint32_t n = 1;
+
+	while (n < available && n <= meta1->continuations &&
+			(entries[n].type & EXFAT_ENTRY_CONTINUED))
+		n++;
+	return n;
+}
+
+static bool check_entry_types(struct fsck_walk* walk, const char* path,
+		const struct exfat_entry* entries, uint32_t n)
+{
+	uint32_t i;
+
+	if (entries[1].type != EXFAT_ENTRY_FILE_INFO ||
+			entries[2].type != EXFAT_ENTRY_FILE_NAME)
+	{
+		walk_error(walk, "'%s' has unexpected entry types %#x, %#x after "
+				"%#x", path, entries[1].type, entries[2].type,
+				entries[0].type);
+		return false;
+	}
+	for (i = 3; i < n; i++)
+		if (entries[i].type < EXFAT_ENTRY_FILE_TAIL &&
+				!(entries[i].type == EXFAT_ENTRY_FILE_NAME &&
+				  entries[i - 1].type == EXFAT_ENTRY_FILE_NAME))
+		{
+			walk_error(walk, "'%s' has unexpected entry type %#x after %#x "
+					"at %u/%u", path, entries[i].type, entries[i - 1].type,
+					i, n);
+			return false;
+		}
+	return true;
+}
+
+/*
+	Checks the file or directory described by the entry set starting at
+	entries[index] the way the node cache would when it loads it. Fills in
+	the tail of path with its name. Returns the number of entries used.
+*/
+static uint32_t check_entry_set(struct fsck_walk* walk,
+		const struct fsck_dir* dir, struct exfat_entry* entries,
+		uint32_t index, uint32_t count, const cluster_t* clusters,
+		char* path, char* name)
+{
+	const struct exfat* ef = walk->ef;
+	struct exfat_entry* set = entries + index;
+	struct exfat_entry_meta1* meta1 = (struct exfat_entry_meta1*) set;
+	const struct exfat_entry_meta2* meta2 =
+			(const struct exfat_entry_meta2*) (set + 1);
+	const uint64_t clusters_heap_size =
+			(uint64_t) le32_to_cpu(ef->sb->cluster_count) * CLUSTER_SIZE(*ef->sb);
+	const uint32_t n = entry_set_length(set, count - index);
+	le16_t name16[EXFAT_NAME_MAX + 1];
+	uint32_t names, i;
+	uint16_t attrib;
+	uint64_t size;
+	cluster_t start_cluster;
+	bool is_contiguous;
+	le16_t checksum;
+	bool ok = true;
+
+	strcpy(name, "?");
+	if (n != 1u + meta1->continuations || n < 3)
+	{
+		walk_error(walk, "entry set at %u in '%s' is cut short (%u of %u "
+				"entries)", index, dir->path, n, 1u + meta1->continuations);
+		goto skip;
+	}
+	if (!check_entry_types(walk, dir->path, set, n))
+		goto skip;
+
+	memset(name16, 0, sizeof(name16));
+	names = MIN(DIV_ROUND_UP(meta2->name_length, EXFAT_ENAME_MAX), n - 2);
+	for (i = 0; i < names; i++)
+		memcpy(name16 + i * EXFAT_ENAME_MAX,
+				((const struct exfat_entry_name*) &set[2 + i])->name,
+				EXFAT_ENAME_MAX * sizeof(le16_t));
+	if (utf16_to_utf8(name, name16, EXFAT_UTF8_NAME_BUFFER_MAX,
+			EXFAT_NAME_MAX) != 0)
+		strcpy(name, "?");
+
+	if (meta2->flags & ~(EXFAT_FLAG_ALWAYS1 | EXFAT_FLAG_CONTIGUOUS))
+	{
+		walk_error(walk, "'%s' has unknown flags in meta2 (%#hhx)", path,
+				meta2->flags);
+		goto skip;
+	}
+	if (n < 2 + DIV_ROUND_UP(meta2->name_length, EXFAT_ENAME_MAX))
+	{
+		walk_error(walk, "'%s' has too few continuations (%hhu < %d)", path,
+				meta1->continuations,
+				1 + DIV_ROUND_UP(meta2->name_length, EXFAT_ENAME_MAX));
+		goto skip;
+	}
+
+	/* if the checksum is wrong the rest is probably garbage */
+	checksum = exfat_calc_checksum(set, n);
+	if (le16_to_cpu(checksum) != le16_to_cpu(meta1->checksum))
+	{
+		bool fixed;
+
+		pthread_mutex_lock(&walk->lock);
+		exfat_error("'%s' has invalid checksum (%#hx != %#hx)", path,
+				le16_to_cpu(checksum), le16_to_cpu(meta1->checksum));
+		meta1->checksum = checksum;
+		fixed = fix_entry(walk, clusters, index, set);
+		pthread_mutex_unlock(&walk->lock);
+		if (!fixed)
+			goto skip;
+	}
+
+	attrib = le16_to_cpu(meta1->attrib);
+	size = le64_to_cpu(meta2->size);
+	start_cluster = le32_to_cpu(meta2->start_cluster);
+	is_contiguous = (meta2->flags & EXFAT_FLAG_CONTIGUOUS) != 0;
+
+	if (le64_to_cpu(meta2->valid_size) > size)
+	{
+		walk_error(walk, "'%s' has valid size (%"PRIu64") greater than size "
+				"(%"PRIu64")", path, le64_to_cpu(meta2->valid_size), size);
+		ok = false;
+	}
+	if (size == 0 && start_cluster != EXFAT_CLUSTER_FREE)
+	{
+		walk_error(walk, "'%s' is empty but start cluster is %#x", path,
+				start_cluster);
+		ok = false;
+	}
+	if (size > 0 && CLUSTER_INVALID(*ef->sb, start_cluster))
+	{
+		walk_error(walk, "'%s' points to invalid cluster %#x", path,
+				start_cluster);
+		ok = false;
+	}
+	if (size > clusters_heap_size)
+	{
+		walk_error(walk, "'%s' is larger than clusters heap: %"PRIu64" > "
+				"%"PRIu64, path, size, clusters_heap_size);
+		ok = false;
+	}
+	if (size == 0 && is_contiguous)
+	{
+		walk_error(walk, "'%s' is empty but marked as contiguous (%#hx)",
+				path, attrib);
+		ok = false;
+	}
+	if ((attrib & EXFAT_ATTRIB_DIR) && size % CLUSTER_SIZE(*ef->sb) != 0)
+	{
+		walk_error(walk, "'%s' directory size %"PRIu64" is not divisible by "
+				"%d", path, size, CLUSTER_SIZE(*ef->sb));
+		ok = false;
+	}
+
+	if (attrib & EXFAT_ATTRIB_DIR)
+	{
+		__atomic_add_fetch(&walk->stats.directories, 1, __ATOMIC_RELAXED);
+		if (!ok)
+			goto skip;
+		enqueue(walk, path, start_cluster, size, is_contiguous, false);
+	}
+	else
+	{
+		__atomic_add_fetch(&walk->stats.files, 1, __ATOMIC_RELAXED);
+		if (!ok)
+			goto skip;
+		check_chain(walk, path, start_cluster, size, is_contiguous, NULL);
+	}
+	return n;
+
+skip:
+	/* what it points to is not to be trusted, so it is not followed */
+	mark_incomplete(walk);
+	return n;
+}
+
+/* The clusters bitmap and the upcase table are only reachable from here. */
+static void claim_system_entry(struct fsck_walk* walk,
+		const struct exfat_entry* entry)
+{
+	const struct exfat_entry_bitmap* bitmap =
+			(const struct exfat_entry_bitmap*) entry;
+	const struct exfat_entry_upcase* upcase =
+			(const struct exfat_entry_upcase*) entry;
+
+	/* mount has checked them already */
+	if (entry->type == EXFAT_ENTRY_BITMAP)
+		check_chain(walk, "(clusters bitmap)",
+				le32_to_cpu(bitmap->start_cluster), le64_to_cpu(bitmap->size),
+				false, NULL);
+	else
+		check_chain(walk, "(upcase table)",
+				le32_to_cpu(upcase->start_cluster), le64_to_cpu(upcase->size),
+				false, NULL);
+}
+
+static int read_directory(struct fsck_walk* walk, const struct fsck_dir* dir,
+		const cluster_t* clusters, uint32_t count, void* buffer)
+{
+	const size_t cluster_size = CLUSTER_SIZE(*walk->ef->sb);
+	uint32_t i, j;
+
+	/* one read for every run of consecutive clusters */
+	for (i = 0; i < count; i = j)
+	{
+		for (j = i + 1; j < count && clusters[j] == clusters[j - 1] + 1; j++);
+		if (exfat_pread(walk->ef->dev, (char*) buffer + i * cluster_size,
+				(j - i) * cluster_size, exfat_c2o(walk->ef, clusters[i])) !=
+				(ssize_t) ((j - i) * cluster_size))
+		{
+			walk_error(walk, "failed to read directory '%s' (%u clusters "
+					"from 0x%x)", dir->path, j - i, clusters[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void check_directory(struct fsck_walk* walk, const struct fsck_dir* dir)
+{
+	const size_t cluster_size = CLUSTER_SIZE(*walk->ef->sb);
+	const uint32_t count = dir->size / cluster_size;
+	const uint32_t entries_count = dir->size / sizeof(struct exfat_entry);
+	const size_t path_length = strlen(dir->path);
+	cluster_t* clusters = NULL;
+	struct exfat_entry* entries = NULL;
+	char* path = NULL;
+	uint32_t i;
+
+	if (dir->size > DIRECTORY_SIZE_MAX)
+	{
+		walk_error(walk, "directory '%s' is too large (%"PRIu64" bytes)",
+				dir->path, dir->size);
+		mark_incomplete(walk);
+		return;
+	}
+	clusters = malloc(MAX(count, 1) * sizeof(cluster_t));
+	entries = malloc(MAX(dir->size, 1));
+	path = malloc(path_length + 1 + EXFAT_UTF8_NAME_BUFFER_MAX);
+	if (clusters == NULL || entries == NULL || path == NULL)
+	{
+		walk_error(walk, "out of memory");
+		mark_incomplete(walk);
+		goto out;
+	}
+	/*
+		A directory whose chain is already taken may well be one of its own
+		ancestors, and reading it would walk in circles.
+	*/
+	if (count != 0 && !CLUSTER_INVALID(*walk->ef->sb, dir->start_cluster) &&
+			is_claimed(walk, dir->start_cluster))
+	{
+		pthread_mutex_lock(&walk->lock);
+		exfat_error("directory '%s' starts at cluster 0x%x, which is used "
+				"by something else already", dir->path, dir->start_cluster);
+		walk->stats.cross_linked++;
+		pthread_mutex_unlock(&walk->lock);
+		mark_incomplete(walk);
+		goto out;
+	}
+	if (!check_chain(walk, dir->path, dir->start_cluster, dir->size,
+			dir->is_contiguous, clusters))
+		goto out;
+	if (read_directory(walk, dir, clusters, count, entries) != 0)
+	{
+		mark_incomplete(walk);
+		goto out;
+	}
+
+	strcpy(path, dir->path);
+	strcat(path, "/");
+	for (i = 0; i < entries_count; i++)
+	{
+		switch (entries[i].type)
+		{
+		case EXFAT_ENTRY_FILE:
+			i += check_entry_set(walk, dir, entries, i, entries_count,
+					clusters, path, path + path_length + 1) - 1;
+			break;
+
+		case EXFAT_ENTRY_BITMAP:
+		case EXFAT_ENTRY_UPCASE:
+			if (dir->is_root)
+				claim_system_entry(walk, &entries[i]);
+			break;
+
+		case EXFAT_ENTRY_LABEL:
+			break;
+
+		default:
+			if (!(entries[i].type & EXFAT_ENTRY_VALID))
+				break; /* deleted entry, ignore it */
+
+			pthread_mutex_lock(&walk->lock);
+			exfat_error("unknown entry type %#hhx at %u in '%s'",
+					entries[i].type, i, dir->path);
+			entries[i].type &= ~EXFAT_ENTRY_VALID;
+			fix_entry(walk, clusters, i, &entries[i]);
+			pthread_mutex_unlock(&walk->lock);
+			break;
+		}
+	}
+
+out:
+	free(path);
+	free(entries);
+	free(clusters);
+}
+
+static void* worker(void* arg)
+{
+	struct fsck_walk* walk = arg;
+
+	pthread_mutex_lock(&walk->lock);
+	for (;;)
+	{
+		struct fsck_dir* dir;
+
+		while ((dir = queue_pop(walk)) == NULL && walk->busy != 0)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		if (dir == NULL)
+			break; /* nothing queued and nothing that could queue more */
+
+		walk->busy++;
+		pthread_mutex_unlock(&walk->lock);
+
+		check_directory(walk, dir);
+		free(dir);
+
+		pthread_mutex_lock(&walk->lock);
+		if (--walk->busy == 0)
+			pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+/* Allocated clusters nobody has claimed, in ranges. */
+static uint32_t report_leaked(const struct fsck_walk* walk)
+{
+	const bitmap_t* cmap = walk->ef->cmap.chunk;
+	const uint32_t cluster_count = le32_to_cpu(walk->ef->sb->cluster_count);
+	const size_t words = BMAP_SIZE(cluster_count) / sizeof(bitmap_t);
+	bitmap_t* lost;
+	uint32_t leaked = 0;
+	uint32_t ranges = 0;
+	size_t start = 0;
+	size_t length = 0;
+	size_t i;
+
+	lost = malloc(words * sizeof(bitmap_t));
+	if (lost == NULL)
+	{
+		exfat_error("failed to allocate lost clusters bitmap");
+		return 0;
+	}
+	for (i = 0; i < words; i++)
+		lost[i] = cmap[i] & ~walk->claimed[i];
+	while (exfat_bmap_next_run(lost, cluster_count, true, &start, &length))
+	{
+		if (ranges++ < LEAKED_RANGES_SHOWN)
+			exfat_warn("clusters 0x%zx-0x%zx are lost",
+					start + EXFAT_FIRST_DATA_CLUSTER,
+					start + length - 1 + EXFAT_FIRST_DATA_CLUSTER);
+		leaked += length;
+	}
+	if (ranges > LEAKED_RANGES_SHOWN)
+		exfat_warn("and %u more ranges of lost clusters",
+				ranges - LEAKED_RANGES_SHOWN);
+	free(lost);
+	return leaked;
+}
+
+/*
+	Replaces the clusters bitmap with the one the walk has built, which
+	frees lost clusters and marks the ones in use that were not. Only done
+	when the whole tree was followed, or whatever was skipped would be
+	freed too.
+*/
+static void rebuild_bitmap(struct fsck_walk* walk)
+{
+	struct exfat* ef = walk->ef;
+	const uint32_t cluster_count = le32_to_cpu(ef->sb->cluster_count);
+	const size_t words = BMAP_SIZE(cluster_count) / sizeof(bitmap_t);
+
+	if (walk->incomplete)
+	{
+		exfat_warn("not rebuilding clusters bitmap: some files or "
+				"directories could not be followed");
+		return;
+	}
+	puts("Rebuilding clusters bitmap from the clusters in use.");
+	if (!exfat_ask_to_fix(ef))
+		return;
+
+	/* the bits past the last cluster are kept as they are */
+	if (cluster_count % (sizeof(bitmap_t) * 8) != 0)
+		walk->claimed[words - 1] |= ef->cmap.chunk[words - 1] &
+				~(BMAP_MASK(cluster_count) - 1);
+	memcpy(ef->cmap.chunk, walk->claimed, words * sizeof(bitmap_t));
+	ef->cmap.dirty = true;
+	if (exfat_flush(ef) != 0)
+		return;
+	exfat_errors_fixed += walk->stats.unallocated +
+			(walk->stats.leaked != 0 ? 1 : 0);
+	walk->stats.bitmap_rebuilt = true;
+}
+
+int fsck_walk(struct exfat* ef, unsigned threads, bool physical_order,
+		struct fsck_stats* stats)
+{
+	struct fsck_walk walk;
+	pthread_t tids[threads != 0 ? threads : 1];
+	unsigned started = 0;
+	unsigned t;
+	int rc = 1;
+
+	/* write out what mount has fixed in the root directory already */
+	if (exfat_flush_nodes(ef) != 0)
+		return 1;
+
+	memset(&walk, 0, sizeof(walk));
+	walk.ef = ef;
+	walk.physical_order = physical_order;
+	pthread_mutex_init(&walk.lock, NULL);
+	pthread_cond_init(&walk.cond, NULL);
+
+	/* the block cache of ublio is not to be shared between threads, and
+	   more than one reader would spoil the physical order */
+	if (exfat_get_fd(ef->dev) == -1 || physical_order)
+		threads = 1;
+
+	walk.claimed = calloc(1, BMAP_SIZE(le32_to_cpu(ef->sb->cluster_count)));
+	if (walk.claimed == NULL)
+	{
+		exfat_error("failed to allocate claimed clusters bitmap");
+		goto out;
+	}
+	fsck_phase_begin(&walk.stats.fat, ef->dev);
+	walk.fat = exfat_read_fat(ef);
+	fsck_phase_end(&walk.stats.fat, ef->dev);
+	if (walk.fat == NULL)
+		goto out;
+	if (enqueue(&walk, ROOT_PATH, ef->root->start_cluster, ef->root->size,
+			ef->root->is_contiguous, true) != 0)
+		goto out;
+
+	fsck_phase_begin(&walk.stats.tree, ef->dev);
+
+	for (t = 1; t < threads; t++)
+		if (pthread_create(&tids[started], NULL, worker, &walk) == 0)
+			started++;
+	worker(&walk);
+	for (t = 0; t < started; t++)
+		pthread_join(tids[t], NULL);
+	fsck_phase_end(&walk.stats.tree, ef->dev);
+
+	fsck_phase_begin(&walk.stats.bitmap, ef->dev);
+	walk.stats.leaked = report_leaked(&walk);
+	walk.stats.incomplete = walk.incomplete;
+	/* clusters of whatever was not followed look lost too */
+	if (walk.stats.leaked != 0 && walk.incomplete)
+		exfat_warn("%u cluster(s) allocated but not used by anything found "
+				"(not all files and directories could be followed)",
+				walk.stats.leaked);
+	else if (walk.stats.leaked != 0)
+		exfat_error("%u cluster(s) allocated but not used by anything",
+				walk.stats.leaked);
+	if (walk.stats.cross_linked != 0)
+		exfat_warn("%u cluster(s) are used by more than one file",
+				walk.stats.cross_linked);
+	if ((walk.stats.leaked != 0 || walk.stats.unallocated != 0) &&
+			ef->repair == EXFAT_REPAIR_YES)
+		rebuild_bitmap(&walk);
+	fsck_phase_end(&walk.stats.bitmap, ef->dev);
+	rc = 0;
+
+out:
+	*stats = walk.stats;
+	free(walk.ahead.dirs);
+	free(walk.behind.dirs);
+	free(walk.fat);
+	free(walk.claimed);
+	pthread_cond_destroy(&walk.cond);
+	pthread_mutex_destroy(&walk.lock);
+	return rc;
+}
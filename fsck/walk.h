@@ -0,0 +1,55 @@
+/*
+	walk.h (10.02.19)
+	Parallel file system tree walk for exfatfsck.
+
+	Free exFAT implementation.
+	Copyright (C) 2011-2018  Andrew Nayenko
+	Copyright (C) 2018-2019  Paul Ciarlo
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FSCK_WALK_H_INCLUDED
+#define FSCK_WALK_H_INCLUDED
+
+#include <exfat.h>
+
+struct fsck_phase
+{
+	uint64_t ns;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+struct fsck_stats
+{
+	uint64_t directories;
+	uint64_t files;
+	uint32_t cross_linked;		/* clusters claimed more than once */
+	uint32_t leaked;			/* allocated clusters nothing claims */
+	uint32_t unallocated;		/* clusters in use but not allocated */
+	bool incomplete;			/* not all of the tree was followed */
+	bool bitmap_rebuilt;
+	struct fsck_phase fat;		/* reading the FAT copy */
+	struct fsck_phase tree;		/* the walk with its chain checks */
+	struct fsck_phase bitmap;	/* lost clusters and the bitmap rebuild */
+};
+
+void fsck_phase_begin(struct fsck_phase* phase, const struct exfat_dev* dev);
+void fsck_phase_end(struct fsck_phase* phase, const struct exfat_dev* dev);
+int fsck_walk(struct exfat* ef, unsigned threads, bool physical_order,
+		struct fsck_stats* stats);
+
+#endif /* ifndef FSCK_WALK_H_INCLUDED */
@@ -23,161 +23,335 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
+#include <stdbool.h>
+#include <errno.h>
 
 #include "bptree.h"
 
-struct bptree_node * alloc_bptree_heap(uint8_t levels, size_t *heap_size) {
-    *heap_size = 1;
-    size_t level_size = 1;
-    for (int i = 1; i < levels; ++i) {
-        level_size *= BPTREE_CHILD_NODES;
-        *heap_size += level_size;
+#define BPTREE_MIN_CAPACITY 64
+// bulk loaded leaves are left with some room so the first inserts after
+// loading don't split every leaf they touch
+#define BPTREE_BULK_FILL (BPTREE_ORDER - BPTREE_ORDER / 4)
+
+static int grow(void **array, uint32_t *capacity, uint32_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return 0;
+    }
+    uint64_t new_capacity = MAX(*capacity, BPTREE_MIN_CAPACITY);
+    while (new_capacity < needed) {
+        new_capacity <<= 1;
+    }
+    if (new_capacity >= BPTREE_NIL) {
+        return -ENOMEM;
+    }
+    void *p = realloc(*array, new_capacity * item_size);
+    if (p == NULL) {
+        return -ENOMEM;
     }
-    struct bptree_node *bptree_heap = malloc(sizeof(struct bptree_node) * *heap_size);
-    memset(bptree_heap, '\0', sizeof(struct bptree_node) * *heap_size);
-    return bptree_heap;
+    *array = p;
+    *capacity = (uint32_t) new_capacity;
+    return 0;
 }
 
-void free_bptree_heap(struct bptree_node *bptree_heap) {
-    free(bptree_heap);
+static int reserve_nodes(struct bptree *bptree, uint32_t count) {
+    return grow((void **) &bptree->nodes, &bptree->node_capacity, bptree->node_count + count, sizeof(struct bptree_node));
 }
 
-void get_bptree_entry_heap_offset(uint8_t height, uint32_t level_offset, uint32_t *heap_offset) {
-    // maybe this can be simplified by doing some simple division or storing the level sizes
-    *heap_offset = 0;
-    uint32_t level_size = 1;
-    while (height--) {
-        *heap_offset += level_size;
-        level_size *= BPTREE_CHILD_NODES;
+static int reserve_records(struct bptree *bptree, uint32_t count) {
+    return grow((void **) &bptree->records, &bptree->record_capacity, bptree->record_count + count, sizeof(struct bptree_record));
+}
+
+// caller must have reserved room
+static uint32_t new_node(struct bptree *bptree, bool leaf) {
+    const uint32_t index = bptree->node_count++;
+    struct bptree_node *node = &bptree->nodes[index];
+    memset(node, 0, sizeof(struct bptree_node));
+    node->leaf = leaf;
+    if (leaf) {
+        node->slots[BPTREE_ORDER] = BPTREE_NIL;
     }
-    *heap_offset += level_size;
+    return index;
 }
 
-void get_bptree_entry_height_and_index(uint32_t heap_offset, uint8_t *height, uint32_t *level_offset) {
-    // maybe this can be simplified by doing some simple division or storing the level sizes
-    *height = 0;
-    uint32_t level_size = 1;
-    while (heap_offset > 0) {
-        heap_offset -= level_size;
-        level_size *= BPTREE_CHILD_NODES;
-        ++(*height);
+// first key > offset, which is the child to descend into
+static int upper_bound(const struct bptree_node *node, uint64_t offset) {
+    int lo = 0, hi = node->count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (node->keys[mid] <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    *level_offset = -heap_offset;
+    return lo;
 }
 
-void init_bptree_heap(struct bptree_node *bptree_heap,
-                      struct exfat_entry_meta2 *root_directory,
-                      uint64_t root_directory_offset) {
-    memcpy(&bptree_heap[0].entry, root_directory, sizeof(struct exfat_entry_meta2));
-    bptree_heap[0].offset = root_directory_offset;
+// first key >= offset
+static int lower_bound(const struct bptree_node *node, uint64_t offset) {
+    int lo = 0, hi = node->count;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (node->keys[mid] < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-void make_bptree(struct bptree *bptree,
-                 uint8_t height,
-                 struct exfat_entry_meta2 *root_directory,
-                 uint64_t root_directory_offset) {
-    size_t heap_size;
-    bptree->heap = alloc_bptree_heap(height, &heap_size);
-    bptree->tree_height = height;
-    bptree->heap_size = heap_size;
-    bptree->max_height = 0;
-    init_bptree_heap(bptree->heap, root_directory, root_directory_offset);
+static uint32_t find_leaf(const struct bptree *bptree, uint64_t offset) {
+    uint32_t n = bptree->root;
+    while (!bptree->nodes[n].leaf) {
+        n = bptree->nodes[n].slots[upper_bound(&bptree->nodes[n], offset)];
+    }
+    return n;
+}
+
+int make_bptree(struct bptree *bptree) {
+    memset(bptree, 0, sizeof(struct bptree));
+    int ret = reserve_nodes(bptree, 1);
+    if (ret != 0) {
+        return ret;
+    }
+    bptree->root = new_node(bptree, true);
+    bptree->height = 1;
+    return 0;
 }
 
 void destroy_bptree(struct bptree *bptree) {
-    free_bptree_heap(bptree->heap);
+    free(bptree->nodes);
+    free(bptree->records);
+    memset(bptree, 0, sizeof(struct bptree));
+}
+
+// Puts (key, slot) at position i of a full node and splits it. For leaves the
+// separator is the first key of the right half and stays there, for internal
+// nodes it moves up and slot is the child right of key.
+static uint32_t split_node(struct bptree *bptree, uint32_t n, int i,
+                           uint64_t key, uint32_t slot, uint64_t *separator) {
+    uint64_t keys[BPTREE_ORDER + 1];
+    uint32_t slots[BPTREE_ORDER + 2];
+    const uint32_t r = new_node(bptree, bptree->nodes[n].leaf);
+    struct bptree_node *left = &bptree->nodes[n], *right = &bptree->nodes[r];
+    const int slot_shift = left->leaf ? 0 : 1;
+    const int slot_count = BPTREE_ORDER + slot_shift;
+
+    memcpy(keys, left->keys, i * sizeof(uint64_t));
+    keys[i] = key;
+    memcpy(keys + i + 1, left->keys + i, (BPTREE_ORDER - i) * sizeof(uint64_t));
+    memcpy(slots, left->slots, (i + slot_shift) * sizeof(uint32_t));
+    slots[i + slot_shift] = slot;
+    memcpy(slots + i + slot_shift + 1, left->slots + i + slot_shift, (slot_count - i - slot_shift) * sizeof(uint32_t));
+
+    const int mid = (BPTREE_ORDER + 1) / 2;
+    *separator = keys[mid];
+    if (left->leaf) {
+        right->count = BPTREE_ORDER + 1 - mid;
+        memcpy(right->keys, keys + mid, right->count * sizeof(uint64_t));
+        memcpy(right->slots, slots + mid, right->count * sizeof(uint32_t));
+        right->slots[BPTREE_ORDER] = left->slots[BPTREE_ORDER];
+        left->slots[BPTREE_ORDER] = r;
+    } else {
+        right->count = BPTREE_ORDER - mid;
+        memcpy(right->keys, keys + mid + 1, right->count * sizeof(uint64_t));
+        memcpy(right->slots, slots + mid + 1, (right->count + 1) * sizeof(uint32_t));
+    }
+    left->count = mid;
+    memcpy(left->keys, keys, mid * sizeof(uint64_t));
+    memcpy(left->slots, slots, (mid + slot_shift) * sizeof(uint32_t));
+    return r;
+}
+
+static void insert_into_node(struct bptree_node *node, int i, uint64_t key, uint32_t slot) {
+    const int slot_shift = node->leaf ? 0 : 1;
+    memmove(node->keys + i + 1, node->keys + i, (node->count - i) * sizeof(uint64_t));
+    memmove(node->slots + i + slot_shift + 1, node->slots + i + slot_shift, (node->count - i) * sizeof(uint32_t));
+    node->keys[i] = key;
+    node->slots[i + slot_shift] = slot;
+    ++node->count;
 }
 
-// TODO refactor these gnarly nested blocks
-void insert_bptree_node(struct bptree *bptree,
-                        uint32_t *bptree_heap_offset, //out
-                        struct exfat_entry_meta2 *entry,
-                        uint64_t entry_offset) {
-    struct bptree_node *node = bptree->heap;
-    uint8_t height = 0;
-    uint32_t level_offset = 0;
-    uint32_t level_size = 1;
-    uint32_t heap_offset;
-    //size_t bucket_increment;
-    // first, find what level this would go in.
-    // if its more than the current maximum level + 1, rebalance the tree
+int insert_bptree_node(struct bptree *bptree,
+                       uint64_t entry_offset,
+                       const struct exfat_entry_meta2 *entry) {
+    uint32_t path[BPTREE_MAX_HEIGHT];
+    int pos[BPTREE_MAX_HEIGHT];
+    int depth = 0;
+    uint32_t n = bptree->root;
+
+    // one split per level plus a new root, so no pointers move under us below
+    int ret = reserve_nodes(bptree, bptree->height + 1);
+    if (ret == 0) {
+        ret = reserve_records(bptree, 1);
+    }
+    if (ret != 0) {
+        return ret;
+    }
+
+    while (!bptree->nodes[n].leaf) {
+        path[depth] = n;
+        pos[depth] = upper_bound(&bptree->nodes[n], entry_offset);
+        n = bptree->nodes[n].slots[pos[depth]];
+        ++depth;
+    }
+    int i = lower_bound(&bptree->nodes[n], entry_offset);
+    if (i < bptree->nodes[n].count && bptree->nodes[n].keys[i] == entry_offset) {
+        return -EEXIST;
+    }
+
+    const uint32_t record = bptree->record_count++;
+    bptree->records[record].offset = entry_offset;
+    memcpy(&bptree->records[record].entry, entry, sizeof(struct exfat_entry_meta2));
+
+    uint64_t key = entry_offset;
+    uint32_t slot = record;
     for (;;) {
-        for (int i = 0; i < BPTREE_CHILD_NODES; ++i) {
-            if (node->child_nodes[i] == 0) {
-                get_bptree_entry_heap_offset(height, level_offset, &heap_offset);
-                get_bptree_entry_heap_offset(height + 1, level_offset * BPTREE_CHILD_NODES, bptree_heap_offset);
-                node->child_nodes[i] = *bptree_heap_offset;
-                node = bptree->heap + *bptree_heap_offset;
-                memcpy(&node->entry, entry, sizeof(struct exfat_entry_meta2));
-                node->offset = entry_offset;
-                node->parent_node = heap_offset;
-                return;
-            } else if (entry_offset > bptree->heap[node->child_nodes[i]].offset) {
-                ++level_offset;
-            } else if (entry_offset < bptree->heap[node->child_nodes[i]].offset) {
-                get_bptree_entry_heap_offset(height, level_offset, &heap_offset);
-
-                /*if (height >= bptree->height) {
-
-                 } else*/
-                if (height >= bptree->max_height) {
-                    uint8_t heap_offset_height = height;
-                    uint32_t heap_offset_level_offset = level_offset;
-
-                    // try to pivot the tree, find the next empty node and move the parent and all following nodes over
-                    while (bptree->heap[++heap_offset].offset != 0) {
-                        get_bptree_entry_height_and_index(heap_offset, &heap_offset_height, &heap_offset_level_offset);
-                        if (heap_offset_height >= bptree->tree_height) {
-                            assert(heap_offset_level_offset == 0);
-                            // TODO : resize the tree. not expected to happen, so not implemented
-                            fprintf(stderr, "dynamically resizing the bptree is not currently supported\n");
-                            abort();
-                        } else if (heap_offset_height > height) {
-                            // that level was full, move node down to this position
-                            memcpy(bptree->heap + heap_offset, node, sizeof(struct bptree_node));
-
-                            // find and update node's parent's child pointer
-                            *bptree_heap_offset = node - bptree->heap;
-                            for (int c = 0; c < BPTREE_CHILD_NODES; ++c) {
-                                if (bptree->heap[node->parent_node].child_nodes[c] == *bptree_heap_offset) {
-                                    bptree->heap[node->parent_node].child_nodes[c] = heap_offset;
-                                    break;
-                                }
-                            }
-
-                            // and update all of node's children's parent pointers
-                            for (int c = 0; c < BPTREE_CHILD_NODES; ++c) {
-                                if (node->child_nodes[c] != 0) {
-                                    bptree->heap[node->child_nodes[c]].parent_node = heap_offset;
-                                }
-                            }
-
-                            // and store the new node into the old parent position
-                            node = bptree->heap + *bptree_heap_offset;
-                            memcpy(&node->entry, entry, sizeof(struct exfat_entry_meta2));
-                            node->offset = entry_offset;
-                            return;
-                        }
-                    }
-
-
-                    if (heap_offset_height == height) {
-                        // move the parent and all following nodes over
-                        memmove(bptree->heap + heap_offset, node, (node - bptree->heap) * sizeof(struct bptree_node));
-                    } else {
-                        //otherwise nothing we can do, its full, increment the max height
-                        ++bptree->max_height;
-                    }
+        if (bptree->nodes[n].count < BPTREE_ORDER) {
+            insert_into_node(&bptree->nodes[n], i, key, slot);
+            return 0;
+        }
+        slot = split_node(bptree, n, i, key, slot, &key);
+        if (depth == 0) {
+            break;
+        }
+        --depth;
+        n = path[depth];
+        i = pos[depth];
+    }
+
+    // the root was split
+    if (bptree->height >= BPTREE_MAX_HEIGHT) {
+        fprintf(stderr, "bptree height exceeds %d\n", BPTREE_MAX_HEIGHT);
+        abort();
+    }
+    const uint32_t root = new_node(bptree, false);
+    bptree->nodes[root].count = 1;
+    bptree->nodes[root].keys[0] = key;
+    bptree->nodes[root].slots[0] = bptree->root;
+    bptree->nodes[root].slots[1] = slot;
+    bptree->root = root;
+    ++bptree->height;
+    return 0;
+}
+
+// Builds the tree bottom up from records sorted by offset, much faster than
+// inserting them one by one. Duplicate offsets are dropped.
+int bulk_load_bptree(struct bptree *bptree,
+                     const struct bptree_record *records,
+                     size_t count) {
+    if (bptree->record_count != 0) {
+        return -EINVAL;
+    }
+    for (size_t i = 1; i < count; ++i) {
+        if (records[i].offset < records[i - 1].offset) {
+            return -EINVAL;
+        }
+    }
+    if (count >= BPTREE_NIL) {
+        return -ENOMEM;
+    }
+    int ret = reserve_records(bptree, count);
+    if (ret != 0) {
+        return ret;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (i == 0 || records[i].offset != records[i - 1].offset) {
+            bptree->records[bptree->record_count++] = records[i];
+        }
+    }
+    if (bptree->record_count == 0) {
+        return 0;
+    }
+
+    // leaves, evenly filled
+    const uint32_t leaf_count = DIV_ROUND_UP(bptree->record_count, BPTREE_BULK_FILL);
+    uint64_t total_nodes = 0;
+    for (uint64_t level = leaf_count; level > 1; level = DIV_ROUND_UP(level, BPTREE_ORDER + 1)) {
+        total_nodes += level;
+    }
+    bptree->node_count = 0;
+    ret = reserve_nodes(bptree, total_nodes + 1);
+    if (ret != 0) {
+        return ret;
+    }
+    uint32_t first = bptree->node_count;
+    for (uint32_t l = 0, r = 0; l < leaf_count; ++l) {
+        const uint32_t n = new_node(bptree, true);
+        struct bptree_node *leaf = &bptree->nodes[n];
+        const uint32_t end = (uint32_t) ((uint64_t) bptree->record_count * (l + 1) / leaf_count);
+        for (; r < end; ++r) {
+            leaf->keys[leaf->count] = bptree->records[r].offset;
+            leaf->slots[leaf->count] = r;
+            ++leaf->count;
+        }
+        if (l != 0) {
+            bptree->nodes[n - 1].slots[BPTREE_ORDER] = n;
+        }
+    }
+
+    // internal levels, each node's key i is the smallest key under child i + 1
+    uint32_t level_count = leaf_count;
+    bptree->height = 1;
+    while (level_count > 1) {
+        const uint32_t parent_count = DIV_ROUND_UP(level_count, BPTREE_ORDER + 1);
+        const uint32_t next_first = bptree->node_count;
+        for (uint32_t p = 0, c = 0; p < parent_count; ++p) {
+            const uint32_t n = new_node(bptree, false);
+            struct bptree_node *parent = &bptree->nodes[n];
+            const uint32_t end = (uint32_t) ((uint64_t) level_count * (p + 1) / parent_count);
+            parent->slots[0] = first + c++;
+            for (; c < end; ++c) {
+                uint32_t child = first + c;
+                parent->slots[parent->count + 1] = child;
+                while (!bptree->nodes[child].leaf) {
+                    child = bptree->nodes[child].slots[0];
                 }
-                ++height;
-                level_offset = level_offset * BPTREE_CHILD_NODES;
-                level_size *= BPTREE_CHILD_NODES;
-                node = bptree->heap + node->child_nodes[i];
-                break;
-            } else {
-                //equal?, not supposed to happen since each entry in the tree is unique
+                parent->keys[parent->count++] = bptree->nodes[child].keys[0];
+            }
+        }
+        first = next_first;
+        level_count = parent_count;
+        ++bptree->height;
+    }
+    bptree->root = first;
+    return 0;
+}
+
+const struct bptree_record * find_bptree_node(const struct bptree *bptree, uint64_t entry_offset) {
+    const struct bptree_node *leaf = &bptree->nodes[find_leaf(bptree, entry_offset)];
+    const int i = lower_bound(leaf, entry_offset);
+    if (i < leaf->count && leaf->keys[i] == entry_offset) {
+        return &bptree->records[leaf->slots[i]];
+    }
+    return NULL;
+}
+
+// Calls cb for every record with first_offset <= offset <= last_offset, in
+// order, and returns how many there were.
+size_t range_bptree(const struct bptree *bptree,
+                    uint64_t first_offset,
+                    uint64_t last_offset,
+                    bptree_range_cb cb,
+                    void *ctx) {
+    size_t visited = 0;
+    uint32_t n = find_leaf(bptree, first_offset);
+    int i = lower_bound(&bptree->nodes[n], first_offset);
+
+    while (n != BPTREE_NIL) {
+        const struct bptree_node *leaf = &bptree->nodes[n];
+        for (; i < leaf->count; ++i) {
+            if (leaf->keys[i] > last_offset) {
+                return visited;
+            }
+            ++visited;
+            if (cb != NULL && cb(&bptree->records[leaf->slots[i]], ctx) != 0) {
+                return visited;
             }
         }
+        n = leaf->slots[BPTREE_ORDER];
+        i = 0;
     }
+    return visited;
 }
@@ -29,56 +29,70 @@
 extern "C" {
 #endif
 
-#define BPTREE_CHILD_NODES 8
+// Ordered index of recovered entry sets keyed by their offset on disk.
+// A B+tree whose nodes and records live in two growable arrays addressed by
+// 32-bit indices, so memory use follows the number of entries actually
+// found and the whole thing can be freed with two calls.
+
+#define BPTREE_ORDER 20             // max keys per node
+#define BPTREE_MAX_HEIGHT 16        // 20^16 entries should be enough for anybody
+#define BPTREE_NIL ((uint32_t) -1)
+
+struct bptree_record
+{
+    uint64_t offset;                // offset of the entry set on disk (really the exfat_entry_meta1)
+    struct exfat_entry_meta2 entry; // 32 bytes. file or directory represented by this record
+};
 
 struct bptree_node
 {
-    struct exfat_entry_meta2 entry; // 32 bytes. file or directory represented by this node
-    uint64_t offset;                // offset of this entry on disk (really the exfat_entry_meta1)
-    // following are all offsets into the bptree_heap
-    uint32_t parent_directory;      // directory containing this file or directory
-    uint32_t next_fde;              // next file or directory in the same directory
-    uint32_t prev_fde;              // previous file or directory in the same directory
-    uint32_t first_directory_entry; // if this is a directory, offset of the bptree_node containing its first entry
-    uint32_t parent_node;                        // parent of this node in the bptree structure
-    uint32_t child_nodes[BPTREE_CHILD_NODES];    // offset of child nodes in the bptree structure
-}
-PACKED;
-STATIC_ASSERT(sizeof(struct bptree_node) == 92);
+    uint64_t keys[BPTREE_ORDER];
+    // internal nodes: count + 1 child nodes, child i holds keys < keys[i]
+    // leaves: records for keys, slots[BPTREE_ORDER] is the next leaf
+    uint32_t slots[BPTREE_ORDER + 1];
+    uint16_t count;
+    uint16_t leaf;
+    uint8_t __padding[8];
+};
+STATIC_ASSERT(sizeof(struct bptree_node) == 256); // four cache lines
 
 struct bptree
 {
-    struct bptree_node *heap;
-    uint8_t tree_height;        //max height of the
-    size_t heap_size;
-    uint8_t max_height; //max height of a currently stored node
-}
-PACKED;
+    struct bptree_node *nodes;
+    uint32_t node_count;
+    uint32_t node_capacity;
+    struct bptree_record *records;
+    uint32_t record_count;
+    uint32_t record_capacity;
+    uint32_t root;
+    uint8_t height;             // 1 when the root is a leaf
+};
 
-//for start size of 2396745 entries or ~200 MB
-#define BPTREE_HEIGHT 8
+// return non-zero to stop the iteration
+typedef int (*bptree_range_cb)(const struct bptree_record *record, void *ctx);
 
-struct bptree_node * alloc_bptree_heap(uint8_t levels, size_t *heap_size);
-void free_bptree_heap(struct bptree_node *bptree_heap);
+int make_bptree(struct bptree *bptree);
+void destroy_bptree(struct bptree *bptree);
 
-void get_bptree_entry_heap_offset(uint8_t height, uint32_t level_offset, uint32_t *heap_offset);
-void get_bptree_entry_height_and_index(uint32_t heap_offset, uint8_t *height, uint32_t *level_offset);
+int insert_bptree_node(struct bptree *bptree,
+                       uint64_t entry_offset,
+                       const struct exfat_entry_meta2 *entry);
 
-void init_bptree_heap(struct bptree_node *bptree_heap,
-                      struct exfat_entry_meta2 *root_directory,
-                      uint64_t root_directory_offset);
+int bulk_load_bptree(struct bptree *bptree,
+                     const struct bptree_record *records,
+                     size_t count);
 
-void make_bptree(struct bptree *bptree,
-                 uint8_t height,
-                 struct exfat_entry_meta2 *root_directory,
-                 uint64_t root_directory_offset);
+const struct bptree_record * find_bptree_node(const struct bptree *bptree, uint64_t entry_offset);
 
-void destroy_bptree(struct bptree *bptree);
+size_t range_bptree(const struct bptree *bptree,
+                    uint64_t first_offset,
+                    uint64_t last_offset,
+                    bptree_range_cb cb,
+                    void *ctx);
 
-void insert_bptree_node(struct bptree *bptree,
-                        uint32_t *bptree_heap_offset, //out
-                        struct exfat_entry_meta2 *entry,
-                        uint64_t entry_offset);
+static inline size_t bptree_size(const struct bptree *bptree) {
+    return bptree->record_count;
+}
 
 #ifdef __cplusplus
 }
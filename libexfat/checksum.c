@@ -0,0 +1,137 @@
+/*
+	checksum.c (02.02.19)
+	exFAT file system implementation library.
+
+	Free exFAT implementation.
+	Copyright (C) 2010-2018  Andrew Nayenko
+	Copyright (C) 2018-2019  Paul Ciarlo
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along
+	with this program; if not, write to the Free Software Foundation, Inc.,
+	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "exfat.h"
+#include <string.h>
+
+/*
+	Every exFAT checksum is the same recurrence: rotate the sum right by one
+	bit and add the next byte. The carry out of the addition is lost, so
+	there is no exact way to fold blocks of bytes together and each byte has
+	to wait for the one before it. What can be done is to keep everything
+	else off that chain: read 8 bytes at a time, never branch per byte to
+	skip a field, and let the compiler unroll the fixed 32 byte entry and
+	512 byte sector cases completely.
+*/
+
+#if defined(__GNUC__) || defined(__clang__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+static ALWAYS_INLINE uint64_t get_word(const uint8_t* p)
+{
+	le64_t w;
+
+	memcpy(&w, p, sizeof(w));
+	return le64_to_cpu(w);
+}
+
+#define ROR_ADD16(sum, byte) \
+	((uint16_t) ((((sum) << 15) | ((sum) >> 1)) + (byte)))
+#define ROR_ADD32(sum, byte) \
+	((uint32_t) ((((sum) << 31) | ((sum) >> 1)) + (byte)))
+
+static ALWAYS_INLINE uint16_t checksum16(uint16_t sum, const uint8_t* p,
+		size_t size)
+{
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		uint64_t w = get_word(p);
+		int i;
+
+		for (i = 0; i < 8; i++, w >>= 8)
+			sum = ROR_ADD16(sum, (uint8_t) w);
+	}
+	for (; size != 0; size--)
+		sum = ROR_ADD16(sum, *p++);
+	return sum;
+}
+
+static ALWAYS_INLINE uint32_t checksum32(uint32_t sum, const uint8_t* p,
+		size_t size)
+{
+	for (; size >= 8; size -= 8, p += 8)
+	{
+		uint64_t w = get_word(p);
+		int i;
+
+		for (i = 0; i < 8; i++, w >>= 8)
+			sum = ROR_ADD32(sum, (uint8_t) w);
+	}
+	for (; size != 0; size--)
+		sum = ROR_ADD32(sum, *p++);
+	return sum;
+}
+
+uint32_t exfat_checksum32(uint32_t sum, const void* buffer, size_t size)
+{
+	return checksum32(sum, buffer, size);
+}
+
+uint16_t exfat_start_checksum(const struct exfat_entry_meta1* entry)
+{
+	const uint8_t* p = (const uint8_t*) entry;
+	uint16_t sum = 0;
+
+	/* skip checksum field itself */
+	sum = ROR_ADD16(sum, p[0]);
+	sum = ROR_ADD16(sum, p[1]);
+	return checksum16(sum, p + 4, sizeof(struct exfat_entry) - 4);
+}
+
+uint16_t exfat_add_checksum(const void* entry, uint16_t sum)
+{
+	return checksum16(sum, entry, sizeof(struct exfat_entry));
+}
+
+le16_t exfat_calc_checksum(const struct exfat_entry* entries, int n)
+{
+	uint16_t checksum;
+
+	/* the entries of a set are contiguous, so one pass covers the rest */
+	checksum = exfat_start_checksum((const struct exfat_entry_meta1*) entries);
+	checksum = checksum16(checksum, (const uint8_t*) (entries + 1),
+			(n - 1) * sizeof(struct exfat_entry));
+	return cpu_to_le16(checksum);
+}
+
+uint32_t exfat_vbr_start_checksum(const void* sector, size_t size)
+{
+	const uint8_t* p = sector;
+	uint32_t sum;
+
+	/* skip volume_state and allocated_percent fields */
+	sum = checksum32(0, p, 0x6a);
+	sum = checksum32(sum, p + 0x6c, 0x70 - 0x6c);
+	return checksum32(sum, p + 0x71, size - 0x71);
+}
+
+uint32_t exfat_vbr_add_checksum(const void* sector, size_t size, uint32_t sum)
+{
+	/* the common sector size gets a fully unrolled copy */
+	if (size == 512)
+		return checksum32(sum, sector, 512);
+	return checksum32(sum, sector, size);
+}
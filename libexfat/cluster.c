@@ -24,6 +24,9 @@
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
+#include <fcntl.h>
+
+#define FAT_READ_CHUNK (8 * 1024 * 1024)
 
 /*
  * Sector to absolute offset.
@@ -437,55 +440,141 @@ int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 	return 0;
 }
 
+/*
+	Reads the whole FAT into memory, from start to end in large chunks, for
+	tools that follow many chains. The copy is indexed by cluster number and
+	is to be freed by the caller. Returns NULL on failure.
+*/
+le32_t* exfat_read_fat(const struct exfat* ef)
+{
+	const size_t size = ((size_t) le32_to_cpu(ef->sb->cluster_count) +
+			EXFAT_FIRST_DATA_CLUSTER) * sizeof(le32_t);
+	const off_t start = (off_t) le32_to_cpu(ef->sb->fat_sector_start) *
+			SECTOR_SIZE(*ef->sb);
+	le32_t* fat;
+	size_t done;
+
+	fat = malloc(size);
+	if (fat == NULL)
+	{
+		exfat_error("failed to allocate %zu bytes for FAT", size);
+		return NULL;
+	}
+	if (exfat_get_fd(ef->dev) != -1)
+		posix_fadvise(exfat_get_fd(ef->dev), start, size,
+				POSIX_FADV_SEQUENTIAL);
+	for (done = 0; done < size; done += FAT_READ_CHUNK)
+	{
+		const size_t chunk = MIN(size - done, FAT_READ_CHUNK);
+
+		if (exfat_pread(ef->dev, (char*) fat + done, chunk, start + done) !=
+				(ssize_t) chunk)
+		{
+			exfat_error("failed to read FAT (%zu bytes at %"PRIu64")",
+					chunk, (uint64_t) (start + done));
+			free(fat);
+			return NULL;
+		}
+	}
+	return fat;
+}
+
 uint32_t exfat_count_free_clusters(const struct exfat* ef)
 {
-	uint32_t free_clusters = 0;
+	const size_t bits = sizeof(bitmap_t) * 8;
+	uint32_t used = 0;
 	uint32_t i;
 
-	for (i = 0; i < ef->cmap.size; i++)
-		if (BMAP_GET(ef->cmap.chunk, i) == 0)
-			free_clusters++;
-	return free_clusters;
+	for (i = 0; i + bits <= ef->cmap.size; i += bits)
+		used += __builtin_popcountll(ef->cmap.chunk[BMAP_BLOCK(i)]);
+	for (; i < ef->cmap.size; i++)
+		if (BMAP_GET(ef->cmap.chunk, i))
+			used++;
+	return ef->cmap.size - used;
 }
 
-static int find_used_clusters(const struct exfat* ef,
-		cluster_t* a, cluster_t* b)
+static size_t bmap_ctz(bitmap_t word)
 {
-	const cluster_t end = le32_to_cpu(ef->sb->cluster_count);
+	return __builtin_ctzll(word);
+}
 
-	/* find first used cluster */
-	for (*a = *b + 1; *a < end; (*a)++)
-		if (BMAP_GET(ef->cmap.chunk, *a - EXFAT_FIRST_DATA_CLUSTER))
-			break;
-	if (*a >= end)
-		return 1;
+/*
+	Finds the next run of bits equal to value in a bitmap of size bits,
+	searching from *start + *length; begin with both zero. Words without a
+	bit of interest are passed over whole and the ends of a run are found
+	with ctz, so the cost is a few operations per word and per run rather
+	than per bit. Returns false when there are no more runs.
+*/
+bool exfat_bmap_next_run(const bitmap_t* bmap, size_t size, bool value,
+		size_t* start, size_t* length)
+{
+	const size_t bits = sizeof(bitmap_t) * 8;
+	const bitmap_t invert = value ? 0 : (bitmap_t) ~(bitmap_t) 0;
+	size_t i = *start + *length;
+	size_t block;
+	bitmap_t word;
 
-	/* find last contiguous used cluster */
-	for (*b = *a; *b < end; (*b)++)
-		if (BMAP_GET(ef->cmap.chunk, *b - EXFAT_FIRST_DATA_CLUSTER) == 0)
-		{
-			(*b)--;
-			break;
-		}
+	if (i >= size)
+		return false;
 
-	return 0;
+	/* the first bit of the run */
+	block = BMAP_BLOCK(i);
+	word = (bmap[block] ^ invert) & (bitmap_t) ~(BMAP_MASK(i) - 1);
+	while (word == 0)
+	{
+		if (++block * bits >= size)
+			return false;
+		word = bmap[block] ^ invert;
+	}
+	i = block * bits + bmap_ctz(word);
+	if (i >= size)
+		return false;
+	*start = i;
+
+	/* the first bit past it */
+	word = (bitmap_t) ~(bmap[block] ^ invert) &
+			(bitmap_t) ~(BMAP_MASK(i) - 1);
+	while (word == 0 && (block + 1) * bits < size)
+		word = (bitmap_t) ~(bmap[++block] ^ invert);
+	i = word != 0 ? MIN(block * bits + bmap_ctz(word), size) : size;
+	*length = i - *start;
+	return true;
+}
+
+/*
+	Iterates over runs of used clusters: *start is the first cluster of a
+	run and *count the number of clusters in it. Begin with both zero.
+*/
+bool exfat_next_used_range(const struct exfat* ef, cluster_t* start,
+		uint32_t* count)
+{
+	size_t index = *start != 0 ? *start - EXFAT_FIRST_DATA_CLUSTER : 0;
+	size_t length = *count;
+
+	if (!exfat_bmap_next_run(ef->cmap.chunk, ef->cmap.size, true, &index,
+			&length))
+		return false;
+	*start = index + EXFAT_FIRST_DATA_CLUSTER;
+	*count = length;
+	return true;
 }
 
 int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b)
 {
-	cluster_t ca, cb;
+	cluster_t start = 0;
+	uint32_t count = 0;
 
-	if (*a == 0 && *b == 0)
-		ca = cb = EXFAT_FIRST_DATA_CLUSTER - 1;
-	else
+	if (*a != 0 || *b != 0)
 	{
-		ca = s2c(ef, *a);
-		cb = s2c(ef, *b);
+		/* carry on after the last cluster of the previous range */
+		start = s2c(ef, *b);
+		count = 1;
 	}
-	if (find_used_clusters(ef, &ca, &cb) != 0)
+	if (!exfat_next_used_range(ef, &start, &count))
 		return 1;
 	if (*a != 0 || *b != 0)
-		*a = c2s(ef, ca);
-	*b = c2s(ef, cb) + (CLUSTER_SIZE(*ef->sb) - 1) / SECTOR_SIZE(*ef->sb);
+		*a = c2s(ef, start);
+	*b = c2s(ef, start + count - 1) +
+			(CLUSTER_SIZE(*ef->sb) - 1) / SECTOR_SIZE(*ef->sb);
 	return 0;
 }
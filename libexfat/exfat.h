@@ -78,6 +78,14 @@ enum exfat_mode
 	EXFAT_MODE_ANY,
 };
 
+enum exfat_zero_method
+{
+	EXFAT_ZERO_UNSUPPORTED,
+	EXFAT_ZERO_FILE_RANGE,	/* image file range kept allocated, unwritten */
+	EXFAT_ZERO_FILE_HOLE,	/* image file range deallocated */
+	EXFAT_ZERO_DEVICE,		/* block device zeroed or unmapped it */
+};
+
 struct exfat_dev;
 
 struct exfat
@@ -131,6 +139,11 @@ int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
 off_t exfat_get_size(const struct exfat_dev* dev);
+int exfat_get_fd(const struct exfat_dev* dev);
+void exfat_get_io_bytes(const struct exfat_dev* dev, uint64_t* read,
+		uint64_t* written);
+enum exfat_zero_method exfat_zero_range(struct exfat_dev* dev, off_t offset,
+		off_t size);
 off_t exfat_seek(struct exfat_dev* dev, off_t offset, int whence);
 ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size);
 ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size);
@@ -161,13 +174,19 @@ int exfat_flush_nodes(struct exfat* ef);
 int exfat_flush(struct exfat* ef);
 int exfat_truncate(struct exfat* ef, struct exfat_node* node, uint64_t size,
 		bool erase);
+le32_t* exfat_read_fat(const struct exfat* ef);
 uint32_t exfat_count_free_clusters(const struct exfat* ef);
+bool exfat_bmap_next_run(const bitmap_t* bmap, size_t size, bool value,
+		size_t* start, size_t* length);
+bool exfat_next_used_range(const struct exfat* ef, cluster_t* start,
+		uint32_t* count);
 int exfat_find_used_sectors(const struct exfat* ef, off_t* a, off_t* b);
 
 void exfat_stat(const struct exfat* ef, const struct exfat_node* node,
 		struct stat* stbuf);
 void exfat_get_name(const struct exfat_node* node,
 		char buffer[EXFAT_UTF8_NAME_BUFFER_MAX]);
+uint32_t exfat_checksum32(uint32_t sum, const void* buffer, size_t size);
 uint16_t exfat_start_checksum(const struct exfat_entry_meta1* entry);
 uint16_t exfat_add_checksum(const void* entry, uint16_t sum);
 le16_t exfat_calc_checksum(const struct exfat_entry* entries, int n);
@@ -178,6 +197,7 @@ le16_t exfat_calc_name_hash(const struct exfat* ef, const le16_t* name,
 void exfat_humanize_bytes(uint64_t value, struct exfat_human_bytes* hb);
 void exfat_print_info(const struct exfat_super_block* sb,
 		uint32_t free_clusters);
+void exfat_print_json_string(FILE* stream, const char* str);
 
 int utf16_to_utf8(char* output, const le16_t* input, size_t outsize,
 		size_t insize);
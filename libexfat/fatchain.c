@@ -0,0 +1,177 @@
+//
+//  fatchain.c
+//  NuclearHolocaust
+//
+//  Copyright © 2019 Paul Ciarlo. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "exfat.h"
+
+#define FAT_READ_CHUNK ((size_t) 4 * 1024 * 1024)
+#define FAT_MEDIA_DESCRIPTOR 0xFFFFFFF8
+
+// The first FAT sector starts with the media descriptor and an end-of-chain
+// marker, which is about the only thing distinguishing it from a sector of
+// cluster numbers. Used when the boot region that said where the FAT is
+// did not survive.
+static off_t locate_fat(struct exfat_dev *dev, const struct exfat_geometry *geo) {
+    const size_t ss = GEOMETRY_SECTOR_SIZE(*geo);
+    uint8_t *buf;
+    off_t offset, found = 0;
+
+    buf = malloc(FAT_READ_CHUNK);
+    if (buf == NULL) {
+        return 0;
+    }
+    for (offset = geo->partition_offset + ss; found == 0 && offset < geo->cluster_heap_offset; offset += FAT_READ_CHUNK) {
+        const size_t len = MIN(FAT_READ_CHUNK, (size_t) (geo->cluster_heap_offset - offset));
+        const ssize_t rd = exfat_pread(dev, buf, len, offset);
+        if (rd <= 0) {
+            break;
+        }
+        for (size_t i = 0; i + 2 * sizeof(le32_t) <= (size_t) rd; i += ss) {
+            le32_t v[2];
+            memcpy(v, buf + i, sizeof(v));
+            if (le32_to_cpu(v[0]) == FAT_MEDIA_DESCRIPTOR && le32_to_cpu(v[1]) == EXFAT_CLUSTER_END) {
+                found = offset + i;
+                break;
+            }
+        }
+    }
+    free(buf);
+    return found;
+}
+
+static bool plausible_entry(cluster_t cluster, cluster_t next, cluster_t count) {
+    return next == EXFAT_CLUSTER_FREE || next == EXFAT_CLUSTER_END || next == EXFAT_CLUSTER_BAD ||
+        (next >= EXFAT_FIRST_DATA_CLUSTER && next < count && next != cluster);
+}
+
+// Reads whatever is left of the FAT into frag->next. A sector is only taken
+// if every entry in it is something a FAT could hold, so sectors that were
+// overwritten with file data or zeroed by a format leave their clusters
+// unknown rather than pointing chains into nowhere.
+int load_fat_fragments(struct exfat_dev *dev, const struct exfat_geometry *geo, struct exfat_fat_fragments *frag) {
+    const size_t ss = GEOMETRY_SECTOR_SIZE(*geo);
+    const size_t per_sector = ss / sizeof(le32_t);
+    off_t fat_offset = geo->fat_offset;
+    uint64_t fat_bytes;
+    uint8_t *buf;
+    cluster_t cluster = 0;
+
+    memset(frag, 0, sizeof(struct exfat_fat_fragments));
+    if (fat_offset == 0) {
+        fat_offset = locate_fat(dev, geo);
+        if (fat_offset == 0) {
+            return -ENOENT;
+        }
+    }
+    frag->count = geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    fat_bytes = ROUND_UP((uint64_t) frag->count * sizeof(le32_t), ss);
+    if (geo->fat_sector_count != 0) {
+        fat_bytes = MIN(fat_bytes, (uint64_t) geo->fat_sector_count << geo->sector_bits);
+    }
+    if (fat_offset + (off_t) fat_bytes > geo->cluster_heap_offset) {
+        fat_bytes = geo->cluster_heap_offset > fat_offset ? geo->cluster_heap_offset - fat_offset : 0;
+    }
+
+    frag->next = calloc(frag->count, sizeof(cluster_t));
+    buf = malloc(FAT_READ_CHUNK);
+    if (frag->next == NULL || buf == NULL) {
+        free(buf);
+        free_fat_fragments(frag);
+        return -ENOMEM;
+    }
+
+    for (uint64_t pos = 0; pos < fat_bytes; pos += FAT_READ_CHUNK) {
+        const size_t len = MIN((uint64_t) FAT_READ_CHUNK, fat_bytes - pos);
+        const ssize_t rd = exfat_pread(dev, buf, len, fat_offset + pos);
+        const size_t sectors = rd > 0 ? (size_t) rd / ss : 0;
+
+        for (size_t s = 0; s < sectors; ++s, cluster += per_sector) {
+            const le32_t *entries = (const le32_t *) (buf + s * ss);
+            const size_t n = MIN(per_sector, (size_t) (frag->count - MIN(cluster, frag->count)));
+            size_t i = cluster == 0 ? EXFAT_FIRST_DATA_CLUSTER : 0;
+            bool in_use = false;
+
+            ++frag->sectors_read;
+            for (; i < n; ++i) {
+                const cluster_t next = le32_to_cpu(entries[i]);
+                if (!plausible_entry(cluster + i, next, frag->count)) {
+                    break;
+                }
+                in_use |= next != EXFAT_CLUSTER_FREE;
+            }
+            if (i < n) {
+                continue;
+            }
+            ++frag->sectors_plausible;
+            if (in_use) {
+                ++frag->sectors_in_use;
+                for (i = cluster == 0 ? EXFAT_FIRST_DATA_CLUSTER : 0; i < n; ++i) {
+                    frag->next[cluster + i] = le32_to_cpu(entries[i]);
+                }
+            }
+        }
+        if (sectors < len / ss) {
+            // unreadable, leave the rest unknown
+            break;
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+void free_fat_fragments(struct exfat_fat_fragments *frag) {
+    free(frag->next);
+    frag->next = NULL;
+    frag->count = 0;
+}
+
+// Follows the chain from start into chain[], at most clusters long. Returns
+// the number of clusters that could be followed; the chain is intact only if
+// that equals clusters and the last one is marked EXFAT_CLUSTER_END. A cycle
+// can never end in EXFAT_CLUSTER_END, so the length bound is all it takes to
+// reject one.
+cluster_t follow_fat_fragments(const struct exfat_fat_fragments *frag, cluster_t start,
+                               cluster_t clusters, cluster_t *chain) {
+    cluster_t n = 0;
+    cluster_t cluster = start;
+
+    while (n < clusters && cluster >= EXFAT_FIRST_DATA_CLUSTER && cluster < frag->count) {
+        chain[n++] = cluster;
+        cluster = frag->next[cluster];
+    }
+    return n;
+}
+
+bool fat_fragments_chain_valid(const struct exfat_fat_fragments *frag, const cluster_t *chain,
+                               cluster_t length, cluster_t clusters) {
+    return length == clusters && clusters != 0 && frag->next[chain[length - 1]] == EXFAT_CLUSTER_END;
+}
+
+void print_fat_fragments(const struct exfat_fat_fragments *frag) {
+    fprintf(stderr, "FAT sectors read          %" PRIu32 "\n", frag->sectors_read);
+    fprintf(stderr, "FAT sectors plausible     %" PRIu32 "\n", frag->sectors_plausible);
+    fprintf(stderr, "FAT sectors with chains   %" PRIu32 "\n", frag->sectors_in_use);
+}
@@ -36,10 +36,11 @@ class libc_exception : public std::exception
 public:
     libc_exception(int e) : _errno(e) {}
     libc_exception(const char *prefix, int e) : _prefix("[" + std::string(prefix) + "] "), _errno(errno) {}
-    virtual const char* what() const noexcept { return (_prefix + strerror(_errno)).c_str(); }
+    virtual const char* what() const noexcept { _what = _prefix + strerror(_errno); return _what.c_str(); }
 private:
     std::string _prefix;
     int _errno;
+    mutable std::string _what;      // what() must not return a temporary
 };
 
 class exfat_exception : public std::exception
@@ -52,9 +53,10 @@ class exfat_exception : public std::exception
         template <typename T>
         exfat_exception &operator<<(T output) { _oss << output; return *this; }
 
-        virtual const char* what() const noexcept { return _oss.str().c_str(); }
+        virtual const char* what() const noexcept { _what = _oss.str(); return _what.c_str(); }
     private:
         std::ostringstream _oss;
+        mutable std::string _what;
 };
 
 #define LIBC_EXCEPTION libc_exception(FILELINE, errno)
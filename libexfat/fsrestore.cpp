@@ -24,38 +24,97 @@
 #include "fsrestore.h"
 #include "fsexcept.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
 #include <fstream>
+#include <mutex>
+#include <regex>
 #include <sstream>
+#include <system_error>
 #include <string>
+#include <thread>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+#define FDE_BATCH_BYTES ((size_t) 1024 * 1024)
+#define RESTORE_BUFFER_BYTES ((size_t) 4 * 1024 * 1024)
+#define RESTORE_BUFFER_ALIGNMENT 4096
+#define RESTORE_DEFAULT_WORKERS 4
+#define RESTORE_KERNEL_COPY_BYTES ((size_t) 1024 * 1024 * 1024)
+
+constexpr struct exfat_entry_label ExFATFilesystem::VOLUME_LABEL;
+constexpr struct exfat_volume_boot_record ExFATFilesystem::VBR;
 
 ExFATFilesystem::ExFATFilesystem() :
+	_restore_workers(RESTORE_DEFAULT_WORKERS),
+	_chain_resolver(nullptr),
+	_chain_resolver_ctx(nullptr),
 	_volume_label(VOLUME_LABEL),
-	_vbr(VBR),
-	_bmp_entry(BMP_ENTRY)
+	_vbr(VBR)
 {
     _filesystem.dev = nullptr;
-    init_fat(&_fat);
-    init_cluster_heap(&_fat, &_heap, &BMP_ENTRY);
-    init_upcase_table(&_fat, &_upcase);
-    _directory_tree = std::make_unique<ExFATDirectoryTree>(0);
+    _fat = {nullptr, 0};
+    _fat_fragments = {nullptr, 0, 0, 0, 0};
+    _heap = {nullptr, 0};
 }
 
 ExFATFilesystem::~ExFATFilesystem() {
+    free_cluster_heap(&_heap);
+    free_fat(&_fat);
+    free_fat_fragments(&_fat_fragments);
     if (_filesystem.dev != nullptr) {
         exfat_close(_filesystem.dev);
     }
 }
 
-void ExFATFilesystem::openFilesystem(std::string device_path, off_t filesystem_offset, bool rw) throw() {
+void ExFATFilesystem::openFilesystem(std::string device_path, off_t filesystem_offset, bool rw) {
+    _device_path = device_path;
     _filesystem.dev = exfat_open(device_path.c_str(), rw ? EXFAT_MODE_RW : EXFAT_MODE_RO);
     if (_filesystem.dev != nullptr) {
         //_fs_offset = filesystem_offset;
     } else {
         throw LIBC_EXCEPTION;
     }
+
+    // the FAT and the bitmap can only be sized once we know what is on the disk
+    if (exfat_probe_geometry(_filesystem.dev, &_geometry) != 0) {
+        exfat_exception ex;
+        ex << "Unable to determine file system geometry of " << device_path;
+        throw ex;
+    }
+    exfat_print_geometry(&_geometry);
+    _directory_tree = std::make_unique<ExFATDirectoryTree>(_geometry);
+    exfat_geometry_to_sb(&_geometry, &_vbr.sb);
+    _vbr.sb.volume_serial = VBR.sb.volume_serial;
+    _vbr.sb.allocated_percent = VBR.sb.allocated_percent;
+
+    init_recovery_bitmap_entry(&_bmp_entry, &_geometry);
+    if (init_fat(&_fat, &_geometry) != 0 ||
+        init_cluster_heap(&_fat, &_heap, &_bmp_entry, &_geometry) != 0 ||
+        init_upcase_table(&_fat, &_upcase) != 0) {
+        exfat_exception ex;
+        ex << "Unable to allocate FAT and cluster heap for " << _geometry.cluster_count << " clusters";
+        throw ex;
+    }
+
+    // only needed for fragmented files, so do without it if it is gone
+    if (load_fat_fragments(_filesystem.dev, &_geometry, &_fat_fragments) == 0) {
+        print_fat_fragments(&_fat_fragments);
+    } else {
+        std::cerr << "No FAT found, fragmented files will be restored as if contiguous" << std::endl;
+    }
 }
 
-void ExFATFilesystem::rebuildFromScanLogfile(std::string filename) throw() {
+void ExFATFilesystem::rebuildFromScanLogfile(std::string filename) {
     std::ifstream logfile(filename);
     std::string line;
     size_t line_no = 0;
@@ -68,16 +127,754 @@ void ExFATFilesystem::rebuildFromScanLogfile(std::string filename) throw() {
         ++line_no;
         _processLine(line, iss, line_no);
     }
+
+    _processPendingFileDirectoryEntries();
+    _directory_tree->resolveParents();
+    std::cerr << "Recovered " << _directory_tree->getDirectoryCount() << " directories, "
+        << _directory_tree->getFileCount() << " files, "
+        << _directory_tree->getOrphanCount() << " of them in lost+found" << std::endl;
+}
+
+class RestoreFilter
+{
+public:
+    RestoreFilter(const std::string &filter) : _use_regex(false), _min_size(0), _max_size(UINT64_MAX) {
+        static const std::regex size_range("([0-9]*[KMGT]?)-([0-9]*[KMGT]?)", std::regex::icase);
+        std::string pattern = filter;
+        std::smatch m;
+        const size_t colon = pattern.rfind(':');
+        if (colon != std::string::npos) {
+            const std::string range = pattern.substr(colon + 1);
+            if (std::regex_match(range, m, size_range)) {
+                if (m[1].length() != 0) {
+                    _min_size = _parseSize(m[1]);
+                }
+                if (m[2].length() != 0) {
+                    _max_size = _parseSize(m[2]);
+                }
+                pattern.erase(colon);
+            }
+        }
+        if (pattern.compare(0, 3, "re:") == 0) {
+            _use_regex = true;
+            try {
+                _regex = std::regex(pattern.substr(3), std::regex::icase | std::regex::nosubs);
+            } catch (std::regex_error &e) {
+                exfat_exception ex;
+                ex << "Bad regular expression in filter " << filter << ": " << e.what();
+                throw ex;
+            }
+        } else {
+            _glob = pattern.empty() ? "*" : pattern;
+        }
+    }
+
+    bool matches(const char *name, uint64_t size) const {
+        if (size < _min_size || size > _max_size) {
+            return false;
+        }
+        if (_use_regex) {
+            return std::regex_search(name, _regex);
+        }
+        return fnmatch(_glob.c_str(), name, FNM_CASEFOLD) == 0;
+    }
+
+private:
+    static uint64_t _parseSize(const std::string &s) {
+        uint64_t size = strtoull(s.c_str(), NULL, 10);
+        switch (toupper(s.back())) {
+            case 'T': size <<= 10; // fall through
+            case 'G': size <<= 10; // fall through
+            case 'M': size <<= 10; // fall through
+            case 'K': size <<= 10;
+        }
+        return size;
+    }
+
+    std::string _glob;
+    std::regex _regex;
+    bool _use_regex;
+    uint64_t _min_size;
+    uint64_t _max_size;
+};
+
+static std::string sanitizeName(const char *name) {
+    std::string s(name);
+    if (s.empty() || s == "." || s == "..") {
+        return "_";
+    }
+    std::replace(s.begin(), s.end(), '/', '_');
+    return s;
+}
+
+std::string ExFATFilesystem::_nodePath(ExFATDirectoryTree::node_index_t node) const {
+    std::vector<ExFATDirectoryTree::node_index_t> path;
+    for (; node != ExFATDirectoryTree::ROOT && node != ExFATDirectoryTree::NIL;
+         node = _directory_tree->getNode(node).parent) {
+        path.push_back(node);
+    }
+    std::string s;
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        s += "/" + sanitizeName(_directory_tree->getName(*it));
+    }
+    return s;
+}
+
+static bool writeAll(const std::string &path, int fd, const uint8_t *data, size_t size) {
+    for (size_t written = 0; written < size; ) {
+        const ssize_t wr = write(fd, data + written, size - written);
+        if (wr == -1) {
+            std::cerr << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        written += wr;
+    }
+    return true;
+}
+
+// Alternates between the two halves of buffer, so the device is read while
+// the previous chunk is still being written out.
+bool ExFATFilesystem::_copyExtentBuffered(const std::string &path, int fd, off_t offset, uint64_t length, uint8_t *buffer, size_t buffer_size) noexcept {
+    const size_t sector_size = GEOMETRY_SECTOR_SIZE(_geometry);
+    const size_t half = buffer_size / 2 / sector_size * sector_size;
+    struct Slot {
+        uint8_t *data;
+        size_t size;
+        ssize_t rd;
+        bool full;
+    } slots[2] = { { buffer, 0, 0, false }, { buffer + half, 0, 0, false } };
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    bool ok = true;
+
+    // read whole sectors, the tail is cut off by ftruncate() in the caller
+    if (length <= half) {
+        if (exfat_pread(_filesystem.dev, buffer, ROUND_UP(length, sector_size), offset) < (ssize_t) length) {
+            std::cerr << path << ": read error at " << std::hex << offset << std::dec << std::endl;
+            return false;
+        }
+        return writeAll(path, fd, buffer, length);
+    }
+
+    std::thread reader;
+    try {
+        reader = std::thread([&]() {
+            off_t pos = offset;
+            for (uint64_t left = length, s = 0; left != 0; s ^= 1) {
+                Slot &slot = slots[s];
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&]() { return !slot.full || stop; });
+                    if (stop) {
+                        return;
+                    }
+                }
+                const size_t chunk = MIN(left, (uint64_t) half);
+                const ssize_t rd = exfat_pread(_filesystem.dev, slot.data, ROUND_UP(chunk, sector_size), pos);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.size = chunk;
+                    slot.rd = rd;
+                    slot.full = true;
+                }
+                cv.notify_all();
+                if (rd < (ssize_t) chunk) {
+                    return;
+                }
+                pos += chunk;
+                left -= chunk;
+            }
+        });
+    } catch (const std::system_error &e) {
+        std::cerr << path << ": " << e.what() << std::endl;
+        return false;
+    }
+
+    for (uint64_t left = length, s = 0; left != 0; s ^= 1) {
+        Slot &slot = slots[s];
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return slot.full; });
+        }
+        if (slot.rd < (ssize_t) slot.size) {
+            std::cerr << path << ": read error at " << std::hex << offset + (length - left) << std::dec << std::endl;
+            ok = false;
+            break;
+        }
+        if (!writeAll(path, fd, slot.data, slot.size)) {
+            ok = false;
+            break;
+        }
+        left -= slot.size;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot.full = false;
+        }
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    cv.notify_all();
+    reader.join();
+    return ok;
+}
+
+// Copies length bytes at offset on the device to the current position of fd.
+// A single extent is handed to the kernel with copy_file_range(), which lets
+// image files on reflink-capable file systems share blocks, or with sendfile()
+// when the source is a block device. Either way the data never passes through
+// our buffers; when neither applies (ublio, non-Linux, EXDEV, ...) it is read
+// and written through the double-buffered pipeline instead.
+bool ExFATFilesystem::_copyExtent(const std::string &path, int fd, off_t offset, uint64_t length, uint8_t *buffer, size_t buffer_size) noexcept {
+#if defined(__linux__)
+    const int dev_fd = exfat_get_fd(_filesystem.dev);
+
+    if (dev_fd != -1) {
+#if defined(HAVE_COPY_FILE_RANGE)
+        while (length != 0) {
+            const ssize_t n = copy_file_range(dev_fd, &offset, fd, NULL, MIN(length, (uint64_t) RESTORE_KERNEL_COPY_BYTES), 0);
+            if (n <= 0) {
+                break;
+            }
+            length -= n;
+        }
+#endif
+        while (length != 0) {
+            const ssize_t n = sendfile(fd, dev_fd, &offset, MIN(length, (uint64_t) RESTORE_KERNEL_COPY_BYTES));
+            if (n <= 0) {
+                break;
+            }
+            length -= n;
+        }
+        if (length == 0) {
+            return true;
+        }
+    }
+#endif
+    return _copyExtentBuffered(path, fd, offset, length, buffer, buffer_size);
 }
 
-void ExFATFilesystem::restoreFilesFromScanLogFile(std::string filter, std::string output_dir) throw() {
-//    exfat
+// Finds the clusters of a fragmented file or directory, from the surviving
+// FAT or, failing that, from the chain resolver. The chain has to have
+// exactly as many clusters as size needs, and a FAT chain must also end where
+// it should.
+bool ExFATFilesystem::_resolveChain(cluster_t start_cluster, const std::string &path, uint64_t size,
+                                    std::vector<cluster_t> &chain) const noexcept {
+    const cluster_t clusters = DIV_ROUND_UP(size, GEOMETRY_CLUSTER_SIZE(_geometry));
+    cluster_t n = 0;
+
+    try {
+        chain.resize(clusters);
+    } catch (const std::bad_alloc &) {
+        return false;
+    }
+    if (_fat_fragments.next != nullptr) {
+        n = follow_fat_fragments(&_fat_fragments, start_cluster, clusters, chain.data());
+        if (!fat_fragments_chain_valid(&_fat_fragments, chain.data(), n, clusters)) {
+            n = 0;
+        }
+    }
+    if (n != clusters && _chain_resolver != nullptr) {
+        n = _chain_resolver(_filesystem.dev, &_geometry, path.c_str(), start_cluster,
+                            size, chain.data(), clusters, _chain_resolver_ctx);
+    }
+    if (n != clusters) {
+        chain.clear();
+        return false;
+    }
+    return true;
 }
 
+// Turns the chain of a fragmented file into runs of adjacent clusters,
+// covering the first length bytes.
+bool ExFATFilesystem::_chainExtents(const RestoreJob &job, uint64_t size, uint64_t length,
+                                    std::vector<Extent> &extents) const noexcept {
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    std::vector<cluster_t> chain;
+
+    if (!_resolveChain(job.start_cluster, job.path, size, chain)) {
+        return false;
+    }
+    try {
+        for (size_t i = 0; i < chain.size() && length != 0; ) {
+            cluster_t run = 1;
+            while (i + run < chain.size() && chain[i + run] == chain[i] + run) {
+                ++run;
+            }
+            const uint64_t bytes = MIN(length, (uint64_t) run * cluster_size);
+            extents.push_back({exfat_geometry_c2o(&_geometry, chain[i]), bytes});
+            length -= bytes;
+            i += run;
+        }
+    } catch (const std::bad_alloc &) {
+        extents.clear();
+        return false;
+    }
+    return true;
+}
+
+// Copies a file's clusters into job.path. A fragmented file follows whatever
+// is left of its FAT chain; if that is gone too its clusters are copied as if
+// they were contiguous, which is right more often than not for files written
+// in one go.
+bool ExFATFilesystem::_restoreFile(const RestoreJob &job, uint8_t *buffer, size_t buffer_size) noexcept {
+    const ExFATDirectoryTree::Node &node = _directory_tree->getNode(job.node);
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const cluster_t end_cluster = _geometry.cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    uint64_t remaining = MIN(node.valid_size, node.size);
+    std::vector<Extent> extents;
+    bool ok = true;
+
+    if (remaining != 0) {
+        if (job.start_cluster < EXFAT_FIRST_DATA_CLUSTER || job.start_cluster >= end_cluster) {
+            std::cerr << job.path << ": bad start cluster " << job.start_cluster << std::endl;
+            return false;
+        }
+        if (node.isFragmented() && node.size > cluster_size &&
+            !_chainExtents(job, node.size, remaining, extents)) {
+            std::cerr << job.path << ": fragmented and its cluster chain is lost, restored as if contiguous" << std::endl;
+        }
+        if (extents.empty()) {
+            const uint64_t available = (uint64_t) (end_cluster - job.start_cluster) * cluster_size;
+            if (remaining > available) {
+                std::cerr << job.path << ": runs past the end of the cluster heap, truncated" << std::endl;
+                remaining = available;
+                ok = false;
+            }
+            extents.push_back({exfat_geometry_c2o(&_geometry, job.start_cluster), remaining});
+        }
+    }
+
+    int fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::cerr << job.path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    for (const Extent &extent : extents) {
+        if (!_copyExtent(job.path, fd, extent.offset, extent.length, buffer, buffer_size)) {
+            ok = false;
+            break;
+        }
+    }
+    // beyond valid_size the file reads as zeroes
+    if (ftruncate(fd, node.size) == -1) {
+        ok = false;
+    }
+    if (close(fd) == -1) {
+        ok = false;
+    }
+    return ok;
+}
+
+void ExFATFilesystem::restoreFilesFromScanLogFile(std::string filter, std::string output_dir) {
+    RestoreFilter restore_filter(filter);
+    std::vector<RestoreJob> jobs;
+    std::unordered_set<std::string> paths, directories;
+
+    if (!_directory_tree) {
+        exfat_exception ex;
+        ex << "No file system to restore from";
+        throw ex;
+    }
+    if (mkdir(output_dir.c_str(), 0755) == -1 && errno != EEXIST) {
+        throw LIBC_EXCEPTION;
+    }
+
+    for (ExFATDirectoryTree::node_index_t n = 0; n < _directory_tree->getNodeCount(); ++n) {
+        const ExFATDirectoryTree::Node &node = _directory_tree->getNode(n);
+        if (node.isDirectory() || node.parent == ExFATDirectoryTree::NIL ||
+            !restore_filter.matches(_directory_tree->getName(n), node.size)) {
+            continue;
+        }
+        RestoreJob job = { n, node.start_cluster, output_dir + _nodePath(n) };
+        if (!paths.insert(job.path).second) {
+            std::ostringstream oss;
+            oss << job.path << "~" << std::hex << node.offset;
+            job.path = oss.str();
+            paths.insert(job.path);
+        }
+        jobs.push_back(job);
+    }
+
+    // directories are made up front so the workers never race on them
+    for (const RestoreJob &job : jobs) {
+        for (size_t slash = job.path.find('/', output_dir.size() + 1);
+             slash != std::string::npos;
+             slash = job.path.find('/', slash + 1)) {
+            const std::string dir = job.path.substr(0, slash);
+            if (directories.insert(dir).second && mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+                throw LIBC_EXCEPTION;
+            }
+        }
+    }
+
+    // in disk order, so concurrent workers keep the head moving forward
+    std::sort(jobs.begin(), jobs.end(), [](const RestoreJob &a, const RestoreJob &b) {
+        return a.start_cluster < b.start_cluster;
+    });
+
+    std::atomic<size_t> next(0), failed(0);
+    const size_t buffer_size = ROUND_UP(MAX(RESTORE_BUFFER_BYTES, GEOMETRY_CLUSTER_SIZE(_geometry)), RESTORE_BUFFER_ALIGNMENT);
+    auto worker = [&]() {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, RESTORE_BUFFER_ALIGNMENT, buffer_size) != 0) {
+            return;
+        }
+        for (size_t i; (i = next++) < jobs.size(); ) {
+            if (!_restoreFile(jobs[i], (uint8_t *) buffer, buffer_size)) {
+                ++failed;
+            }
+        }
+        free(buffer);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned w = 0; w < MIN(_restore_workers, (unsigned) MAX(jobs.size(), (size_t) 1)); ++w) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread &t : workers) {
+        t.join();
+    }
+    if (next < jobs.size()) {
+        exfat_exception ex;
+        ex << "Unable to allocate restore buffers";
+        throw ex;
+    }
+
+    std::cerr << "Restored " << jobs.size() - failed << " of " << jobs.size() << " files matching "
+        << filter << " into " << output_dir << std::endl;
+}
+
+// Starts a FAT from scratch with a chain for every fragmented file and
+// directory, and marks in claimed every cluster that something recovered
+// lives in, so the metadata made up afterwards goes around them. Fragmented
+// directories whose chain is lost keep only their first cluster, which is all
+// resolveParents() looked in, and are marked in truncated.
+void ExFATFilesystem::_claimClusters(std::vector<bool> &claimed, std::vector<bool> &truncated) {
+    const ExFATDirectoryTree &tree = *_directory_tree;
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const cluster_t end_cluster = _geometry.cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    std::vector<ExFATDirectoryTree::node_index_t> nodes, fragmented;
+    std::vector<std::vector<cluster_t>> chains;
+    std::vector<ExFATDirectoryTree::node_index_t> unresolved;
+    size_t cross_linked = 0, truncated_count = 0;
+
+    for (ExFATDirectoryTree::node_index_t n = ExFATDirectoryTree::LOST_FOUND + 1; n < tree.getNodeCount(); ++n) {
+        const ExFATDirectoryTree::Node &node = tree.getNode(n);
+        if (node.parent == ExFATDirectoryTree::NIL || node.size == 0 ||
+            node.start_cluster < EXFAT_FIRST_DATA_CLUSTER || node.start_cluster >= end_cluster) {
+            continue;
+        }
+        nodes.push_back(n);
+        if (node.isFragmented() && node.size > cluster_size) {
+            fragmented.push_back(n);
+        }
+    }
+
+    // resolving a chain can mean searching the disk, so spread it out
+    chains.resize(fragmented.size());
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next++) < fragmented.size(); ) {
+            const ExFATDirectoryTree::Node &node = tree.getNode(fragmented[i]);
+            _resolveChain(node.start_cluster, _nodePath(fragmented[i]), node.size, chains[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned w = 1; w < MIN(_restore_workers, (unsigned) MAX(fragmented.size(), (size_t) 1)); ++w) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &t : workers) {
+        t.join();
+    }
+
+    free_fat(&_fat);
+    if (init_fat(&_fat, &_geometry) != 0) {
+        exfat_exception ex;
+        ex << "Unable to allocate FAT for " << _geometry.cluster_count << " clusters";
+        throw ex;
+    }
+    auto claim = [&](cluster_t c, cluster_t next) {
+        cross_linked += claimed[c];
+        claimed[c] = true;
+        _fat.entries[c] = next;
+    };
+    size_t f = 0;
+    for (ExFATDirectoryTree::node_index_t n : nodes) {
+        const ExFATDirectoryTree::Node &node = tree.getNode(n);
+        const cluster_t last = MIN(node.start_cluster + DIV_ROUND_UP(node.size, cluster_size), (uint64_t) end_cluster) - 1;
+        if (f < fragmented.size() && fragmented[f] == n) {
+            const std::vector<cluster_t> &chain = chains[f++];
+            if (!chain.empty()) {
+                for (size_t i = 0; i < chain.size(); ++i) {
+                    claim(chain[i], i + 1 < chain.size() ? chain[i + 1] : EXFAT_CLUSTER_END);
+                }
+                continue;
+            }
+            if (node.isDirectory()) {
+                claim(node.start_cluster, EXFAT_CLUSTER_END);
+                truncated[n] = true;
+                ++truncated_count;
+                continue;
+            }
+            unresolved.push_back(n);
+        } else if (!node.isFragmented()) {
+            // contiguous, the FAT is not looked at
+            for (cluster_t c = node.start_cluster; c <= last; ++c) {
+                cross_linked += claimed[c];
+                claimed[c] = true;
+            }
+        } else {
+            claim(node.start_cluster, EXFAT_CLUSTER_END);
+        }
+    }
+
+    // Files whose chain is lost were restored as if contiguous. They get a
+    // chain that says so, except that it steps around whatever is known to
+    // belong to something else.
+    for (ExFATDirectoryTree::node_index_t n : unresolved) {
+        const ExFATDirectoryTree::Node &node = tree.getNode(n);
+        cluster_t count = DIV_ROUND_UP(node.size, cluster_size), prev = 0;
+        for (cluster_t c = node.start_cluster; count != 0 && c < end_cluster; ++c) {
+            if (claimed[c] && c != node.start_cluster) {
+                continue;
+            }
+            if (prev != 0) {
+                claim(prev, c);
+            }
+            prev = c;
+            --count;
+        }
+        claim(prev, EXFAT_CLUSTER_END);
+    }
+    if (!unresolved.empty() || truncated_count != 0 || cross_linked != 0) {
+        std::cerr << unresolved.size() << " fragmented files given a guessed chain, "
+            << truncated_count << " fragmented directories cut down to one cluster, "
+            << cross_linked << " clusters claimed twice" << std::endl;
+    }
+}
+
+// Takes the next clusters from cursor on that nobody claimed, enough for size
+// bytes and at least one, and chains them in the FAT.
+std::vector<cluster_t> ExFATFilesystem::_allocateClusters(std::vector<bool> &claimed, cluster_t &cursor, uint64_t size) {
+    const cluster_t end_cluster = _geometry.cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    const uint64_t count = MAX(DIV_ROUND_UP(size, GEOMETRY_CLUSTER_SIZE(_geometry)), (uint64_t) 1);
+    std::vector<cluster_t> clusters;
+
+    for (; clusters.size() < count && cursor < end_cluster; ++cursor) {
+        if (!claimed[cursor]) {
+            claimed[cursor] = true;
+            if (!clusters.empty()) {
+                _fat.entries[clusters.back()] = cursor;
+            }
+            clusters.push_back(cursor);
+        }
+    }
+    if (clusters.size() < count) {
+        exfat_exception ex;
+        ex << "No room left for " << count << " clusters of file system metadata";
+        throw ex;
+    }
+    _fat.entries[clusters.back()] = EXFAT_CLUSTER_END;
+    return clusters;
+}
+
+// Journals size bytes of data into clusters, one record per run of adjacent
+// clusters, with the rest of the last cluster zeroed.
+void ExFATFilesystem::_writeClusters(struct exfat_journal *journal, const std::vector<cluster_t> &clusters,
+                                     const void *data, size_t size) const {
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const uint8_t *p = (const uint8_t *) data;
+
+    for (size_t i = 0; i < clusters.size(); ) {
+        size_t run = 1;
+        while (i + run < clusters.size() && clusters[i + run] == clusters[i] + run) {
+            ++run;
+        }
+        const off_t offset = exfat_geometry_c2o(&_geometry, clusters[i]);
+        const size_t bytes = run * cluster_size;
+        const size_t len = MIN(size, bytes);
+        exfat_journal_write(journal, offset, p, len);
+        exfat_journal_zero(journal, offset + len, bytes - len);
+        p += len;
+        size -= len;
+        i += run;
+    }
+}
+
+void ExFATFilesystem::_writeFat(struct exfat_journal *journal) const {
+    const off_t offset = _geometry.partition_offset + ((off_t) le32_to_cpu(_vbr.sb.fat_sector_start) << _geometry.sector_bits);
+    const uint64_t region = (uint64_t) le32_to_cpu(_vbr.sb.fat_sector_count) << _geometry.sector_bits;
+    const size_t per_record = EXFAT_JOURNAL_RECORD_BYTES / sizeof(le32_t);
+    std::vector<le32_t> buf(per_record);
+
+    for (cluster_t c = 0; c < _fat.count; c += per_record) {
+        const size_t n = MIN((size_t) (_fat.count - c), per_record);
+        for (size_t i = 0; i < n; ++i) {
+            buf[i] = cpu_to_le32(_fat.entries[c + i]);
+        }
+        exfat_journal_write(journal, offset + (off_t) c * sizeof(le32_t), buf.data(), n * sizeof(le32_t));
+    }
+    exfat_journal_zero(journal, offset + (off_t) _fat.count * sizeof(le32_t), region - _fat.count * sizeof(le32_t));
+}
+
+// The 12 sectors of a boot region: super block, 8 extended boot sectors, OEM
+// parameters, a reserved sector and the checksum of the other 11.
+void ExFATFilesystem::_writeBootRegion(struct exfat_journal *journal, off_t offset) const {
+    const size_t ss = GEOMETRY_SECTOR_SIZE(_geometry);
+    std::vector<uint8_t> region(VBR_SECTORS * ss);
+    uint32_t checksum;
+
+    memcpy(region.data(), &_vbr.sb, sizeof(_vbr.sb));
+    for (int i = 1; i <= 8; ++i) {
+        const le32_t signature = cpu_to_le32(0xAA550000);
+        memcpy(&region[(i + 1) * ss - sizeof(signature)], &signature, sizeof(signature));
+    }
+    checksum = exfat_vbr_start_checksum(region.data(), ss);
+    for (int i = 1; i < VBR_SECTORS - 1; ++i) {
+        checksum = exfat_vbr_add_checksum(&region[i * ss], ss, checksum);
+    }
+    for (size_t i = (VBR_SECTORS - 1) * ss; i < region.size(); i += sizeof(le32_t)) {
+        const le32_t value = cpu_to_le32(checksum);
+        memcpy(&region[i], &value, sizeof(value));
+    }
+    exfat_journal_write(journal, offset, region.data(), region.size());
+}
+
+// Lays out a fresh FAT, allocation bitmap, upcase table and root directory
+// around the clusters of everything recovered, and journals them together
+// with a lost+found for the orphans. The bitmap marks the whole heap in use,
+// like the one init_cluster_heap() makes, so nothing that was not recovered
+// gets overwritten once the file system is mounted again.
 void ExFATFilesystem::writeRestoreJournal(int fd) {
+    if (!_directory_tree) {
+        exfat_exception ex;
+        ex << "No file system to reconstruct";
+        throw ex;
+    }
+    const ExFATDirectoryTree &tree = *_directory_tree;
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const cluster_t end_cluster = _geometry.cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    std::vector<bool> claimed(end_cluster), truncated(tree.getNodeCount());
+    std::vector<struct exfat_entry> root, lost_found;
+    std::vector<cluster_t> lost_found_clusters;
+    cluster_t cursor = EXFAT_FIRST_DATA_CLUSTER;
+    struct exfat_journal journal;
+
+    if ((uint64_t) le32_to_cpu(_vbr.sb.fat_sector_count) << _geometry.sector_bits < (uint64_t) end_cluster * sizeof(le32_t)) {
+        exfat_exception ex;
+        ex << "No room for a FAT of " << end_cluster << " entries before the cluster heap";
+        throw ex;
+    }
+    _claimClusters(claimed, truncated);
+
+    // in the order mkexfat puts them
+    const std::vector<cluster_t> bitmap_clusters = _allocateClusters(claimed, cursor, le64_to_cpu(_bmp_entry.size));
+    const std::vector<cluster_t> upcase_clusters = _allocateClusters(claimed, cursor, sizeof(_upcase));
+    struct exfat_entry_upcase upcase;
+    memset(&upcase, 0, sizeof(upcase));
+    upcase.type = EXFAT_ENTRY_UPCASE;
+    upcase.checksum = cpu_to_le32(upcase_checksum((const uint8_t *) _upcase.upcase_entries, sizeof(_upcase)));
+    upcase.start_cluster = cpu_to_le32(upcase_clusters[0]);
+    upcase.size = cpu_to_le64(sizeof(_upcase));
+    _bmp_entry.start_cluster = cpu_to_le32(bitmap_clusters[0]);
+    root.resize(3);
+    memcpy(&root[0], &_volume_label, sizeof(struct exfat_entry));
+    memcpy(&root[1], &_bmp_entry, sizeof(struct exfat_entry));
+    memcpy(&root[2], &upcase, sizeof(struct exfat_entry));
+    tree.collectEntrySets(_filesystem.dev, ExFATDirectoryTree::ROOT, truncated, root);
+
+    if (tree.getNode(ExFATDirectoryTree::LOST_FOUND).parent == ExFATDirectoryTree::ROOT) {
+        static const char name[] = "lost+found";
+        union exfat_entries_t set[3];
+        le16_t utf16[EXFAT_ENAME_MAX];
+
+        tree.collectEntrySets(_filesystem.dev, ExFATDirectoryTree::LOST_FOUND, truncated, lost_found);
+        lost_found_clusters = _allocateClusters(claimed, cursor, lost_found.size() * sizeof(struct exfat_entry));
+        const uint64_t size = lost_found_clusters.size() * cluster_size;
+
+        memset(set, 0, sizeof(set));
+        memset(utf16, 0, sizeof(utf16));
+        utf8_to_utf16(utf16, name, EXFAT_ENAME_MAX, strlen(name));
+        _filesystem.upcase = _upcase.upcase_entries;
+        set[0].meta1.type = EXFAT_ENTRY_FILE;
+        set[0].meta1.continuations = 2;
+        set[0].meta1.attrib = cpu_to_le16(EXFAT_ATTRIB_DIR);
+        exfat_unix2exfat(time(NULL), &set[0].meta1.crdate, &set[0].meta1.crtime, &set[0].meta1.crtime_cs);
+        set[0].meta1.mdate = set[0].meta1.adate = set[0].meta1.crdate;
+        set[0].meta1.mtime = set[0].meta1.atime = set[0].meta1.crtime;
+        set[0].meta1.mtime_cs = set[0].meta1.crtime_cs;
+        set[1].meta2.type = EXFAT_ENTRY_FILE_INFO;
+        set[1].meta2.flags = EXFAT_FLAG_ALWAYS1 |
+            (lost_found_clusters.back() - lost_found_clusters.front() + 1 == lost_found_clusters.size() ? EXFAT_FLAG_CONTIGUOUS : 0);
+        set[1].meta2.name_length = strlen(name);
+        set[1].meta2.name_hash = exfat_calc_name_hash(&_filesystem, utf16, strlen(name));
+        set[1].meta2.valid_size = set[1].meta2.size = cpu_to_le64(size);
+        set[1].meta2.start_cluster = cpu_to_le32(lost_found_clusters[0]);
+        set[2].name.type = EXFAT_ENTRY_FILE_NAME;
+        memcpy(set[2].name.name, utf16, sizeof(utf16));
+        set[0].meta1.checksum = exfat_calc_checksum(&set[0].ent, 3);
+        root.insert(root.end(), &set[0].ent, &set[0].ent + 1);
+        root.insert(root.end(), &set[1].ent, &set[1].ent + 1);
+        root.insert(root.end(), &set[2].ent, &set[2].ent + 1);
+    }
+    const std::vector<cluster_t> root_clusters = _allocateClusters(claimed, cursor, root.size() * sizeof(struct exfat_entry));
+    _vbr.sb.rootdir_cluster = cpu_to_le32(root_clusters[0]);
+    _vbr.sb.volume_state = cpu_to_le16(0);
+
+    std::vector<uint8_t> bitmap(le64_to_cpu(_bmp_entry.size));
+    memcpy(bitmap.data(), _heap.allocation_flags, bitmap.size());
+    if (_geometry.cluster_count % 8 != 0) {
+        bitmap.back() &= (1u << (_geometry.cluster_count % 8)) - 1;
+    }
+
+    errno = exfat_journal_open(&journal, fd, &_geometry);
+    if (errno != 0) {
+        throw LIBC_EXCEPTION;
+    }
+    _writeClusters(&journal, bitmap_clusters, bitmap.data(), bitmap.size());
+    _writeClusters(&journal, upcase_clusters, &_upcase, sizeof(_upcase));
+    exfat_journal_barrier(&journal);
+    _writeClusters(&journal, root_clusters, root.data(), root.size() * sizeof(struct exfat_entry));
+    if (!lost_found_clusters.empty()) {
+        _writeClusters(&journal, lost_found_clusters, lost_found.data(), lost_found.size() * sizeof(struct exfat_entry));
+    }
+    tree.writeRepairJournal(&journal, _filesystem.dev, truncated);
+    exfat_journal_barrier(&journal);
+    _writeFat(&journal);
+    exfat_journal_barrier(&journal);
+    _writeBootRegion(&journal, _geometry.partition_offset + ((off_t) VBR_SECTORS << _geometry.sector_bits));
+    exfat_journal_barrier(&journal);
+    _writeBootRegion(&journal, _geometry.partition_offset);
+    exfat_journal_barrier(&journal);
+
+    const uint64_t records = journal.records, bytes = journal.bytes;
+    errno = exfat_journal_close(&journal);
+    if (errno != 0) {
+        throw LIBC_EXCEPTION;
+    }
+    std::cerr << "Journaled " << bytes << " bytes in " << records << " records, root directory at cluster "
+        << root_clusters[0] << std::endl;
 }
 
 void ExFATFilesystem::reconstructLive(int fd) {
+    writeRestoreJournal(fd);
+    if (exfat_get_mode(_filesystem.dev) != EXFAT_MODE_RW) {
+        exfat_close(_filesystem.dev);
+        _filesystem.dev = exfat_open(_device_path.c_str(), EXFAT_MODE_RW);
+        if (_filesystem.dev == nullptr) {
+            throw LIBC_EXCEPTION;
+        }
+    }
+    const int ret = exfat_journal_replay(_filesystem.dev, fd);
+    if (ret != 0) {
+        exfat_exception ex;
+        ex << "Unable to apply the reconstruction journal: " << strerror(ret);
+        throw ex;
+    }
 }
 
 void ExFATFilesystem::_processLine(std::string &line, std::istringstream &iss, size_t line_no) throw() {
@@ -117,62 +914,120 @@ void ExFATFilesystem::_processLine(std::string &line, std::istringstream &iss, s
 }
 
 void ExFATFilesystem::_processFileDirectoryEntry(off_t disk_offset) throw() {
-    //_processFileDirectoryEntryCb(disk_offset, _directory_tree::addNode);
-    _processFileDirectoryEntryCb(disk_offset, [this](off_t fs_offset, struct exfat_node_entry& entry) {
-        le16_t fname_utf16[EXFAT_NAME_MAX];
-        le16_t *pfname_utf16 = fname_utf16;
-        char fname[EXFAT_UTF8_ENAME_BUFFER_MAX];
-        char *pfname = fname;
-
-        if (entry.fde.attrib.__u16 & EXFAT_ATTRIB_DIR) { // this is a directory, skip
-        } else { // going to assume it is a file
-            bool copy = false;
-            for (int c = 0; c < entry.fde.continuations - 2; ++c) {
-                if (entry.u_continuations[c].ent.type == EXFAT_ENTRY_FILE_NAME) {
-                    memcpy(pfname_utf16, entry.u_continuations[c].name.name, EXFAT_ENAME_MAX * sizeof(le16_t));
-                    pfname_utf16 += EXFAT_ENAME_MAX;
-                }
-            }
-            pfname_utf16->__u16 = 0;
-            int res = utf16_to_utf8(fname, fname_utf16, sizeof(fname), sizeof(le16_t) * EXFAT_NAME_MAX);
-            if (res == 0) {
-                //check name
-                std::string s(fname);
-                if (s.rfind(".DTS") != std::string::npos || s.rfind(".dts") != std::string::npos) {
-                    //check name
-                }
-            }
+    _pending_fde_offsets.push_back(disk_offset);
+}
+
+void ExFATFilesystem::_processPendingFileDirectoryEntries() throw() {
+    _processFileDirectoryEntriesCb(_pending_fde_offsets, [this](off_t fs_offset, struct exfat_node_entry& entry) {
+        try {
+            _directory_tree->addNode(fs_offset, entry);
+        } catch (exfat_exception &ex) {
+            std::cerr << "Skipping FDE at " << std::hex << fs_offset << std::dec << ": " << ex.what() << std::endl;
         }
     });
+    _pending_fde_offsets.clear();
+    _pending_fde_offsets.shrink_to_fit();
 }
 
-void ExFATFilesystem::_processFileDirectoryEntryCb(
-    off_t disk_offset,
-    std::function<void(off_t, struct exfat_node_entry&)> fun) throw()
+// Sorts the offsets and reads runs of adjacent clusters holding FDEs with one
+// read of up to FDE_BATCH_BYTES, instead of one small random read per FDE.
+// Every read is padded by one exfat_node_entry so entry sets straddling the
+// end of the run come out whole. A batch that cannot be read is reported and
+// its entry sets are skipped.
+template <typename Callback>
+void ExFATFilesystem::_processFileDirectoryEntriesCb(std::vector<off_t> &disk_offsets, Callback fun) throw()
 {
-    struct exfat_node_entry node_entry;
-    ssize_t rd = exfat_pread(_filesystem.dev, &node_entry, sizeof(node_entry), disk_offset);
-    if (rd == sizeof(struct exfat_node_entry)) {
-        fun(disk_offset, node_entry);
-    } else if (rd == 0) {
-        return;
-    } else if (rd == -1) {
-        throw LIBC_EXCEPTION;
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const size_t batch_max = MAX(cluster_size, FDE_BATCH_BYTES);
+    std::vector<uint8_t> buf(batch_max + sizeof(struct exfat_node_entry));
+
+    std::sort(disk_offsets.begin(), disk_offsets.end());
+    disk_offsets.erase(std::unique(disk_offsets.begin(), disk_offsets.end()), disk_offsets.end());
+
+    for (size_t i = 0; i < disk_offsets.size(); ) {
+        off_t batch_offset = disk_offsets[i];
+        size_t j = i + 1;
+
+        if (disk_offsets[i] >= _geometry.cluster_heap_offset) {
+            const cluster_t first_cluster = exfat_geometry_o2c(&_geometry, disk_offsets[i]);
+            cluster_t last_cluster = first_cluster;
+            for (; j < disk_offsets.size(); ++j) {
+                const cluster_t c = exfat_geometry_o2c(&_geometry, disk_offsets[j]);
+                if (c > last_cluster + 1 || (size_t) (c - first_cluster + 1) * cluster_size > batch_max) {
+                    break;
+                }
+                last_cluster = c;
+            }
+            batch_offset = exfat_geometry_c2o(&_geometry, first_cluster);
+        }
+
+        const size_t batch_size = disk_offsets[j - 1] - batch_offset + sizeof(struct exfat_node_entry);
+        ssize_t rd = exfat_pread(_filesystem.dev, buf.data(), batch_size, batch_offset);
+        if (rd == -1) {
+            std::cerr << "Skipping " << j - i << " FDEs: failed to read " << batch_size << " bytes at "
+                      << std::hex << batch_offset << std::dec << ": " << strerror(errno) << std::endl;
+            i = j;
+            continue;
+        }
+        for (; i < j; ++i) {
+            const size_t pos = disk_offsets[i] - batch_offset;
+            if (pos + sizeof(struct exfat_node_entry) > (size_t) rd) {
+                break; // past the end of the device
+            }
+            // exfat_node_entry is packed, so any position in the buffer will do
+            fun(disk_offsets[i], *reinterpret_cast<struct exfat_node_entry *>(buf.data() + pos));
+        }
+        i = j;
     }
 }
 
 /* C API */
 exfat_filesystem_t reconstruct_filesystem_from_scan_logfile(const char *fsdev, const char *logfilename) {
     ExFATFilesystem *fs = new ExFATFilesystem;
-    fs->openFilesystem(fsdev, 0, false);
-    fs->rebuildFromScanLogfile(logfilename);
+    try {
+        fs->openFilesystem(fsdev, 0, false);
+        fs->rebuildFromScanLogfile(logfilename);
+    } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        delete fs;
+        return NULL;
+    }
     return fs;
 }
 
-void write_fs_reconstruct_journal(exfat_filesystem_t fs, int fd) {
+int write_fs_reconstruct_journal(exfat_filesystem_t fs, int fd) {
+    try {
+        ((ExFATFilesystem*)fs)->writeRestoreJournal(fd);
+    } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        return EIO;
+    }
+    return 0;
 }
 
-void reconstruct_live_fs(exfat_filesystem_t fs, int fd) {
+int reconstruct_live_fs(exfat_filesystem_t fs, int fd) {
+    try {
+        ((ExFATFilesystem*)fs)->reconstructLive(fd);
+    } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        return EIO;
+    }
+    return 0;
+}
+
+void set_chain_resolver(exfat_filesystem_t fs, exfat_chain_resolver_t resolver, void *ctx) {
+    ((ExFATFilesystem*)fs)->setChainResolver(resolver, ctx);
+}
+
+int restore_files_from_scan_logfile(exfat_filesystem_t fs, const char *filter, const char *output_dir, unsigned workers) {
+    try {
+        ((ExFATFilesystem*)fs)->setRestoreWorkers(workers);
+        ((ExFATFilesystem*)fs)->restoreFilesFromScanLogFile(filter, output_dir);
+    } catch (std::exception &ex) {
+        std::cerr << ex.what() << std::endl;
+        return EIO;
+    }
+    return 0;
 }
 
 void free_filesystem(exfat_filesystem_t fs) {
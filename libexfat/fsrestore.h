@@ -29,10 +29,20 @@ extern "C" {
 
 typedef void* exfat_filesystem_t;
 
+/* Called for fragmented files whose FAT chain is gone. Fills chain with up to
+   clusters cluster numbers, the first being start_cluster, and returns how
+   many it could place; anything short of clusters is treated as a failure.
+   Called from several restore workers at once. */
+typedef cluster_t (*exfat_chain_resolver_t)(struct exfat_dev *dev, const struct exfat_geometry *geo,
+        const char *name, cluster_t start_cluster, uint64_t size, cluster_t *chain, cluster_t clusters,
+        void *ctx);
+
 /* Public C API */
 exfat_filesystem_t reconstruct_filesystem_from_scan_logfile(const char *fsdev, const char *logfilename);
-void write_fs_reconstruct_journal(exfat_filesystem_t fs, int fd);
-void reconstruct_live_fs(exfat_filesystem_t fs, int fd);
+int write_fs_reconstruct_journal(exfat_filesystem_t fs, int fd);
+int reconstruct_live_fs(exfat_filesystem_t fs, int fd);
+void set_chain_resolver(exfat_filesystem_t fs, exfat_chain_resolver_t resolver, void *ctx);
+int restore_files_from_scan_logfile(exfat_filesystem_t fs, const char *filter, const char *output_dir, unsigned workers);
 void free_filesystem(exfat_filesystem_t fs);
 
 #ifdef __cplusplus
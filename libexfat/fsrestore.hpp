@@ -30,7 +30,7 @@
 #include <set>
 #include <string>
 #include <exception>
-#include <functional>
+#include <vector>
 #include <cerrno>
 #include <cstring>
 
@@ -43,23 +43,66 @@ public:
     ExFATFilesystem();
     virtual ~ExFATFilesystem();
 
-    void openFilesystem(std::string device_path, off_t filesystem_offset, bool rw) throw(); // from start of partition or disk
-    void rebuildFromScanLogfile(std::string filename) throw();
+    void openFilesystem(std::string device_path, off_t filesystem_offset, bool rw); // from start of partition or disk
+    void rebuildFromScanLogfile(std::string filename);
+    // Writes everything needed to make the file system mountable again to fd,
+    // without touching the device; see exfat_journal_replay() for applying it.
     void writeRestoreJournal(int fd);
+    // Writes the journal to fd, then replays it onto the device.
     void reconstructLive(int fd);
-    void restoreFilesFromScanLogFile(std::string filter, std::string output_dir) throw();
+    // filter is "<glob>[:<min>-<max>]" or "re:<regex>[:<min>-<max>]", matched
+    // case-insensitively against file names; sizes take K, M, G and T suffixes
+    // and either end of the range may be left out
+    void restoreFilesFromScanLogFile(std::string filter, std::string output_dir);
+    void setRestoreWorkers(unsigned workers) { _restore_workers = workers != 0 ? workers : 1; }
+    // asked for the clusters of fragmented files the FAT knows nothing about
+    void setChainResolver(exfat_chain_resolver_t resolver, void *ctx) { _chain_resolver = resolver; _chain_resolver_ctx = ctx; }
 
 private:
+    struct RestoreJob
+    {
+        ExFATDirectoryTree::node_index_t node;
+        cluster_t start_cluster;
+        std::string path;
+    };
+
+    struct Extent
+    {
+        off_t offset;
+        uint64_t length;
+    };
+
+    std::string _nodePath(ExFATDirectoryTree::node_index_t node) const;
+    bool _restoreFile(const RestoreJob &job, uint8_t *buffer, size_t buffer_size) noexcept;
+    bool _resolveChain(cluster_t start_cluster, const std::string &path, uint64_t size, std::vector<cluster_t> &chain) const noexcept;
+    bool _chainExtents(const RestoreJob &job, uint64_t size, uint64_t length, std::vector<Extent> &extents) const noexcept;
+    bool _copyExtent(const std::string &path, int fd, off_t offset, uint64_t length, uint8_t *buffer, size_t buffer_size) noexcept;
+    bool _copyExtentBuffered(const std::string &path, int fd, off_t offset, uint64_t length, uint8_t *buffer, size_t buffer_size) noexcept;
+
+    void _claimClusters(std::vector<bool> &claimed, std::vector<bool> &truncated);
+    std::vector<cluster_t> _allocateClusters(std::vector<bool> &claimed, cluster_t &cursor, uint64_t size);
+    void _writeClusters(struct exfat_journal *journal, const std::vector<cluster_t> &clusters, const void *data, size_t size) const;
+    void _writeFat(struct exfat_journal *journal) const;
+    void _writeBootRegion(struct exfat_journal *journal, off_t offset) const;
+
     void _processLine(std::string &line, std::istringstream &iss, size_t line_no) throw();
     void _processFileDirectoryEntry(off_t disk_offset) throw();
-    void _processFileDirectoryEntryCb(off_t disk_offset, std::function<void(off_t, struct exfat_node_entry&)> fun) throw();
+    void _processPendingFileDirectoryEntries() throw();
+    template <typename Callback>
+    void _processFileDirectoryEntriesCb(std::vector<off_t> &disk_offsets, Callback fun) throw();
 
     std::string _device_path;
 
     std::unique_ptr<ExFATDirectoryTree> _directory_tree;
+    std::vector<off_t> _pending_fde_offsets; // FDEs seen in the log, read in disk order later
+    unsigned _restore_workers;
+    exfat_chain_resolver_t _chain_resolver;
+    void *_chain_resolver_ctx;
 
     struct exfat _filesystem;
+    struct exfat_geometry _geometry;
     struct exfat_file_allocation_table _fat;
+    struct exfat_fat_fragments _fat_fragments; // what is left of the original FAT
     struct exfat_cluster_heap _heap;
     struct exfat_upcase_table _upcase;
     struct exfat_entry_label _volume_label;
@@ -82,17 +125,17 @@ private:
             //    uint8_t    __unused1[53];            /* 0x0B always 0 */
             .__unused1 = {0},
             //    le64_t sector_start;            /* 0x40 partition first sector */
-            .sector_start = {PARTITION_START_SECTOR},        // 409640
+            .sector_start = {0},               // from _geometry
             //    le64_t sector_count;            /* 0x48 partition sectors count */
-            .sector_count = {0x1D1B977B7},     // 7813560247
+            .sector_count = {0},               // from _geometry
             //    le32_t fat_sector_start;        /* 0x50 FAT first sector */
             .fat_sector_start = {0},
             //    le32_t fat_sector_count;        /* 0x54 FAT sectors count */
             .fat_sector_count = {0},
             //    le32_t cluster_sector_start;    /* 0x58 first cluster sector */
-            .cluster_sector_start = {CLUSTER_HEAP_PARTITION_START_SECTOR},
+            .cluster_sector_start = {0},       // from _geometry
             //    le32_t cluster_count;            /* 0x5C total clusters count */
-            .cluster_count = {FAT_CLUSTER_COUNT},
+            .cluster_count = {0},              // from _geometry
             //    le32_t rootdir_cluster;            /* 0x60 first cluster of the root dir */
             .rootdir_cluster = {0},
             //    le32_t volume_serial;            /* 0x64 volume serial number */
@@ -131,15 +174,6 @@ private:
             .chksum = {0},
         } },
     };
-
-    static constexpr struct exfat_entry_bitmap BMP_ENTRY =            /* allocated clusters bitmap */
-    {
-        .type = EXFAT_ENTRY_BITMAP,                    /* EXFAT_ENTRY_BITMAP */
-        .bitmap_flags = 0,            /* bit 0: 0 = 1st cluster heap. 1 = 2nd cluster heap. */
-        .__unknown1 = {0},
-        .start_cluster = {2},
-        .size = {(FAT_CLUSTER_COUNT) / 8 + (FAT_CLUSTER_COUNT) % 8} /* in bytes = Ceil (Cluster count / 8 ) */
-    };
 };
 
 #endif /* fsrestore_hpp */
@@ -24,24 +24,71 @@
 #include "fstree.hpp"
 #include "fsexcept.hpp"
 
+#include <algorithm>
 #include <iomanip>
 
-ExFATDirectoryTree::ExFATDirectoryTree(off_t root_directory_offset)
+constexpr ExFATDirectoryTree::node_index_t ExFATDirectoryTree::NIL;
+constexpr ExFATDirectoryTree::node_index_t ExFATDirectoryTree::ROOT;
+constexpr ExFATDirectoryTree::node_index_t ExFATDirectoryTree::LOST_FOUND;
+
+#define STATE_DUPLICATE 0x80
+#define STATE_ON_PATH 1
+#define STATE_DONE 2
+
+ExFATDirectoryTree::ExFATDirectoryTree(const struct exfat_geometry &geometry) :
+    _geometry(geometry),
+    _directory_count(0),
+    _duplicate_count(0),
+    _orphan_count(0)
 {
-    struct exfat_node_entry entry;
-    _root_directory = std::make_shared<RootDirectory>(root_directory_offset, entry);
+    _newNode(EXFAT_ATTRIB_DIR, "", 0);
+    _newNode(EXFAT_ATTRIB_DIR, "lost+found", strlen("lost+found"));
 }
 
 ExFATDirectoryTree::~ExFATDirectoryTree() {
 
 }
 
-void ExFATDirectoryTree::addNode(off_t fde_offset, struct exfat_node_entry &entry) throw() {
+// FNV-1a; identical names share one copy in the arena
+uint32_t ExFATDirectoryTree::_internName(const char *name, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (uint8_t) name[i]) * 0x100000001b3ULL;
+    }
+    auto it = _name_index.find(hash);
+    if (it != _name_index.end() &&
+        strncmp(&_names[it->second], name, length) == 0 && _names[it->second + length] == '\0') {
+        return it->second;
+    }
+    const uint32_t offset = _names.size();
+    _names.insert(_names.end(), name, name + length);
+    _names.push_back('\0');
+    if (it == _name_index.end()) {
+        _name_index.emplace(hash, offset);
+    }
+    return offset;
+}
+
+ExFATDirectoryTree::node_index_t ExFATDirectoryTree::_newNode(uint16_t attrib, const char *name, size_t name_length) {
+    Node node;
+    memset(&node, 0, sizeof(node));
+    node.attrib = attrib;
+    node.parent = NIL;
+    node.name = _internName(name, name_length);
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+}
+
+void ExFATDirectoryTree::addNode(off_t fde_offset, struct exfat_node_entry &entry) {
+    le16_t name[EXFAT_NAME_MAX + 1];
+    char utf8[EXFAT_UTF8_NAME_BUFFER_MAX];
+    size_t length = 0;
+
     // verify checksum
     const uint8_t continuations = entry.fde.continuations;
     if (continuations < 2 || continuations > 18) {
         exfat_exception except;
-        except << "bad number of continuations " << continuations;
+        except << "bad number of continuations " << (unsigned) continuations;
         throw except;
     }
 
@@ -53,16 +100,248 @@ void ExFATDirectoryTree::addNode(off_t fde_offset, struct exfat_node_entry &entr
         throw except;
     }
 
-    if (entry.fde.attrib.__u16 & EXFAT_ATTRIB_DIR) { // this is a directory
-        //a
-    } else { // going to assume it is a file
+    // the first name entry is efn, the rest are continuations after it
+    for (int i = 0; i < continuations - 1 && length < EXFAT_NAME_MAX; ++i) {
+        const struct exfat_entry_name &efn = i == 0 ? entry.efn : entry.u_continuations[i - 1].name;
+        if (efn.type != EXFAT_ENTRY_FILE_NAME) {
+            break;
+        }
+        memcpy(name + length, efn.name, EXFAT_ENAME_MAX * sizeof(le16_t));
+        length += EXFAT_ENAME_MAX;
+    }
+    length = MIN(length, (size_t) entry.efi.name_length);
+    name[length] = cpu_to_le16(0);
+    if (utf16_to_utf8(utf8, name, sizeof(utf8), length + 1) != 0) {
+        utf8[0] = '\0';
+    }
+
+    const node_index_t index = _newNode(le16_to_cpu(entry.fde.attrib), utf8, strlen(utf8));
+    Node &node = _nodes[index];
+    node.offset = fde_offset;
+    node.size = le64_to_cpu(entry.efi.size);
+    node.valid_size = le64_to_cpu(entry.efi.valid_size);
+    node.start_cluster = le32_to_cpu(entry.efi.start_cluster);
+    node.flags = entry.efi.flags;
+    if (node.isDirectory()) {
+        ++_directory_count;
+    }
+}
+
+ExFATDirectoryTree::node_index_t ExFATDirectoryTree::findNode(off_t fde_offset) const {
+    auto it = std::lower_bound(_by_offset.begin(), _by_offset.end(), fde_offset,
+                               [this](node_index_t n, off_t offset) { return (off_t) _nodes[n].offset < offset; });
+    if (it != _by_offset.end() && (off_t) _nodes[*it].offset == fde_offset) {
+        return *it;
+    }
+    return NIL;
+}
+
+// Every directory claims the clusters it occupies, then each entry set finds
+// its parent by looking up the cluster it was found in. Directories which are
+// not contiguous only claim their first cluster, since the FAT is gone; what
+// was found in their other clusters ends up in lost+found.
+void ExFATDirectoryTree::resolveParents() noexcept {
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    const cluster_t end_cluster = _geometry.cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    const node_index_t count = _nodes.size();
+    std::unordered_map<cluster_t, node_index_t> cluster_map;
+    size_t cluster_total = 1;
+
+    // entries logged twice are dropped, the first one stays
+    _by_offset.clear();
+    _by_offset.reserve(count);
+    for (node_index_t n = ROOT; n < count; ++n) {
+        _nodes[n].parent = NIL;
+        _nodes[n].state = 0;
+        if (n > LOST_FOUND) {
+            _by_offset.push_back(n);
+        }
+    }
+    std::stable_sort(_by_offset.begin(), _by_offset.end(),
+                     [this](node_index_t a, node_index_t b) { return _nodes[a].offset < _nodes[b].offset; });
+    _duplicate_count = 0;
+    _directory_count = 0;
+    auto last = _by_offset.begin();
+    for (auto it = _by_offset.begin(); it != _by_offset.end(); ++it) {
+        if (it != _by_offset.begin() && _nodes[*it].offset == _nodes[*(last - 1)].offset) {
+            _nodes[*it].state = STATE_DUPLICATE;
+            ++_duplicate_count;
+        } else {
+            *last++ = *it;
+            _directory_count += _nodes[*it].isDirectory();
+        }
+    }
+    _by_offset.erase(last, _by_offset.end());
+
+    for (node_index_t n = LOST_FOUND + 1; n < count; ++n) {
+        const Node &dir = _nodes[n];
+        if (dir.isDirectory() && dir.state == 0) {
+            cluster_total += dir.isFragmented() ? 1 : DIV_ROUND_UP(dir.size, cluster_size);
+        }
+    }
+    cluster_map.reserve(cluster_total);
+    if (_geometry.rootdir_cluster != 0) {
+        cluster_map.emplace(_geometry.rootdir_cluster, ROOT);
+    }
+    for (node_index_t n = LOST_FOUND + 1; n < count; ++n) {
+        const Node &dir = _nodes[n];
+        if (!dir.isDirectory() || dir.state != 0 ||
+            dir.start_cluster < EXFAT_FIRST_DATA_CLUSTER || dir.start_cluster >= end_cluster) {
+            continue;
+        }
+        const size_t clusters = dir.isFragmented() ? 1 : MAX(DIV_ROUND_UP(dir.size, cluster_size), 1);
+        for (size_t c = 0; c < clusters && dir.start_cluster + c < end_cluster; ++c) {
+            cluster_map.emplace(dir.start_cluster + c, n); // first claim wins
+        }
+    }
+
+    _orphan_count = 0;
+    for (node_index_t n = LOST_FOUND + 1; n < count; ++n) {
+        if (_nodes[n].state != 0) {
+            continue;
+        }
+        auto parent = cluster_map.find(exfat_geometry_o2c(&_geometry, _nodes[n].offset));
+        if (parent != cluster_map.end() && parent->second != n) {
+            _nodes[n].parent = parent->second;
+        } else {
+            _nodes[n].parent = LOST_FOUND;
+            ++_orphan_count;
+        }
+    }
+
+    // Garbage can make directories each other's ancestors. Walk up from every
+    // directory once; meeting a directory already on the current path means a
+    // cycle, which is broken by moving that directory to lost+found.
+    std::vector<node_index_t> path;
+    for (node_index_t n = LOST_FOUND + 1; n < count; ++n) {
+        if (!_nodes[n].isDirectory() || _nodes[n].state != 0) {
+            continue;
+        }
+        node_index_t d = n;
+        path.clear();
+        while (d > LOST_FOUND && _nodes[d].state == 0) {
+            _nodes[d].state = STATE_ON_PATH;
+            path.push_back(d);
+            d = _nodes[d].parent;
+        }
+        if (d > LOST_FOUND && _nodes[d].state == STATE_ON_PATH) {
+            _nodes[d].parent = LOST_FOUND;
+            ++_orphan_count;
+        }
+        for (node_index_t p : path) {
+            _nodes[p].state = STATE_DONE;
+        }
+    }
+
+    // children as contiguous runs of one array, counting sort by parent
+    const bool lost_found_used = _orphan_count != 0;
+    _nodes[LOST_FOUND].parent = lost_found_used ? ROOT : NIL;
+    for (node_index_t n = ROOT; n < count; ++n) {
+        _nodes[n].child_count = 0;
+    }
+    size_t linked = 0;
+    for (node_index_t n = LOST_FOUND; n < count; ++n) {
+        if (_nodes[n].parent != NIL) {
+            ++_nodes[_nodes[n].parent].child_count;
+            ++linked;
+        }
+    }
+    uint32_t first = 0;
+    for (node_index_t n = ROOT; n < count; ++n) {
+        _nodes[n].first_child = first;
+        first += _nodes[n].child_count;
+        _nodes[n].child_count = 0;
+    }
+    _children.assign(linked, NIL);
+    for (node_index_t n = LOST_FOUND; n < count; ++n) {
+        Node &node = _nodes[n];
+        if (node.parent != NIL) {
+            Node &parent = _nodes[node.parent];
+            _children[parent.first_child + parent.child_count++] = n;
+        }
+    }
+    _children.shrink_to_fit();
+}
+
+void ExFATDirectoryTree::printTree(std::ostream &os) const {
+    std::vector<std::pair<node_index_t, int>> stack;
+    stack.emplace_back(ROOT, 0);
+    while (!stack.empty()) {
+        const node_index_t n = stack.back().first;
+        const int depth = stack.back().second;
+        const Node &node = _nodes[n];
+        stack.pop_back();
+
+        os << std::string(depth * 2, ' ') << getName(n) << (node.isDirectory() ? "/" : "");
+        if (node.offset != 0) {
+            os << " [" << std::hex << std::setw(16) << std::setfill('0') << node.offset << std::dec << "]";
+        }
+        os << std::endl;
+        for (const node_index_t *child = childrenEnd(n); child != childrenBegin(n); ) {
+            stack.emplace_back(*--child, depth + 1);
+        }
+    }
+}
+
+// Reads the entry set of node n as it is on the disk into entries, which has
+// room for a whole one, and returns the number of entries in it, 0 if it is
+// no longer what the scanner found there.
+int ExFATDirectoryTree::_readEntrySet(struct exfat_dev *dev, node_index_t n, bool truncate,
+                                      struct exfat_entry *entries) const {
+    const Node &node = _nodes[n];
+    const size_t cluster_size = GEOMETRY_CLUSTER_SIZE(_geometry);
+    struct exfat_entry_meta1 *fde = (struct exfat_entry_meta1 *) &entries[0];
+    struct exfat_entry_meta2 *efi = (struct exfat_entry_meta2 *) &entries[1];
+    const ssize_t rd = exfat_pread(dev, entries, sizeof(struct exfat_node_entry), node.offset);
+
+    if (rd < (ssize_t) (3 * sizeof(struct exfat_entry)) || fde->type != EXFAT_ENTRY_FILE ||
+        fde->continuations < 2 || fde->continuations > 18 ||
+        (size_t) rd < (fde->continuations + 1) * sizeof(struct exfat_entry) ||
+        le16_to_cpu(exfat_calc_checksum(entries, fde->continuations + 1)) != le16_to_cpu(fde->checksum)) {
+        std::cerr << getName(n) << ": entry set at " << std::hex << node.offset << std::dec
+            << " has changed since the scan, left out" << std::endl;
+        return 0;
     }
+    if (truncate) {
+        efi->flags |= EXFAT_FLAG_CONTIGUOUS;
+        efi->size = efi->valid_size = cpu_to_le64(cluster_size);
+        fde->checksum = exfat_calc_checksum(entries, fde->continuations + 1);
+    }
+    return fde->continuations + 1;
 }
 
-void ExFATDirectoryTree::writeRepairJournal(int fd) throw() {
-    
+void ExFATDirectoryTree::collectEntrySets(struct exfat_dev *dev, node_index_t dir, const std::vector<bool> &truncated,
+                                          std::vector<struct exfat_entry> &entries) const {
+    struct exfat_node_entry set;
+    std::vector<node_index_t> children;
+
+    for (const node_index_t *child = childrenBegin(dir); child != childrenEnd(dir); ++child) {
+        if (_nodes[*child].offset != 0) {
+            children.push_back(*child);
+        }
+    }
+    // in disk order, they were logged in whatever order the scan found them
+    std::sort(children.begin(), children.end(),
+              [this](node_index_t a, node_index_t b) { return _nodes[a].offset < _nodes[b].offset; });
+    for (node_index_t n : children) {
+        const struct exfat_entry *first = (const struct exfat_entry *) &set;
+        const int count = _readEntrySet(dev, n, truncated[n], (struct exfat_entry *) &set);
+        entries.insert(entries.end(), first, first + count);
+    }
 }
 
-void ExFATDirectoryTree::reconstructLive(int fd) throw() {
-    
+void ExFATDirectoryTree::writeRepairJournal(struct exfat_journal *journal, struct exfat_dev *dev,
+                                            const std::vector<bool> &truncated) const {
+    struct exfat_node_entry set;
+
+    for (node_index_t n : _by_offset) {
+        const node_index_t parent = _nodes[n].parent;
+        if (!truncated[n] || parent == ROOT || parent == LOST_FOUND || parent == NIL) {
+            continue;
+        }
+        const int count = _readEntrySet(dev, n, true, (struct exfat_entry *) &set);
+        if (count != 0) {
+            exfat_journal_write(journal, _nodes[n].offset, &set, count * sizeof(struct exfat_entry));
+        }
+    }
 }
@@ -26,84 +26,89 @@
 #include "exfat.h"
 
 #include <iostream>
-#include <map>
 #include <unordered_map>
-#include <memory>
-#include <set>
 #include <string>
+#include <vector>
 #include <cstring>
 
 #include "fsexcept.hpp"
 
 struct exfat;
 
+// Directory tree rebuilt from the entry sets found by the scanner. Nodes live
+// in one array and refer to each other by 32-bit index, names are interned in
+// a single string arena, and after resolveParents() the children of every
+// directory are a contiguous run of one shared index array.
 class ExFATDirectoryTree
 {
 public:
-    ExFATDirectoryTree(off_t root_directory_offset);
-    virtual ~ExFATDirectoryTree();
-
-    void addNode(off_t fde_offset, struct exfat_node_entry &entry) throw();
-    void writeRepairJournal(int fd) throw();
-    void reconstructLive(int fd) throw();
-
-//private:
-    class Node;
-    class Directory;
-    class RootDirectory;
-    class File;
-
-    std::shared_ptr<RootDirectory> _root_directory;
-    std::unordered_map<off_t, std::shared_ptr<Node>> _node_offset_map;
-
-    class Node
-    {
-    public:
-        Node() {}
-        Node(std::shared_ptr<Directory> &parent) : _parent(parent) {}
-        virtual ~Node() {}
-
-        virtual bool loadFromFDE(off_t fde_offset, struct exfat_node_entry &entry) throw();
-
-        struct exfat_node_entry &getNodeEntry() { return _entry; }
-        bool isFragmented() const { return EXFAT_FLAG_CONTIGUOUS & _entry.efi.flags; }
-        size_t getSize() const { return _entry.efi.size.__u64; }
-    protected:
-        Node(off_t offset, struct exfat_node_entry &entry) : _node_offset(offset), _entry(entry) {}
-    private:
-        off_t _node_offset;
-        struct exfat_node_entry _entry;
-        std::shared_ptr<Directory> _parent;
-        std::string _name; // utf-8
-    };
+    typedef uint32_t node_index_t;
+    static constexpr node_index_t NIL = (node_index_t) -1;
+    static constexpr node_index_t ROOT = 0;
+    static constexpr node_index_t LOST_FOUND = 1;
 
-    class Directory : public Node
+    struct Node
     {
-    public:
-        Directory() {}
-        Directory(std::shared_ptr<Directory> &parent) : Node(parent) {}
-        virtual ~Directory() {}
-
-        void addChild(std::shared_ptr<Node> child) noexcept;
-    protected:
-        Directory(off_t offset, struct exfat_node_entry &entry) : Node(offset, entry) {}
-    private:
-        std::set<std::shared_ptr<Node>> _children;
+        uint64_t offset;            // FDE on disk, 0 for root and lost+found
+        uint64_t size;
+        uint64_t valid_size;
+        cluster_t start_cluster;
+        node_index_t parent;
+        uint32_t first_child;       // into _children, valid after resolveParents()
+        uint32_t child_count;
+        uint32_t name;              // into _names
+        uint16_t attrib;
+        uint8_t flags;              // EXFAT_FLAG_xxx
+        uint8_t state;              // scratch for resolveParents()
+
+        bool isDirectory() const { return attrib & EXFAT_ATTRIB_DIR; }
+        bool isFragmented() const { return !(flags & EXFAT_FLAG_CONTIGUOUS); }
     };
 
-    class RootDirectory : public Directory
-    {
-    public:
-        RootDirectory(off_t offset, struct exfat_node_entry &entry) : Directory(offset, entry) {}
-    };
+    ExFATDirectoryTree(const struct exfat_geometry &geometry);
+    virtual ~ExFATDirectoryTree();
 
-    class File : public Node
-    {
-    public:
-        File(std::shared_ptr<Directory> &parent) : Node(parent) {}
-        virtual ~File() {}
-    private:
-    };
+    // Throws exfat_exception for an entry set that does not check out, which
+    // the caller skips.
+    void addNode(off_t fde_offset, struct exfat_node_entry &entry);
+    void resolveParents() noexcept;
+    void printTree(std::ostream &os) const;
+    // Appends the entry sets of dir's children, read back from the disk, for
+    // the directories reconstruction has to make up: the root and lost+found.
+    // Directories marked in truncated are cut down to their first cluster.
+    void collectEntrySets(struct exfat_dev *dev, node_index_t dir, const std::vector<bool> &truncated,
+                          std::vector<struct exfat_entry> &entries) const;
+    // Rewrites in place the entry sets of truncated directories which are
+    // not collected into one of those.
+    void writeRepairJournal(struct exfat_journal *journal, struct exfat_dev *dev,
+                            const std::vector<bool> &truncated) const;
+
+    const Node &getNode(node_index_t index) const { return _nodes[index]; }
+    const char *getName(node_index_t index) const { return &_names[_nodes[index].name]; }
+    node_index_t findNode(off_t fde_offset) const;
+    size_t getNodeCount() const { return _nodes.size(); }
+
+    const node_index_t *childrenBegin(node_index_t dir) const { return _children.data() + _nodes[dir].first_child; }
+    const node_index_t *childrenEnd(node_index_t dir) const { return childrenBegin(dir) + _nodes[dir].child_count; }
+
+    size_t getDirectoryCount() const { return _directory_count; }
+    size_t getFileCount() const { return _nodes.size() - 2 - _directory_count - _duplicate_count; }
+    size_t getOrphanCount() const { return _orphan_count; }
+
+private:
+    int _readEntrySet(struct exfat_dev *dev, node_index_t n, bool truncate, struct exfat_entry *entries) const;
+    node_index_t _newNode(uint16_t attrib, const char *name, size_t name_length);
+    uint32_t _internName(const char *name, size_t length);
+
+    struct exfat_geometry _geometry;
+    std::vector<Node> _nodes;
+    std::vector<node_index_t> _children;
+    std::vector<node_index_t> _by_offset;   // sorted by FDE offset, valid after resolveParents()
+    std::vector<char> _names;
+    std::unordered_map<uint64_t, uint32_t> _name_index; // name hash -> _names offset
+    size_t _directory_count;
+    size_t _duplicate_count;
+    size_t _orphan_count;
 };
 
 #endif /* fstree_hpp */
@@ -0,0 +1,532 @@
+//
+//  geometry.c
+//  NuclearHolocaust
+//
+//  Copyright © 2019 Paul Ciarlo. All rights reserved.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+
+#include "exfat.h"
+
+#define MBR_SECTOR_SIZE 512     // LBAs in partition tables are assumed to be 512 bytes
+#define MAX_PARTITIONS 16
+#define GPT_MAX_ENTRIES 128
+#define VBR_SEARCH_CHUNK ((size_t) 1024 * 1024)
+// around each sample that had hits, read this much more to catch the
+// subdirectories which are usually allocated close to their parent
+#define GEOMETRY_DENSE_BYTES ((size_t) 4 * 1024 * 1024)
+#define GEOMETRY_DENSE_SAMPLES 64
+// caps the voting at GEOMETRY_VOTE_MAX^2 candidates per cluster size
+#define GEOMETRY_VOTE_MAX 1024
+
+static uint32_t get_le32(const uint8_t *p) {
+    le32_t v;
+    memcpy(&v, p, sizeof(v));
+    return le32_to_cpu(v);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    le64_t v;
+    memcpy(&v, p, sizeof(v));
+    return le64_to_cpu(v);
+}
+
+static bool looks_like_super_block(const struct exfat_super_block *sb) {
+    return memcmp(sb->oem_name, "EXFAT   ", sizeof(sb->oem_name)) == 0 &&
+        le16_to_cpu(sb->boot_signature) == 0xAA55 &&
+        sb->sector_bits >= 9 && sb->sector_bits <= 12 &&
+        (int) sb->sector_bits + (int) sb->spc_bits <= 25 &&
+        sb->fat_count == 1 &&
+        le32_to_cpu(sb->cluster_count) != 0;
+}
+
+// Reads the 12 sector boot region at offset and verifies its checksum.
+static bool check_vbr(struct exfat_dev *dev, off_t offset, struct exfat_super_block *sb) {
+    uint8_t *buf;
+    size_t ss;
+    uint32_t checksum;
+    bool ret = true;
+
+    if (exfat_pread(dev, sb, sizeof(struct exfat_super_block), offset) != sizeof(struct exfat_super_block)) {
+        return false;
+    }
+    if (!looks_like_super_block(sb)) {
+        return false;
+    }
+
+    ss = (size_t) 1 << sb->sector_bits;
+    buf = malloc(VBR_SECTORS * ss);
+    if (buf == NULL) {
+        return false;
+    }
+    if (exfat_pread(dev, buf, VBR_SECTORS * ss, offset) != (ssize_t) (VBR_SECTORS * ss)) {
+        free(buf);
+        return false;
+    }
+    checksum = exfat_vbr_start_checksum(buf, ss);
+    for (int i = 1; i < VBR_SECTORS - 1; ++i) {
+        checksum = exfat_vbr_add_checksum(buf + i * ss, ss, checksum);
+    }
+    for (size_t i = 0; i < ss / sizeof(le32_t); ++i) {
+        if (get_le32(buf + (VBR_SECTORS - 1) * ss + i * sizeof(le32_t)) != checksum) {
+            ret = false;
+            break;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+static void fill_from_super_block(struct exfat_geometry *geo,
+                                  const struct exfat_super_block *sb,
+                                  off_t partition_offset,
+                                  enum exfat_geometry_source source) {
+    geo->source = source;
+    geo->partition_offset = partition_offset;
+    geo->sector_bits = sb->sector_bits;
+    geo->spc_bits = sb->spc_bits;
+    geo->sector_count = le64_to_cpu(sb->sector_count);
+    geo->fat_offset = partition_offset + ((off_t) le32_to_cpu(sb->fat_sector_start) << sb->sector_bits);
+    geo->fat_sector_count = le32_to_cpu(sb->fat_sector_count);
+    geo->cluster_heap_offset = partition_offset + ((off_t) le32_to_cpu(sb->cluster_sector_start) << sb->sector_bits);
+    geo->cluster_count = le32_to_cpu(sb->cluster_count);
+    geo->rootdir_cluster = le32_to_cpu(sb->rootdir_cluster);
+}
+
+// Main boot region first, then the backup one which follows it.
+static bool probe_partition(struct exfat_dev *dev, off_t start, struct exfat_geometry *geo) {
+    struct exfat_super_block sb;
+
+    if (check_vbr(dev, start, &sb)) {
+        fill_from_super_block(geo, &sb, start, EXFAT_GEOMETRY_MAIN_VBR);
+        return true;
+    }
+    for (int bits = 9; bits <= 12; ++bits) {
+        if (check_vbr(dev, start + ((off_t) VBR_SECTORS << bits), &sb) && sb.sector_bits == bits) {
+            fill_from_super_block(geo, &sb, start, EXFAT_GEOMETRY_BACKUP_VBR);
+            return true;
+        }
+    }
+    return false;
+}
+
+static int add_partition(off_t *starts, int count, off_t start) {
+    for (int i = 0; i < count; ++i) {
+        if (starts[i] == start) {
+            return count;
+        }
+    }
+    if (count < MAX_PARTITIONS) {
+        starts[count++] = start;
+    }
+    return count;
+}
+
+static int collect_gpt_partitions(struct exfat_dev *dev, off_t *starts, int count) {
+    static const uint8_t unused_type[16] = {0};
+    uint8_t header[MBR_SECTOR_SIZE];
+    uint8_t *entries;
+    uint64_t entries_lba;
+    uint32_t entry_count, entry_size;
+
+    if (exfat_pread(dev, header, sizeof(header), MBR_SECTOR_SIZE) != sizeof(header) ||
+        memcmp(header, "EFI PART", 8) != 0) {
+        return count;
+    }
+    entries_lba = get_le64(header + 72);
+    entry_count = MIN(get_le32(header + 80), GPT_MAX_ENTRIES);
+    entry_size = get_le32(header + 84);
+    if (entry_size < 128 || entry_size > MBR_SECTOR_SIZE) {
+        return count;
+    }
+    entries = malloc((size_t) entry_count * entry_size);
+    if (entries == NULL) {
+        return count;
+    }
+    if (exfat_pread(dev, entries, (size_t) entry_count * entry_size,
+                    (off_t) entries_lba * MBR_SECTOR_SIZE) == (ssize_t) entry_count * entry_size) {
+        for (uint32_t i = 0; i < entry_count; ++i) {
+            const uint8_t *entry = entries + (size_t) i * entry_size;
+            if (memcmp(entry, unused_type, sizeof(unused_type)) != 0) {
+                count = add_partition(starts, count, (off_t) get_le64(entry + 32) * MBR_SECTOR_SIZE);
+            }
+        }
+    }
+    free(entries);
+    return count;
+}
+
+// Partition starts from the MBR or GPT, if any survived. The device itself
+// is always the first candidate, for bare file system images.
+static int collect_partitions(struct exfat_dev *dev, off_t *starts) {
+    uint8_t mbr[MBR_SECTOR_SIZE];
+    int count = add_partition(starts, 0, 0);
+
+    if (exfat_pread(dev, mbr, sizeof(mbr), 0) != sizeof(mbr) ||
+        mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        return count;
+    }
+    for (int i = 0; i < 4; ++i) {
+        const uint8_t *entry = mbr + 0x1BE + 16 * i;
+        const uint8_t type = entry[4];
+        const uint32_t lba = get_le32(entry + 8);
+
+        if (type == 0xEE) { // protective MBR
+            count = collect_gpt_partitions(dev, starts, count);
+        } else if (type != 0x00 && type != 0x05 && type != 0x0F && type != 0x85 && lba != 0) {
+            count = add_partition(starts, count, (off_t) lba * MBR_SECTOR_SIZE);
+        }
+    }
+    return count;
+}
+
+// Sector by sector search for any copy of the boot region that still passes
+// its checksum. The sector_start field tells whether it is the main or the
+// backup copy; if it is stale, a following backup copy is looked for.
+static bool search_vbr_copies(struct exfat_dev *dev, struct exfat_geometry *geo, off_t limit) {
+    uint8_t *buf = malloc(VBR_SEARCH_CHUNK);
+    bool found = false;
+
+    if (buf == NULL) {
+        return false;
+    }
+    limit = MIN(limit, geo->disk_size);
+    for (off_t chunk = 0; chunk < limit && !found; chunk += VBR_SEARCH_CHUNK) {
+        ssize_t rd = exfat_pread(dev, buf, VBR_SEARCH_CHUNK, chunk);
+        if (rd <= 0) {
+            break;
+        }
+        for (size_t s = 0; s + MBR_SECTOR_SIZE <= (size_t) rd; s += MBR_SECTOR_SIZE) {
+            struct exfat_super_block sb, backup;
+            const off_t x = chunk + s;
+            off_t ss, start;
+
+            if (memcmp(buf + s + 3, "EXFAT   ", 8) != 0 || buf[s + 510] != 0x55 || buf[s + 511] != 0xAA) {
+                continue;
+            }
+            if (!check_vbr(dev, x, &sb)) {
+                continue;
+            }
+            ss = (off_t) 1 << sb.sector_bits;
+            start = (off_t) le64_to_cpu(sb.sector_start) << sb.sector_bits;
+            if (start == x - VBR_SECTORS * ss) {
+                fill_from_super_block(geo, &sb, start, EXFAT_GEOMETRY_BACKUP_VBR);
+            } else if (start == x || check_vbr(dev, x + VBR_SECTORS * ss, &backup)) {
+                fill_from_super_block(geo, &sb, x, EXFAT_GEOMETRY_MAIN_VBR);
+            } else {
+                fill_from_super_block(geo, &sb, x, EXFAT_GEOMETRY_BACKUP_VBR);
+            }
+            found = true;
+            break;
+        }
+    }
+    free(buf);
+    return found;
+}
+
+struct geometry_sample
+{
+    off_t fde_offsets[GEOMETRY_VOTE_MAX];   // sector aligned entry sets only
+    size_t fde_count;
+    cluster_t dir_clusters[GEOMETRY_VOTE_MAX];
+    size_t dir_count;
+    off_t min_fde_offset;
+    uint64_t bitmap_bytes;                  // size of the allocation bitmap, 0 if not seen
+};
+
+static void sample_entry_set(off_t offset, const struct exfat_entry_meta1 *fde, void *ctx) {
+    struct geometry_sample *s = ctx;
+    const struct exfat_entry_meta2 *efi = (const struct exfat_entry_meta2 *) (fde + 1);
+    const cluster_t start_cluster = le32_to_cpu(efi->start_cluster);
+
+    s->min_fde_offset = MIN(s->min_fde_offset, offset);
+    // a directory's first cluster starts on a sector boundary
+    if (offset % MBR_SECTOR_SIZE == 0 && s->fde_count < GEOMETRY_VOTE_MAX) {
+        s->fde_offsets[s->fde_count++] = offset;
+    }
+    if ((le16_to_cpu(fde->attrib) & EXFAT_ATTRIB_DIR) &&
+        start_cluster >= EXFAT_FIRST_DATA_CLUSTER &&
+        s->dir_count < GEOMETRY_VOTE_MAX) {
+        s->dir_clusters[s->dir_count++] = start_cluster;
+    }
+}
+
+// The root directory starts with the bitmap and upcase table entries; the
+// bitmap size gives away the cluster count.
+static void sample_root_entries(struct geometry_sample *s, const uint8_t *buf, size_t size) {
+    for (size_t i = 0; i + 2 * sizeof(struct exfat_entry) <= size; i += sizeof(struct exfat_entry)) {
+        const struct exfat_entry_bitmap *bitmap = (const struct exfat_entry_bitmap *) (buf + i);
+        if (bitmap->type == EXFAT_ENTRY_BITMAP &&
+            buf[i + sizeof(struct exfat_entry)] == EXFAT_ENTRY_UPCASE &&
+            le64_to_cpu(bitmap->size) != 0 &&
+            le64_to_cpu(bitmap->size) <= DIV_ROUND_UP(EXFAT_LAST_DATA_CLUSTER, 8)) {
+            s->bitmap_bytes = le64_to_cpu(bitmap->size);
+        }
+    }
+}
+
+static size_t sample_region(struct exfat_dev *dev, struct geometry_sample *s,
+                            uint8_t *buf, size_t size, off_t offset) {
+    ssize_t rd = exfat_pread(dev, buf, size, offset);
+    if (rd <= 0) {
+        return 0;
+    }
+    sample_root_entries(s, buf, rd);
+    return exfat_scan_entry_sets(buf, rd, offset, sample_entry_set, s);
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    const off_t x = *(const off_t *) a, y = *(const off_t *) b;
+    return (x > y) - (x < y);
+}
+
+static int compare_clusters(const void *a, const void *b) {
+    const cluster_t x = *(const cluster_t *) a, y = *(const cluster_t *) b;
+    return (x > y) - (x < y);
+}
+
+static size_t unique(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *)) {
+    uint8_t *p = base;
+    size_t out = 0;
+
+    qsort(base, n, size, cmp);
+    for (size_t i = 0; i < n; ++i) {
+        if (out == 0 || cmp(p + (out - 1) * size, p + i * size) != 0) {
+            memmove(p + out * size, p + i * size, size);
+            ++out;
+        }
+    }
+    return out;
+}
+
+// Every directory's start cluster c and every sector aligned entry set at
+// disk offset o proposes heap = o - (c - 2) * cluster_size. Pairs where o is
+// really the first entry of directory c all agree on one value for the right
+// cluster size, everything else is noise spread over the whole disk.
+static bool vote_cluster_heap(struct geometry_sample *s, off_t disk_size,
+                              int *spc_bits, off_t *heap, size_t *votes) {
+    off_t *candidates = malloc(sizeof(off_t) * GEOMETRY_VOTE_MAX * GEOMETRY_VOTE_MAX);
+    size_t best = 1;
+
+    if (candidates == NULL) {
+        return false;
+    }
+    s->fde_count = unique(s->fde_offsets, s->fde_count, sizeof(off_t), compare_offsets);
+    s->dir_count = unique(s->dir_clusters, s->dir_count, sizeof(cluster_t), compare_clusters);
+
+    for (int bits = 0; bits <= 25 - 9; ++bits) {
+        const off_t cluster_size = (off_t) MBR_SECTOR_SIZE << bits;
+        size_t n = 0;
+
+        for (size_t d = 0; d < s->dir_count; ++d) {
+            const off_t base = (off_t) (s->dir_clusters[d] - EXFAT_FIRST_DATA_CLUSTER) * cluster_size;
+            if (base >= disk_size) {
+                continue;
+            }
+            for (size_t f = 0; f < s->fde_count; ++f) {
+                const off_t h = s->fde_offsets[f] - base;
+                if (h >= 0 && h <= s->min_fde_offset) {
+                    candidates[n++] = h;
+                }
+            }
+        }
+        qsort(candidates, n, sizeof(off_t), compare_offsets);
+        for (size_t i = 0, run; i < n; i += run) {
+            for (run = 1; i + run < n && candidates[i + run] == candidates[i]; ++run)
+                ;
+            if (run > best) {
+                best = run;
+                *spc_bits = bits;
+                *heap = candidates[i];
+            }
+        }
+    }
+    free(candidates);
+    *votes = best;
+    return best >= 2;
+}
+
+static bool infer_geometry(struct exfat_dev *dev, struct exfat_geometry *geo,
+                           const off_t *partitions, int partition_count) {
+    struct geometry_sample *s = calloc(1, sizeof(struct geometry_sample));
+    uint8_t *buf = malloc(GEOMETRY_DENSE_BYTES);
+    uint32_t *hits = calloc(GEOMETRY_SAMPLE_COUNT, sizeof(uint32_t));
+    off_t stride = ROUND_UP(geo->disk_size / GEOMETRY_SAMPLE_COUNT, MBR_SECTOR_SIZE);
+    off_t heap = 0;
+    int spc_bits = 0;
+    size_t votes = 0;
+    bool ret = false;
+
+    do {
+        if (s == NULL || buf == NULL || hits == NULL) {
+            break;
+        }
+        s->min_fde_offset = geo->disk_size;
+        stride = MAX(stride, (off_t) GEOMETRY_SAMPLE_BYTES);
+
+        // sparse pass over the whole device
+        for (int i = 0; i < GEOMETRY_SAMPLE_COUNT && (off_t) i * stride < geo->disk_size; ++i) {
+            hits[i] = sample_region(dev, s, buf, GEOMETRY_SAMPLE_BYTES, (off_t) i * stride);
+        }
+
+        // dense pass around the samples with the most entry sets
+        for (int n = 0; n < GEOMETRY_DENSE_SAMPLES; ++n) {
+            int top = -1;
+            for (int i = 0; i < GEOMETRY_SAMPLE_COUNT; ++i) {
+                if (hits[i] != 0 && (top == -1 || hits[i] > hits[top])) {
+                    top = i;
+                }
+            }
+            if (top == -1) {
+                break;
+            }
+            hits[top] = 0;
+            sample_region(dev, s, buf, GEOMETRY_DENSE_BYTES,
+                          MAX((off_t) 0, (off_t) top * stride - (off_t) GEOMETRY_DENSE_BYTES / 2));
+        }
+
+        fprintf(stderr, "geometry: sampled %zu sector aligned entry sets, %zu directories\n",
+                s->fde_count, s->dir_count);
+        if (!vote_cluster_heap(s, geo->disk_size, &spc_bits, &heap, &votes)) {
+            break;
+        }
+        fprintf(stderr, "geometry: cluster heap at %016" PRIx64 " with %zu votes\n", (uint64_t) heap, votes);
+
+        geo->source = EXFAT_GEOMETRY_INFERRED;
+        geo->sector_bits = 9;
+        geo->spc_bits = spc_bits;
+        geo->cluster_heap_offset = heap;
+        geo->partition_offset = 0;
+        for (int i = 0; i < partition_count; ++i) {
+            if (partitions[i] <= heap) {
+                geo->partition_offset = MAX(geo->partition_offset, partitions[i]);
+            }
+        }
+        geo->fat_offset = 0;
+        geo->fat_sector_count = 0;
+        geo->rootdir_cluster = 0;
+        geo->cluster_count = MIN((uint64_t) (geo->disk_size - heap) / GEOMETRY_CLUSTER_SIZE(*geo),
+                                 (uint64_t) EXFAT_LAST_DATA_CLUSTER - EXFAT_FIRST_DATA_CLUSTER);
+        if (s->bitmap_bytes != 0 && s->bitmap_bytes * 8 < (uint64_t) geo->cluster_count + 8) {
+            geo->cluster_count = MIN(geo->cluster_count, s->bitmap_bytes * 8);
+        }
+        geo->sector_count = (geo->disk_size - geo->partition_offset) >> geo->sector_bits;
+        ret = true;
+    } while (0);
+
+    free(hits);
+    free(buf);
+    free(s);
+    return ret;
+}
+
+int exfat_probe_geometry(struct exfat_dev *dev, struct exfat_geometry *geo) {
+    off_t partitions[MAX_PARTITIONS];
+    int partition_count;
+
+    memset(geo, 0, sizeof(struct exfat_geometry));
+    geo->disk_size = exfat_get_size(dev);
+
+    partition_count = collect_partitions(dev, partitions);
+    for (int i = 0; i < partition_count; ++i) {
+        if (probe_partition(dev, partitions[i], geo)) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "geometry: no boot region at %d partition start(s), searching the first %" PRIu64 " MB\n",
+            partition_count, (uint64_t) GEOMETRY_VBR_SEARCH_BYTES >> 20);
+    if (search_vbr_copies(dev, geo, GEOMETRY_VBR_SEARCH_BYTES)) {
+        return 0;
+    }
+    fprintf(stderr, "geometry: no surviving boot region, inferring from directory entries\n");
+    if (infer_geometry(dev, geo, partitions, partition_count)) {
+        return 0;
+    }
+    geo->source = EXFAT_GEOMETRY_NONE;
+    exfat_error("unable to determine file system geometry");
+    return -EIO;
+}
+
+void exfat_print_geometry(const struct exfat_geometry *geo) {
+    static const char *const sources[] = {
+        "none", "main boot region", "backup boot region", "inferred from directory entries",
+    };
+
+    fprintf(stderr, "Geometry source           %s\n", sources[geo->source]);
+    fprintf(stderr, "Device size               %" PRIu64 "\n", (uint64_t) geo->disk_size);
+    fprintf(stderr, "Partition offset          %016" PRIx64 "\n", (uint64_t) geo->partition_offset);
+    fprintf(stderr, "FAT offset                %016" PRIx64 "\n", (uint64_t) geo->fat_offset);
+    fprintf(stderr, "Cluster heap offset       %016" PRIx64 "\n", (uint64_t) geo->cluster_heap_offset);
+    fprintf(stderr, "Sector size               %zu\n", GEOMETRY_SECTOR_SIZE(*geo));
+    fprintf(stderr, "Cluster size              %zu\n", GEOMETRY_CLUSTER_SIZE(*geo));
+    fprintf(stderr, "Clusters count            %u\n", geo->cluster_count);
+    fprintf(stderr, "Root directory cluster    %u\n", geo->rootdir_cluster);
+}
+
+off_t exfat_geometry_c2o(const struct exfat_geometry *geo, cluster_t cluster) {
+    return geo->cluster_heap_offset +
+        ((off_t) (cluster - EXFAT_FIRST_DATA_CLUSTER) << (geo->sector_bits + geo->spc_bits));
+}
+
+cluster_t exfat_geometry_o2c(const struct exfat_geometry *geo, off_t offset) {
+    return (cluster_t) ((offset - geo->cluster_heap_offset) >> (geo->sector_bits + geo->spc_bits)) +
+        EXFAT_FIRST_DATA_CLUSTER;
+}
+
+// Super block describing the geometry. If the FAT location is unknown it is
+// placed right after the main and backup boot regions.
+void exfat_geometry_to_sb(const struct exfat_geometry *geo, struct exfat_super_block *sb) {
+    const uint32_t heap_sector = (geo->cluster_heap_offset - geo->partition_offset) >> geo->sector_bits;
+    uint32_t fat_sector_start, fat_sector_count;
+
+    if (geo->fat_offset != 0) {
+        fat_sector_start = (geo->fat_offset - geo->partition_offset) >> geo->sector_bits;
+        fat_sector_count = geo->fat_sector_count;
+    } else {
+        fat_sector_start = 2 * VBR_SECTORS;
+        fat_sector_count = DIV_ROUND_UP(((uint64_t) geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER) * sizeof(cluster_t),
+                                        GEOMETRY_SECTOR_SIZE(*geo));
+        if (fat_sector_start + fat_sector_count > heap_sector) {
+            fat_sector_count = heap_sector > fat_sector_start ? heap_sector - fat_sector_start : 0;
+        }
+    }
+
+    memset(sb, 0, sizeof(struct exfat_super_block));
+    sb->jump[0] = 0xEB;
+    sb->jump[1] = 0x76;
+    sb->jump[2] = 0x90;
+    memcpy(sb->oem_name, "EXFAT   ", sizeof(sb->oem_name));
+    sb->sector_start = cpu_to_le64(geo->partition_offset >> geo->sector_bits);
+    sb->sector_count = cpu_to_le64(geo->sector_count);
+    sb->fat_sector_start = cpu_to_le32(fat_sector_start);
+    sb->fat_sector_count = cpu_to_le32(fat_sector_count);
+    sb->cluster_sector_start = cpu_to_le32(heap_sector);
+    sb->cluster_count = cpu_to_le32(geo->cluster_count);
+    sb->rootdir_cluster = cpu_to_le32(geo->rootdir_cluster);
+    sb->version.major = 1;
+    sb->version.minor = 0;
+    sb->sector_bits = geo->sector_bits;
+    sb->spc_bits = geo->spc_bits;
+    sb->fat_count = 1;
+    sb->drive_no = 0x80;
+    sb->boot_signature = cpu_to_le16(0xAA55);
+}
@@ -20,6 +20,9 @@
 	51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* for fallocate() */
+#endif
 #include "exfat.h"
 #include <inttypes.h>
 #include <sys/types.h>
@@ -37,6 +40,7 @@
 #include <sys/ioctl.h>
 #elif __linux__
 #include <sys/mount.h>
+#include <linux/falloc.h>
 #endif
 #ifdef USE_UBLIO
 #include <sys/uio.h>
@@ -48,6 +52,8 @@ struct exfat_dev
 	int fd;
 	enum exfat_mode mode;
 	off_t size; /* in bytes */
+	uint64_t bytes_read;	/* updated atomically, readers may be threads */
+	uint64_t bytes_written;
 #ifdef USE_UBLIO
 	off_t pos;
 	ublio_filehandle_t ufh;
@@ -116,6 +122,8 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 		exfat_error("failed to allocate memory for device structure");
 		return NULL;
 	}
+	dev->bytes_read = 0;
+	dev->bytes_written = 0;
 
 	switch (mode)
 	{
@@ -316,6 +324,74 @@ off_t exfat_get_size(const struct exfat_dev* dev)
 	return dev->size;
 }
 
+/* Returns the descriptor for callers that hand I/O to the kernel, or -1 when
+   reads have to go through the block cache. */
+int exfat_get_fd(const struct exfat_dev* dev)
+{
+#ifdef USE_UBLIO
+	return -1;
+#else
+	return dev->fd;
+#endif
+}
+
+/*
+	Zeroes a range without sending the zeroes down: the range of an image
+	file is turned into unwritten extents, or deallocated where that is not
+	supported, and a block device is told to write zeroes itself, which flash
+	translates into unmapping the blocks where it can. Returns how it was
+	done, or EXFAT_ZERO_UNSUPPORTED if the caller has to write the zeroes
+	after all.
+*/
+enum exfat_zero_method exfat_zero_range(struct exfat_dev* dev, off_t offset,
+		off_t size)
+{
+#if defined(__linux__) && !defined(USE_UBLIO)
+	struct stat stbuf;
+
+	if (fstat(dev->fd, &stbuf) != 0)
+		return EXFAT_ZERO_UNSUPPORTED;
+	if (S_ISREG(stbuf.st_mode))
+	{
+#ifdef FALLOC_FL_ZERO_RANGE
+		if (fallocate(dev->fd, FALLOC_FL_ZERO_RANGE, offset, size) == 0)
+			return EXFAT_ZERO_FILE_RANGE;
+#endif
+#ifdef FALLOC_FL_PUNCH_HOLE
+		if (fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				offset, size) == 0)
+			return EXFAT_ZERO_FILE_HOLE;
+#endif
+	}
+#ifdef BLKZEROOUT
+	else if (S_ISBLK(stbuf.st_mode) && offset % 512 == 0 && size % 512 == 0)
+	{
+		/* BLKDISCARD alone does not promise that zeroes are read back */
+		uint64_t range[2] = {offset, size};
+
+		if (ioctl(dev->fd, BLKZEROOUT, range) == 0)
+			return EXFAT_ZERO_DEVICE;
+	}
+#endif
+#endif
+	return EXFAT_ZERO_UNSUPPORTED;
+}
+
+/* Bytes transferred since the device was opened. */
+void exfat_get_io_bytes(const struct exfat_dev* dev, uint64_t* read,
+		uint64_t* written)
+{
+	*read = __atomic_load_n(&dev->bytes_read, __ATOMIC_RELAXED);
+	*written = __atomic_load_n(&dev->bytes_written, __ATOMIC_RELAXED);
+}
+
+static ssize_t count_bytes(uint64_t* counter, ssize_t result)
+{
+	if (result > 0)
+		__atomic_add_fetch(counter, result, __ATOMIC_RELAXED);
+	return result;
+}
+
 off_t exfat_seek(struct exfat_dev* dev, off_t offset, int whence)
 {
 #ifdef USE_UBLIO
@@ -332,9 +408,9 @@ ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size)
 	ssize_t result = ublio_pread(dev->ufh, buffer, size, dev->pos);
 	if (result >= 0)
 		dev->pos += size;
-	return result;
+	return count_bytes(&dev->bytes_read, result);
 #else
-	return read(dev->fd, buffer, size);
+	return count_bytes(&dev->bytes_read, read(dev->fd, buffer, size));
 #endif
 }
 
@@ -344,9 +420,9 @@ ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 	ssize_t result = ublio_pwrite(dev->ufh, buffer, size, dev->pos);
 	if (result >= 0)
 		dev->pos += size;
-	return result;
+	return count_bytes(&dev->bytes_written, result);
 #else
-	return write(dev->fd, buffer, size);
+	return count_bytes(&dev->bytes_written, write(dev->fd, buffer, size));
 #endif
 }
 
@@ -354,9 +430,11 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 		off_t offset)
 {
 #ifdef USE_UBLIO
-	return ublio_pread(dev->ufh, buffer, size, offset);
+	return count_bytes(&dev->bytes_read,
+			ublio_pread(dev->ufh, buffer, size, offset));
 #else
-	return pread(dev->fd, buffer, size, offset);
+	return count_bytes(&dev->bytes_read,
+			pread(dev->fd, buffer, size, offset));
 #endif
 }
 
@@ -364,9 +442,11 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 		off_t offset)
 {
 #ifdef USE_UBLIO
-	return ublio_pwrite(dev->ufh, buffer, size, offset);
+	return count_bytes(&dev->bytes_written,
+			ublio_pwrite(dev->ufh, buffer, size, offset));
 #else
-	return pwrite(dev->fd, buffer, size, offset);
+	return count_bytes(&dev->bytes_written,
+			pwrite(dev->fd, buffer, size, offset));
 #endif
 }
 
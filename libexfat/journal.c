@@ -0,0 +1,370 @@
+//
+//  journal.c
+//  NuclearHolocaust
+//
+//  Copyright © 2019 Paul Ciarlo <paul.ciarlo@gmail.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+//
+// The reconstruction journal is a header followed by records, each one a
+// 32 byte header and for DATA records the bytes to write. A BARRIER record
+// ends each phase and an END record the journal; nothing is applied unless
+// the whole journal is there and every checksum matches.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "exfat.h"
+
+#define JOURNAL_MAGIC "EXFATJNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORD_DATA 1
+#define JOURNAL_RECORD_ZERO 2       // length zero bytes, no payload
+#define JOURNAL_RECORD_BARRIER 3
+#define JOURNAL_RECORD_END 4
+#define JOURNAL_BUFFER_BYTES ((size_t) 8 * 1024 * 1024)
+#define REPLAY_WRITE_BYTES ((size_t) 16 * 1024 * 1024)
+
+struct journal_header
+{
+    char magic[8];
+    le32_t version;
+    le32_t checksum;            // of the header with this field zero
+    le64_t disk_size;
+    le64_t partition_offset;
+    le32_t cluster_count;
+    uint8_t sector_bits;
+    uint8_t spc_bits;
+    uint8_t __unused[26];
+}
+PACKED;
+STATIC_ASSERT(sizeof(struct journal_header) == 64);
+
+struct journal_record
+{
+    le32_t type;
+    le32_t checksum;            // of the record with this field zero, then the payload
+    le64_t offset;              // on the device
+    le64_t length;
+    le32_t phase;
+    le32_t __unused;
+}
+PACKED;
+STATIC_ASSERT(sizeof(struct journal_record) == 32);
+
+static const char *const phase_names[] = {
+    "none", "bitmap and upcase table", "directories", "FAT", "backup boot region", "main boot region",
+};
+
+static uint32_t record_checksum(const struct journal_record *record, const void *payload, size_t size) {
+    struct journal_record copy = *record;
+    copy.checksum = cpu_to_le32(0);
+    return exfat_vbr_add_checksum(payload, size, exfat_vbr_add_checksum(&copy, sizeof(copy), 0));
+}
+
+static void journal_flush(struct exfat_journal *journal) {
+    for (size_t written = 0; written < journal->used && journal->error == 0; ) {
+        const ssize_t wr = write(journal->fd, journal->buffer + written, journal->used - written);
+        if (wr == -1) {
+            journal->error = errno;
+        } else {
+            written += wr;
+        }
+    }
+    journal->used = 0;
+}
+
+static void journal_append(struct exfat_journal *journal, uint32_t type, off_t offset, uint64_t length,
+                           const void *payload, size_t size) {
+    struct journal_record record;
+
+    if (journal->error != 0) {
+        return;
+    }
+    if (journal->used + sizeof(record) + size > JOURNAL_BUFFER_BYTES) {
+        journal_flush(journal);
+    }
+    memset(&record, 0, sizeof(record));
+    record.type = cpu_to_le32(type);
+    record.offset = cpu_to_le64(offset);
+    record.length = cpu_to_le64(length);
+    record.phase = cpu_to_le32(journal->phase);
+    record.checksum = cpu_to_le32(record_checksum(&record, payload, size));
+    memcpy(journal->buffer + journal->used, &record, sizeof(record));
+    memcpy(journal->buffer + journal->used + sizeof(record), payload, size);
+    journal->used += sizeof(record) + size;
+    ++journal->records;
+}
+
+int exfat_journal_open(struct exfat_journal *journal, int fd, const struct exfat_geometry *geo) {
+    struct journal_header header;
+
+    memset(journal, 0, sizeof(struct exfat_journal));
+    journal->fd = fd;
+    journal->phase = EXFAT_JOURNAL_METADATA;
+    journal->buffer = malloc(JOURNAL_BUFFER_BYTES);
+    if (journal->buffer == NULL) {
+        return ENOMEM;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = cpu_to_le32(JOURNAL_VERSION);
+    header.disk_size = cpu_to_le64(geo->disk_size);
+    header.partition_offset = cpu_to_le64(geo->partition_offset);
+    header.cluster_count = cpu_to_le32(geo->cluster_count);
+    header.sector_bits = geo->sector_bits;
+    header.spc_bits = geo->spc_bits;
+    header.checksum = cpu_to_le32(exfat_vbr_add_checksum(&header, sizeof(header), 0));
+    memcpy(journal->buffer, &header, sizeof(header));
+    journal->used = sizeof(header);
+    return 0;
+}
+
+// Cuts data into records of at most EXFAT_JOURNAL_RECORD_BYTES; the parts
+// that are all zero, like most of a FAT, are logged without their bytes.
+void exfat_journal_write(struct exfat_journal *journal, off_t offset, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    while (size != 0) {
+        const size_t len = MIN(size, EXFAT_JOURNAL_RECORD_BYTES);
+        if (p[0] == 0 && memcmp(p, p + 1, len - 1) == 0) {
+            journal_append(journal, JOURNAL_RECORD_ZERO, offset, len, NULL, 0);
+        } else {
+            journal_append(journal, JOURNAL_RECORD_DATA, offset, len, p, len);
+        }
+        journal->bytes += len;
+        offset += len;
+        p += len;
+        size -= len;
+    }
+}
+
+void exfat_journal_zero(struct exfat_journal *journal, off_t offset, uint64_t size) {
+    if (size != 0) {
+        journal_append(journal, JOURNAL_RECORD_ZERO, offset, size, NULL, 0);
+        journal->bytes += size;
+    }
+}
+
+void exfat_journal_barrier(struct exfat_journal *journal) {
+    journal_append(journal, JOURNAL_RECORD_BARRIER, 0, 0, NULL, 0);
+    ++journal->phase;
+}
+
+// Ends the journal and makes sure it is on disk before anyone replays it.
+int exfat_journal_close(struct exfat_journal *journal) {
+    int ret;
+
+    journal_append(journal, JOURNAL_RECORD_END, 0, 0, NULL, 0);
+    journal_flush(journal);
+    if (journal->error == 0 && fsync(journal->fd) == -1) {
+        journal->error = errno;
+    }
+    ret = journal->error;
+    free(journal->buffer);
+    journal->buffer = NULL;
+    return ret;
+}
+
+static int read_at(int fd, void *buf, size_t size, off_t offset) {
+    for (size_t done = 0; done < size; ) {
+        const ssize_t rd = pread(fd, (uint8_t *) buf + done, size - done, offset + done);
+        if (rd == -1) {
+            return errno;
+        }
+        if (rd == 0) {
+            return EIO;     // truncated
+        }
+        done += rd;
+    }
+    return 0;
+}
+
+struct replay
+{
+    struct exfat_dev *dev;
+    uint8_t *buffer;
+    size_t used;
+    off_t offset;               // where buffer goes on the device
+    uint64_t bytes;
+};
+
+static int replay_flush(struct replay *replay) {
+    if (replay->used != 0) {
+        if (exfat_pwrite(replay->dev, replay->buffer, replay->used, replay->offset) != (ssize_t) replay->used) {
+            return EIO;
+        }
+        replay->bytes += replay->used;
+        replay->used = 0;
+    }
+    return 0;
+}
+
+// Returns where length bytes for offset go in the write buffer, after writing
+// out what is there if they do not simply continue it. Returns NULL and leaves
+// the buffer alone if that write fails.
+static uint8_t *replay_reserve(struct replay *replay, off_t offset, size_t length, int *ret) {
+    if (replay->used == 0 || replay->offset + (off_t) replay->used != offset ||
+        replay->used + length > REPLAY_WRITE_BYTES) {
+        *ret = replay_flush(replay);
+        if (*ret != 0) {
+            return NULL;
+        }
+        replay->offset = offset;
+    }
+    replay->used += length;
+    return replay->buffer + replay->used - length;
+}
+
+// Goes through the journal twice: first to check that it is complete and
+// intact, then to apply it. Adjacent records are merged into writes of up to
+// REPLAY_WRITE_BYTES and every phase is synced before the next one starts, so
+// whatever the boot region points at is on the disk before the boot region.
+static int replay_pass(int fd, struct replay *replay, uint8_t *payload) {
+    off_t pos = sizeof(struct journal_header);
+    uint32_t phase = EXFAT_JOURNAL_METADATA;
+
+    for (;;) {
+        struct journal_record record;
+        uint64_t length;
+        uint32_t type;
+        off_t offset;
+        int ret = read_at(fd, &record, sizeof(record), pos);
+
+        if (ret != 0) {
+            return ret;
+        }
+        pos += sizeof(record);
+        type = le32_to_cpu(record.type);
+        offset = le64_to_cpu(record.offset);
+        length = le64_to_cpu(record.length);
+        if (le32_to_cpu(record.phase) != phase) {
+            return EINVAL;
+        }
+
+        switch (type) {
+        case JOURNAL_RECORD_DATA: {
+            uint8_t *dst = payload;
+            if (length == 0 || length > EXFAT_JOURNAL_RECORD_BYTES) {
+                return EINVAL;
+            }
+            if (replay != NULL) {
+                dst = replay_reserve(replay, offset, length, &ret);
+            }
+            if (ret == 0) {
+                ret = read_at(fd, dst, length, pos);
+            }
+            if (ret == 0 && record_checksum(&record, dst, length) != le32_to_cpu(record.checksum)) {
+                ret = EINVAL;
+            }
+            pos += length;
+            break;
+        }
+        case JOURNAL_RECORD_ZERO:
+            if (record_checksum(&record, NULL, 0) != le32_to_cpu(record.checksum)) {
+                return EINVAL;
+            }
+            while (replay != NULL && length != 0 && ret == 0) {
+                const size_t len = MIN(length, (uint64_t) EXFAT_JOURNAL_RECORD_BYTES);
+                uint8_t *dst = replay_reserve(replay, offset, len, &ret);
+                if (dst == NULL) {
+                    break;
+                }
+                memset(dst, 0, len);
+                offset += len;
+                length -= len;
+            }
+            break;
+        case JOURNAL_RECORD_BARRIER:
+        case JOURNAL_RECORD_END:
+            if (record_checksum(&record, NULL, 0) != le32_to_cpu(record.checksum)) {
+                return EINVAL;
+            }
+            if (replay != NULL) {
+                ret = replay_flush(replay);
+                if (ret == 0 && exfat_fsync(replay->dev) != 0) {
+                    ret = EIO;
+                }
+                if (ret == 0 && type == JOURNAL_RECORD_BARRIER) {
+                    fprintf(stderr, "wrote %s, %" PRIu64 " bytes so far\n",
+                            phase < sizeof(phase_names) / sizeof(phase_names[0]) ? phase_names[phase] : "?",
+                            replay->bytes);
+                }
+            }
+            if (type == JOURNAL_RECORD_END) {
+                return ret;
+            }
+            ++phase;
+            break;
+        default:
+            return EINVAL;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+}
+
+int exfat_journal_replay(struct exfat_dev *dev, int fd) {
+    struct journal_header header;
+    struct replay replay;
+    uint8_t *payload;
+    uint32_t checksum;
+    int ret = read_at(fd, &header, sizeof(header), 0);
+
+    if (ret != 0) {
+        fprintf(stderr, "unable to read journal header: %s\n", strerror(ret));
+        return ret;
+    }
+    checksum = le32_to_cpu(header.checksum);
+    header.checksum = cpu_to_le32(0);
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+        le32_to_cpu(header.version) != JOURNAL_VERSION ||
+        exfat_vbr_add_checksum(&header, sizeof(header), 0) != checksum) {
+        fprintf(stderr, "not a reconstruction journal\n");
+        return EINVAL;
+    }
+    if ((off_t) le64_to_cpu(header.disk_size) != exfat_get_size(dev)) {
+        fprintf(stderr, "journal is for a %" PRIu64 " byte device, this one has %jd bytes\n",
+                le64_to_cpu(header.disk_size), (intmax_t) exfat_get_size(dev));
+        return EINVAL;
+    }
+
+    payload = malloc(MAX(EXFAT_JOURNAL_RECORD_BYTES, REPLAY_WRITE_BYTES));
+    if (payload == NULL) {
+        return ENOMEM;
+    }
+    ret = replay_pass(fd, NULL, payload);
+    if (ret != 0) {
+        fprintf(stderr, "journal is damaged or incomplete, nothing was written: %s\n", strerror(ret));
+        free(payload);
+        return ret;
+    }
+    memset(&replay, 0, sizeof(replay));
+    replay.dev = dev;
+    replay.buffer = payload;
+    ret = replay_pass(fd, &replay, NULL);
+    if (ret != 0) {
+        fprintf(stderr, "replay failed after %" PRIu64 " bytes, run it again to finish: %s\n",
+                replay.bytes, strerror(ret));
+    }
+    free(payload);
+    return ret;
+}
@@ -23,28 +23,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "exfat.h"
 
-static const size_t sector_size_bytes = SECTOR_SIZE_BYTES; // bytes 0x0200
-static const size_t sectors_per_cluster = SECTORS_PER_CLUSTER; // 0x0200
-static const size_t cluster_size_bytes = SECTOR_SIZE_BYTES * SECTORS_PER_CLUSTER;
-static const size_t disk_size_bytes = DISK_SIZE_BYTES; // 0x0000040000000000; // 4TB
-static const size_t cluster_heap_disk_start_sector = CLUSTER_HEAP_DISK_START_SECTOR;
-static const size_t cluster_heap_partition_start_sector = CLUSTER_HEAP_PARTITION_START_SECTOR;
-static const size_t partition_start_sector = PARTITION_START_SECTOR;
-static const size_t cluster_count = CLUSTER_COUNT;
-
-void init_fat(struct exfat_file_allocation_table *fat) {
-    //const size_t sectors = sizeof(struct exfat_file_allocation_table) / SECTOR_SIZE_BYTES;
-    fat->entries[0] = 0x0FFFFFF8; // Media descriptor hard drive
-    fat->entries[1] = EXFAT_CLUSTER_END; // Label?
-    fat->entries[2] = EXFAT_CLUSTER_END; // To be set to next cluster of the Allocation bitmap
-    fat->entries[3] = EXFAT_CLUSTER_END; // Up-Case table
-    fat->entries[4] = EXFAT_CLUSTER_END; // Root directory
-    for (cluster_t c = 5; c < CLUSTER_COUNT; ++c) {
-        fat->entries[c] = EXFAT_CLUSTER_FREE;
+int init_fat(struct exfat_file_allocation_table *fat, const struct exfat_geometry *geo) {
+    fat->count = geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    fat->entries = calloc(fat->count, sizeof(cluster_t));
+    if (fat->entries == NULL) {
+        fat->count = 0;
+        return -ENOMEM;
     }
+    fat->entries[0] = 0xFFFFFFF8; // Media descriptor hard drive
+    fat->entries[1] = EXFAT_CLUSTER_END;
+    // the rest is EXFAT_CLUSTER_FREE (0) from calloc until the bitmap, the
+    // upcase table and the root directory are given their clusters
+    return 0;
+}
+
+void free_fat(struct exfat_file_allocation_table *fat) {
+    free(fat->entries);
+    fat->entries = NULL;
+    fat->count = 0;
 }
 
 // Sector 10 is reserved, and is not currently defined.
@@ -57,11 +57,15 @@ void init_fat(struct exfat_file_allocation_table *fat) {
 
 void update_chksum_sector(le32_t *chksum, const uint8_t *const buf, size_t len)
 {
-    for (size_t i = 0; i < len; ++i) {
-        if (i != 106 && i != 107 && i != 112){
-            chksum->__u32 = ((chksum->__u32 << 31) | (chksum->__u32 >> 1)) + (uint32_t)buf[i];
-        }
+    // volume_state and allocated_percent are left out
+    uint32_t sum = exfat_checksum32(chksum->__u32, buf, MIN(len, 106));
+    if (len > 108) {
+        sum = exfat_checksum32(sum, buf + 108, MIN(len, 112) - 108);
+    }
+    if (len > 113) {
+        sum = exfat_checksum32(sum, buf + 113, len - 113);
     }
+    chksum->__u32 = sum;
 }
 
 void restore_fat(struct exfat_dev *dev, struct exfat_volume_boot_record *vbr) {
@@ -83,7 +87,7 @@ void restore_fat(struct exfat_dev *dev, struct exfat_volume_boot_record *vbr) {
 }
 
 cluster_t find_next_free_cluster(const struct exfat_file_allocation_table *const fat) {
-    for (cluster_t c = 0; c < sizeof(fat->entries); ++c) {
+    for (cluster_t c = EXFAT_FIRST_DATA_CLUSTER; c < fat->count; ++c) {
         if (fat->entries[c] == EXFAT_CLUSTER_FREE) {
             return c;
         }
@@ -175,15 +179,22 @@ void init_filesystem(struct exfat_dev *dev, struct exfat *fs, struct exfat_volum
 
 int init_cluster_heap(struct exfat_file_allocation_table *fat,
                       struct exfat_cluster_heap *heap,
-                      const struct exfat_entry_bitmap *const bmp_entry) {
+                      const struct exfat_entry_bitmap *const bmp_entry,
+                      const struct exfat_geometry *geo) {
+    heap->size = geo->cluster_count;
+    heap->allocation_flags = malloc(BMAP_SIZE(heap->size));
+    if (heap->allocation_flags == NULL) {
+        return -ENOMEM;
+    }
     // mark everything allocated so we don't accidentally overwrite any data
-    memset(heap, 0xFF, sizeof(struct exfat_cluster_heap));
+    memset(heap->allocation_flags, 0xFF, BMAP_SIZE(heap->size));
 
     const size_t bmp_size_clusters =
-        bmp_entry->size.__u64 / cluster_size_bytes +
-        bmp_entry->size.__u64 % cluster_size_bytes;
-    cluster_t c = 2;
+        DIV_ROUND_UP(le64_to_cpu(bmp_entry->size), GEOMETRY_CLUSTER_SIZE(*geo));
+    cluster_t c = le32_to_cpu(bmp_entry->start_cluster);
     for (size_t i = 1; i < bmp_size_clusters; ++i) {
+        // claim c before looking for the next one, or we would find c again
+        fat->entries[c] = EXFAT_CLUSTER_END;
         cluster_t next = find_next_free_cluster(fat);
         if (next == -1) {
             return -1;
@@ -197,6 +208,48 @@ int init_cluster_heap(struct exfat_file_allocation_table *fat,
     return 0;
 }
 
+void free_cluster_heap(struct exfat_cluster_heap *heap) {
+    free(heap->allocation_flags);
+    heap->allocation_flags = NULL;
+    heap->size = 0;
+}
+
+void init_recovery_bitmap_entry(struct exfat_entry_bitmap *bmp_entry, const struct exfat_geometry *geo) {
+    memset(bmp_entry, 0, sizeof(struct exfat_entry_bitmap));
+    bmp_entry->type = EXFAT_ENTRY_BITMAP;
+    bmp_entry->bitmap_flags = 0; // bit 0: 0 = 1st cluster heap. 1 = 2nd cluster heap.
+    bmp_entry->start_cluster = cpu_to_le32(EXFAT_FIRST_DATA_CLUSTER);
+    bmp_entry->size = cpu_to_le64(DIV_ROUND_UP((uint64_t) geo->cluster_count, 8)); // Ceil (Cluster count / 8)
+}
+
+// Finds file entry sets (FILE, FILE_INFO, FILE_NAME...) with a valid checksum
+// at 32 byte aligned positions in buf, which was read from the device at offset.
+size_t exfat_scan_entry_sets(const void *buf, size_t size, off_t offset,
+                             exfat_entry_set_cb cb, void *ctx) {
+    const struct exfat_entry *entries = buf;
+    const size_t n = size / sizeof(struct exfat_entry);
+    size_t found = 0;
+
+    for (size_t i = 0; i + 2 < n; ) {
+        const struct exfat_entry_meta1 *fde = (const struct exfat_entry_meta1 *) &entries[i];
+        if (fde->type == EXFAT_ENTRY_FILE &&
+            entries[i + 1].type == EXFAT_ENTRY_FILE_INFO &&
+            entries[i + 2].type == EXFAT_ENTRY_FILE_NAME &&
+            fde->continuations >= 2 && fde->continuations <= 18 &&
+            i + fde->continuations < n &&
+            le16_to_cpu(exfat_calc_checksum(&entries[i], fde->continuations + 1)) == le16_to_cpu(fde->checksum)) {
+            if (cb != NULL) {
+                cb(offset + (off_t) (i * sizeof(struct exfat_entry)), fde, ctx);
+            }
+            ++found;
+            i += 1 + fde->continuations;
+        } else {
+            ++i;
+        }
+    }
+    return found;
+}
+
 struct exfat_entry_upcase upcase_entry =    /* upper case translation table */
 {
     .type          = EXFAT_ENTRY_UPCASE,   //uint8_t type; /* EXFAT_ENTRY_UPCASE */
@@ -209,15 +262,11 @@ struct exfat_entry_upcase upcase_entry =    /* upper case translation table */
 
 uint32_t upcase_checksum(const uint8_t *const data, size_t data_bytes)
 {
-    uint32_t chksum = 0;
-    for (size_t i = 0; i < data_bytes; ++i) {
-        chksum = ((chksum << 31) | (chksum >> 1)) + (uint32_t)data[i];
-    }
-    return chksum;
+    return exfat_checksum32(0, data, data_bytes);
 }
 
 int init_upcase_table(struct exfat_file_allocation_table *fat, struct exfat_upcase_table *tbl) {
-    for (int i = 0; i < sizeof(tbl->upcase_entries); ++i) {
+    for (int i = 0; i < sizeof(tbl->upcase_entries) / sizeof(tbl->upcase_entries[0]); ++i) {
         tbl->upcase_entries[i] = i;
     }
     // ASCII
@@ -289,37 +338,54 @@ void free_directory(struct exfat_node_entry *dir) {
     free(dir);
 }
 
+static int compare_bptree_records(const void *a, const void *b) {
+    const struct bptree_record *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
 int reconstruct(struct exfat_dev *dev, FILE *logfile) {
     struct exfat fs;
-    struct exfat_volume_boot_record vbr; //TODO Needs to be initialized
-    struct exfat_file_allocation_table fat;
-    struct exfat_cluster_heap heap;
-    struct exfat_upcase_table upcase;
+    struct exfat_geometry geo;
+    struct exfat_volume_boot_record *vbr;
+    struct exfat_file_allocation_table fat = {NULL, 0};
+    struct exfat_cluster_heap heap = {NULL, 0};
+    struct exfat_upcase_table *upcase;
     struct bptree bptree;
-    struct exfat_entry_meta2 root_directory; // TODO initialize
-    size_t root_directory_offset = 0; // TODO initialize
-    struct exfat_entry_bitmap bmp_entry =            /* allocated clusters bitmap */
-    {
-        .type = EXFAT_ENTRY_BITMAP,                    /* EXFAT_ENTRY_BITMAP */
-        .bitmap_flags = 0,            /* bit 0: 0 = 1st cluster heap. 1 = 2nd cluster heap. */
-        .__unknown1 = {0},
-        .start_cluster = {2},
-        .size = {(FAT_CLUSTER_COUNT) / 8 + (FAT_CLUSTER_COUNT) % 8} /* in bytes = Ceil (Cluster count / 8 ) */
-    };
-
-    init_filesystem(dev, &fs, &vbr);
+    struct exfat_entry_bitmap bmp_entry;     /* allocated clusters bitmap */
+
+    int ret = exfat_probe_geometry(dev, &geo);
+    if (ret != 0) {
+        return -ret;
+    }
+    exfat_print_geometry(&geo);
+
+    vbr = calloc(1, sizeof(struct exfat_volume_boot_record));
+    upcase = malloc(sizeof(struct exfat_upcase_table));
+    if (vbr == NULL || upcase == NULL) {
+        free(upcase);
+        free(vbr);
+        return ENOMEM;
+    }
+    exfat_geometry_to_sb(&geo, &vbr->sb);
+    init_filesystem(dev, &fs, vbr);
     //fs->root    = make_node();
     //bptree_heap[0]
 
-    init_fat(&fat);
-    int ret = init_cluster_heap(&fat, &heap, &bmp_entry);
+    init_recovery_bitmap_entry(&bmp_entry, &geo);
+    ret = init_fat(&fat, &geo);
+    if (ret == 0) {
+        ret = init_cluster_heap(&fat, &heap, &bmp_entry, &geo);
+        if (ret == 0) {
+            ret = init_upcase_table(&fat, upcase);
+        }
+    }
     if (ret != 0) {
-        return ret;
-
+        free_cluster_heap(&heap);
+        free_fat(&fat);
+        free(upcase);
+        free(vbr);
+        return ret < 0 ? -ret : ret;
     }
-    init_upcase_table(&fat, &upcase);
-
-    make_bptree(&bptree, BPTREE_HEIGHT, &root_directory, root_directory_offset);
 
     char * line = NULL;
     size_t len = 0;
@@ -327,33 +393,95 @@ int reconstruct(struct exfat_dev *dev, FILE *logfile) {
     size_t offset;
     size_t scanf_str_sz = 1024;
     char *scanf_str = malloc(scanf_str_sz);
+    struct bptree_record *records = NULL;
+    size_t record_count = 0, record_capacity = 0;
 
-    while ((read = getline(&line, &len, logfile)) != -1) {
+    if (scanf_str == NULL) {
+        ret = ENOMEM;
+    }
+    while (ret == 0 && (read = getline(&line, &len, logfile)) != -1) {
         //printf("Retrieved line of length %zu:\n", read);
         //printf("%s", line);
-        while (read > scanf_str_sz) {
-            scanf_str_sz <<= 1;
-            scanf_str = realloc(scanf_str, scanf_str_sz);
+        if (read > scanf_str_sz) {
+            char *str;
+            while (read > scanf_str_sz) {
+                scanf_str_sz <<= 1;
+            }
+            str = realloc(scanf_str, scanf_str_sz);
+            if (str == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            scanf_str = str;
         }
 
-        if (sscanf(line, FDE_LOG_FMT, &offset) != 0) {
-            // insert
-        } else if (sscanf(line, EFL_LOG_FMT, &offset, scanf_str)) {
+        if (sscanf(line, FDE_LOG_FMT, &offset) == 1) {
+            struct exfat_entry_meta2 entry;
+            if (exfat_pread(dev, &entry, sizeof(entry), offset + sizeof(struct exfat_entry)) != sizeof(entry) ||
+                entry.type != EXFAT_ENTRY_FILE_INFO) {
+                fprintf(stderr, "no stream extension entry after FDE at %016zx\n", offset);
+                continue;
+            }
+            if (record_count == record_capacity) {
+                const size_t capacity = MAX(record_capacity * 2, 1024);
+                struct bptree_record *grown = realloc(records, capacity * sizeof(struct bptree_record));
+                if (grown == NULL) {
+                    ret = ENOMEM;
+                    break;
+                }
+                records = grown;
+                record_capacity = capacity;
+            }
+            records[record_count].offset = offset;
+            records[record_count].entry = entry;
+            ++record_count;
+        } else if (sscanf(line, EFL_LOG_FMT, &offset, scanf_str) == 2) {
             //EFL
-        } else if (sscanf(line, EFI_LOG_FMT, &offset)) {
+        } else if (sscanf(line, EFI_LOG_FMT, &offset) == 1) {
             //EFL
-        } else if (sscanf(line, EFN_LOG_FMT, &offset, scanf_str)) {
+        } else if (sscanf(line, EFN_LOG_FMT, &offset, scanf_str) == 2) {
             //EFN
         }
 
         // parse each line
     }
 
+    free(line);
     free(scanf_str);
+    if (ret != 0) {
+        fprintf(stderr, "out of memory reading the scan log\n");
+        free(records);
+        free_cluster_heap(&heap);
+        free_fat(&fat);
+        free(upcase);
+        free(vbr);
+        return ret;
+    }
+
+    // the scanner logs dense regions first, so the log is not in disk order
+    qsort(records, record_count, sizeof(struct bptree_record), compare_bptree_records);
+    ret = make_bptree(&bptree);
+    if (ret == 0) {
+        ret = bulk_load_bptree(&bptree, records, record_count);
+    }
+    free(records);
+    if (ret != 0) {
+        destroy_bptree(&bptree);
+        free_cluster_heap(&heap);
+        free_fat(&fat);
+        free(upcase);
+        free(vbr);
+        return -ret;
+    }
+    fprintf(stderr, "indexed %zu entry sets\n", bptree_size(&bptree));
 
     // TODO write FAT to disk or log
     //free_node(fs->root);
     destroy_bptree(&bptree);
+    free_cluster_heap(&heap);
+    free_fat(&fat);
+    free(upcase);
+    free(vbr);
     return 0;
 }
 
@@ -23,55 +23,96 @@
 #ifndef recovery_h
 #define recovery_h
 
+#include <stdbool.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #include "exfatfs.h"
 
+struct exfat;
+struct exfat_dev;
+
 #define FDE_LOG_FMT "FDE %016zx\n"
 #define EFL_LOG_FMT "EFL %016zx %s\n"
 #define EFI_LOG_FMT "EFI %016zx\n"
 #define EFN_LOG_FMT "EFN %016zx %s\n"
 
-#define SECTOR_SIZE_BYTES ((size_t)512)
-#define SECTORS_PER_CLUSTER ((size_t)512)
-#define CLUSTER_COUNT ((cluster_t)0xE8DB79)
-#define CLUSTER_COUNT_SECTORS (CLUSTER_COUNT * SECTORS_PER_CLUSTER)
-#define FAT_CLUSTER_COUNT (CLUSTER_COUNT - 2)
-#define CLUSTER_SIZE_BYTES (CLUSTER_COUNT_SECTORS * SECTOR_SIZE_BYTES)
-#define DISK_SIZE_BYTES ((size_t)0x000003a352944000)
-#define CLUSTER_HEAP_DISK_START_SECTOR ((size_t)0x8c400)
-#define CLUSTER_HEAP_PARTITION_START_SECTOR ((size_t)0x283D8)
-#define PARTITION_START_SECTOR ((size_t)0x64028)
-
-// rounded to sector boundary
-struct exfat_file_allocation_table
+enum exfat_geometry_source
 {
-    cluster_t entries[CLUSTER_COUNT];
-    uint8_t padding[SECTOR_SIZE_BYTES - ((CLUSTER_COUNT<<2) % SECTOR_SIZE_BYTES)];
-}
-PACKED;
-STATIC_ASSERT(sizeof(struct exfat_file_allocation_table) == (CLUSTER_COUNT << 2) + SECTOR_SIZE_BYTES - ((CLUSTER_COUNT << 2) % SECTOR_SIZE_BYTES) && (sizeof(struct exfat_file_allocation_table) % SECTOR_SIZE_BYTES) == 0 );
-
-struct exfat_sector
+    EXFAT_GEOMETRY_NONE,        // nothing usable was found
+    EXFAT_GEOMETRY_MAIN_VBR,    // main boot region passed its checksum
+    EXFAT_GEOMETRY_BACKUP_VBR,  // main boot region is gone, backup survived
+    EXFAT_GEOMETRY_INFERRED,    // guessed from directory entries found on disk
+};
+
+// Layout of the (possibly nuked) file system on the device. All offsets are
+// in bytes from the start of the device, so partitioned disks and bare
+// file system images are handled the same way.
+struct exfat_geometry
 {
-    uint8_t data[SECTOR_SIZE_BYTES];
-}
-PACKED;
-STATIC_ASSERT(sizeof(struct exfat_sector) == SECTOR_SIZE_BYTES);
-
-struct exfat_cluster
+    enum exfat_geometry_source source;
+    off_t disk_size;            // size of the device
+    off_t partition_offset;     // main VBR
+    off_t fat_offset;           // first FAT sector, 0 if unknown
+    off_t cluster_heap_offset;  // cluster 2
+    uint64_t sector_count;      // file system size in sectors
+    uint32_t fat_sector_count;  // 0 if unknown
+    uint32_t cluster_count;     // clusters in the heap
+    cluster_t rootdir_cluster;  // 0 if unknown
+    uint8_t sector_bits;        // sector size as (1 << n)
+    uint8_t spc_bits;           // sectors per cluster as (1 << n)
+};
+
+#define GEOMETRY_SECTOR_SIZE(geo) ((size_t) 1 << (geo).sector_bits)
+#define GEOMETRY_CLUSTER_SIZE(geo) (GEOMETRY_SECTOR_SIZE(geo) << (geo).spc_bits)
+#define VBR_SECTORS 12          // boot sectors, OEM parameters, reserved and checksum sectors
+
+// how far into the device to look for a surviving copy of the boot region
+#define GEOMETRY_VBR_SEARCH_BYTES ((off_t) 1 << 30)
+// number of evenly spread chunks read when inferring the geometry
+#define GEOMETRY_SAMPLE_COUNT 4096
+#define GEOMETRY_SAMPLE_BYTES ((size_t) 64 * 1024)
+
+int exfat_probe_geometry(struct exfat_dev *dev, struct exfat_geometry *geo);
+void exfat_print_geometry(const struct exfat_geometry *geo);
+off_t exfat_geometry_c2o(const struct exfat_geometry *geo, cluster_t cluster);
+cluster_t exfat_geometry_o2c(const struct exfat_geometry *geo, off_t offset);
+void exfat_geometry_to_sb(const struct exfat_geometry *geo, struct exfat_super_block *sb);
+
+// Called for every checksum-verified file entry set found in a buffer.
+typedef void (*exfat_entry_set_cb)(off_t offset, const struct exfat_entry_meta1 *fde, void *ctx);
+
+size_t exfat_scan_entry_sets(const void *buf, size_t size, off_t offset,
+                             exfat_entry_set_cb cb, void *ctx);
+
+// Recovered FAT, one entry per cluster including the two reserved ones.
+struct exfat_file_allocation_table
 {
-    struct exfat_sector sectors[SECTORS_PER_CLUSTER];
-}
-PACKED;
-STATIC_ASSERT(sizeof(struct exfat_cluster) == SECTOR_SIZE_BYTES*SECTORS_PER_CLUSTER);
+    cluster_t *entries;
+    cluster_t count;
+};
 
-//STATIC_ASSERT(sizeof(struct exfat_filesystem) == 1 + 24 + (0xE8DB79+2) );
+int init_fat(struct exfat_file_allocation_table *fat, const struct exfat_geometry *geo);
+void free_fat(struct exfat_file_allocation_table *fat);
 
-struct exfat;
-struct exfat_dev;
-
-void init_fat(struct exfat_file_allocation_table *fat);
+// What survived of the on-disk FAT, one entry per cluster like the FAT itself.
+// Clusters whose FAT sector was lost read as EXFAT_CLUSTER_FREE.
+struct exfat_fat_fragments
+{
+    cluster_t *next;
+    cluster_t count;            // cluster_count + EXFAT_FIRST_DATA_CLUSTER
+    uint32_t sectors_read;
+    uint32_t sectors_plausible; // every entry in range or a marker
+    uint32_t sectors_in_use;    // plausible and not all free
+};
+
+int load_fat_fragments(struct exfat_dev *dev, const struct exfat_geometry *geo, struct exfat_fat_fragments *frag);
+void free_fat_fragments(struct exfat_fat_fragments *frag);
+cluster_t follow_fat_fragments(const struct exfat_fat_fragments *frag, cluster_t start,
+                               cluster_t clusters, cluster_t *chain);
+bool fat_fragments_chain_valid(const struct exfat_fat_fragments *frag, const cluster_t *chain,
+                               cluster_t length, cluster_t clusters);
+void print_fat_fragments(const struct exfat_fat_fragments *frag);
 void update_chksum_sector(le32_t *chksum, const uint8_t *const buf, size_t len);
 void restore_fat(struct exfat_dev *dev, struct exfat_volume_boot_record *vbr);
 struct exfat_node* make_node(void);
@@ -80,18 +121,17 @@ void dump_exfat_entry(union exfat_entries_t *ent, size_t cluster_ofs);
 struct exfat_node* try_load_node_from_fde(struct exfat *fs, size_t fde_offset);
 void init_filesystem(struct exfat_dev *dev, struct exfat *fs, struct exfat_volume_boot_record *vbr);
 
-#define CLUSTER_HEAP_SIZE (BMAP_SIZE(FAT_CLUSTER_COUNT))
-#define CLUSTER_HEAP_SIZE_BYTES (CLUSTER_HEAP_SIZE * sizeof(bitmap_t))
-
 struct exfat_cluster_heap {
-    bitmap_t allocation_flags[CLUSTER_HEAP_SIZE];
-}
-PACKED;
-STATIC_ASSERT(sizeof(struct exfat_cluster_heap) == CLUSTER_HEAP_SIZE_BYTES);
+    bitmap_t *allocation_flags;
+    uint32_t size; // in bits
+};
 
 int init_cluster_heap(struct exfat_file_allocation_table *fat,
                       struct exfat_cluster_heap *heap,
-                      const struct exfat_entry_bitmap *const bmp_entry);
+                      const struct exfat_entry_bitmap *const bmp_entry,
+                      const struct exfat_geometry *geo);
+void free_cluster_heap(struct exfat_cluster_heap *heap);
+void init_recovery_bitmap_entry(struct exfat_entry_bitmap *bmp_entry, const struct exfat_geometry *geo);
 
 struct exfat_upcase_table
 {
@@ -108,6 +148,40 @@ void free_directory(struct exfat_node_entry *dir);
 
 int reconstruct(struct exfat_dev *dev, FILE *logfile);
 
+// Everything reconstruction writes, in the order it has to reach the disk.
+// Phases are synced one after the other and the boot region comes last, so
+// the file system only shows up once all it refers to is in place. Records
+// overwrite absolute offsets, so a replay that was interrupted is finished by
+// simply replaying the whole journal again.
+enum exfat_journal_phase
+{
+    EXFAT_JOURNAL_METADATA = 1, // allocation bitmap and upcase table
+    EXFAT_JOURNAL_DIRECTORIES,  // new root and lost+found, repaired entry sets
+    EXFAT_JOURNAL_FAT,
+    EXFAT_JOURNAL_BACKUP_VBR,
+    EXFAT_JOURNAL_MAIN_VBR,
+};
+
+#define EXFAT_JOURNAL_RECORD_BYTES ((size_t) 4 * 1024 * 1024)
+
+struct exfat_journal
+{
+    int fd;
+    uint8_t *buffer;
+    size_t used;
+    uint32_t phase;             // of the records written now
+    uint64_t records;
+    uint64_t bytes;             // to be written to the device
+    int error;                  // first errno, sticky
+};
+
+int exfat_journal_open(struct exfat_journal *journal, int fd, const struct exfat_geometry *geo);
+void exfat_journal_write(struct exfat_journal *journal, off_t offset, const void *data, size_t size);
+void exfat_journal_zero(struct exfat_journal *journal, off_t offset, uint64_t size);
+void exfat_journal_barrier(struct exfat_journal *journal);
+int exfat_journal_close(struct exfat_journal *journal);
+int exfat_journal_replay(struct exfat_dev *dev, int fd);
+
 void dump_exfat_entry(union exfat_entries_t *ent, size_t cluster_ofs);
 
 #endif /* recovery_h */
@@ -53,68 +53,6 @@ void exfat_get_name(const struct exfat_node* node,
 		exfat_bug("failed to convert name to UTF-8");
 }
 
-static uint16_t add_checksum_byte(uint16_t sum, uint8_t byte)
-{
-	return ((sum << 15) | (sum >> 1)) + byte;
-}
-
-static uint16_t add_checksum_bytes(uint16_t sum, const void* buffer, size_t n)
-{
-	int i;
-
-	for (i = 0; i < n; i++)
-		sum = add_checksum_byte(sum, ((const uint8_t*) buffer)[i]);
-	return sum;
-}
-
-uint16_t exfat_start_checksum(const struct exfat_entry_meta1* entry)
-{
-	uint16_t sum = 0;
-	int i;
-
-	for (i = 0; i < sizeof(struct exfat_entry); i++)
-		if (i != 2 && i != 3) /* skip checksum field itself */
-			sum = add_checksum_byte(sum, ((const uint8_t*) entry)[i]);
-	return sum;
-}
-
-uint16_t exfat_add_checksum(const void* entry, uint16_t sum)
-{
-	return add_checksum_bytes(sum, entry, sizeof(struct exfat_entry));
-}
-
-le16_t exfat_calc_checksum(const struct exfat_entry* entries, int n)
-{
-	uint16_t checksum;
-	int i;
-
-	checksum = exfat_start_checksum((const struct exfat_entry_meta1*) entries);
-	for (i = 1; i < n; i++)
-		checksum = exfat_add_checksum(entries + i, checksum);
-	return cpu_to_le16(checksum);
-}
-
-uint32_t exfat_vbr_start_checksum(const void* sector, size_t size)
-{
-	size_t i;
-	uint32_t sum = 0;
-
-	for (i = 0; i < size; i++)
-		/* skip volume_state and allocated_percent fields */
-		if (i != 0x6a && i != 0x6b && i != 0x70)
-			sum = ((sum << 31) | (sum >> 1)) + ((const uint8_t*) sector)[i];
-	return sum;
-}
-
-uint32_t exfat_vbr_add_checksum(const void* sector, size_t size, uint32_t sum)
-{
-	size_t i;
-
-	for (i = 0; i < size; i++)
-		sum = ((sum << 31) | (sum >> 1)) + ((const uint8_t*) sector)[i];
-	return sum;
-}
-
 le16_t exfat_calc_name_hash(const struct exfat* ef, const le16_t* name,
 		size_t length)
 {
@@ -178,3 +116,21 @@ void exfat_print_info(const struct exfat_super_block* sb,
 	exfat_humanize_bytes(avail_space, &hb);
 	printf("Available space      %10"PRIu64" %s\n", hb.value, hb.unit);
 }
+
+/* Writes a string as a quoted JSON string; names are UTF-8 already. */
+void exfat_print_json_string(FILE* stream, const char* str)
+{
+	fputc('"', stream);
+	for (; *str != '\0'; str++)
+	{
+		const unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(stream, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(stream, "\\u%04x", c);
+		else
+			fputc(c, stream);
+	}
+	fputc('"', stream);
+}
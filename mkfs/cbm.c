@@ -45,26 +45,24 @@ static int cbm_write(struct exfat_dev* dev)
 			DIV_ROUND_UP(cbm.get_size(), get_cluster_size()) +
 			DIV_ROUND_UP(uct.get_size(), get_cluster_size()) +
 			DIV_ROUND_UP(rootdir.get_size(), get_cluster_size());
-	size_t bitmap_size = ROUND_UP(allocated_clusters, CHAR_BIT);
-	bitmap_t* bitmap = malloc(BMAP_SIZE(bitmap_size));
-	size_t i;
+	size_t bitmap_size = DIV_ROUND_UP(allocated_clusters, CHAR_BIT);
+	uint8_t* bitmap = malloc(bitmap_size);
 
 	if (bitmap == NULL)
 	{
-		exfat_error("failed to allocate bitmap of %zu bytes",
-				BMAP_SIZE(bitmap_size));
+		exfat_error("failed to allocate bitmap of %zu bytes", bitmap_size);
 		return 1;
 	}
-	memset(bitmap, 0, BMAP_SIZE(bitmap_size));
 
-	for (i = 0; i < bitmap_size; i++)
-		if (i < allocated_clusters)
-			BMAP_SET(bitmap, i);
-	if (exfat_write(dev, bitmap, bitmap_size / CHAR_BIT) < 0)
+	/* the allocated clusters are the first ones, so whole bytes of ones
+	   and then the few bits left over */
+	memset(bitmap, 0xff, allocated_clusters / CHAR_BIT);
+	if (allocated_clusters % CHAR_BIT != 0)
+		bitmap[bitmap_size - 1] = (1u << (allocated_clusters % CHAR_BIT)) - 1;
+	if (exfat_write(dev, bitmap, bitmap_size) < 0)
 	{
 		free(bitmap);
-		exfat_error("failed to write bitmap of %zu bytes",
-				bitmap_size / CHAR_BIT);
+		exfat_error("failed to write bitmap of %zu bytes", bitmap_size);
 		return 1;
 	}
 	free(bitmap);
@@ -36,48 +36,72 @@ static off_t fat_size(void)
 	return get_volume_size() / get_cluster_size() * sizeof(cluster_t);
 }
 
-static cluster_t fat_write_entry(struct exfat_dev* dev, cluster_t cluster,
-		cluster_t value)
+/* FAT entries are staged here and written out a buffer at a time */
+#define FAT_STAGING_ENTRIES (64 * 1024)
+
+struct fat_staging
 {
-	le32_t fat_entry = cpu_to_le32(value);
-	if (exfat_write(dev, &fat_entry, sizeof(fat_entry)) < 0)
-	{
-		exfat_error("failed to write FAT entry 0x%x", value);
+	struct exfat_dev* dev;
+	le32_t* entries;
+	size_t count;
+	cluster_t cluster;
+};
+
+static int fat_flush(struct fat_staging* staging)
+{
+	if (staging->count == 0)
 		return 0;
+	if (exfat_write(staging->dev, staging->entries,
+			staging->count * sizeof(le32_t)) < 0)
+	{
+		exfat_error("failed to write FAT entries 0x%x-0x%x",
+				(unsigned) (staging->cluster - staging->count),
+				staging->cluster - 1);
+		return 1;
 	}
-	return cluster + 1;
+	staging->count = 0;
+	return 0;
 }
 
-static cluster_t fat_write_entries(struct exfat_dev* dev, cluster_t cluster,
-		uint64_t length)
+static int fat_add_entry(struct fat_staging* staging, cluster_t value)
 {
-	cluster_t end = cluster + DIV_ROUND_UP(length, get_cluster_size());
+	staging->entries[staging->count++] = cpu_to_le32(value);
+	staging->cluster++;
+	if (staging->count == FAT_STAGING_ENTRIES)
+		return fat_flush(staging);
+	return 0;
+}
 
-	while (cluster < end - 1)
-	{
-		cluster = fat_write_entry(dev, cluster, cluster + 1);
-		if (cluster == 0)
-			return 0;
-	}
-	return fat_write_entry(dev, cluster, EXFAT_CLUSTER_END);
+static int fat_add_entries(struct fat_staging* staging, uint64_t length)
+{
+	cluster_t end = staging->cluster + DIV_ROUND_UP(length, get_cluster_size());
+
+	while (staging->cluster < end - 1)
+		if (fat_add_entry(staging, staging->cluster + 1) != 0)
+			return 1;
+	return fat_add_entry(staging, EXFAT_CLUSTER_END);
 }
 
 static int fat_write(struct exfat_dev* dev)
 {
-	cluster_t c = 0;
+	struct fat_staging staging = {dev, NULL, 0, 0};
+	int rc = 1;
 
-	if (!(c = fat_write_entry(dev, c, 0xfffffff8))) /* media type */
-		return 1;
-	if (!(c = fat_write_entry(dev, c, 0xffffffff))) /* some weird constant */
-		return 1;
-	if (!(c = fat_write_entries(dev, c, cbm.get_size())))
-		return 1;
-	if (!(c = fat_write_entries(dev, c, uct.get_size())))
-		return 1;
-	if (!(c = fat_write_entries(dev, c, rootdir.get_size())))
+	staging.entries = malloc(FAT_STAGING_ENTRIES * sizeof(le32_t));
+	if (staging.entries == NULL)
+	{
+		exfat_error("failed to allocate %zu bytes for FAT entries",
+				FAT_STAGING_ENTRIES * sizeof(le32_t));
 		return 1;
-
-	return 0;
+	}
+	if (fat_add_entry(&staging, 0xfffffff8) == 0 && /* media type */
+			fat_add_entry(&staging, 0xffffffff) == 0 && /* some weird constant */
+			fat_add_entries(&staging, cbm.get_size()) == 0 &&
+			fat_add_entries(&staging, uct.get_size()) == 0 &&
+			fat_add_entries(&staging, rootdir.get_size()) == 0)
+		rc = fat_flush(&staging);
+	free(staging.entries);
+	return rc;
 }
 
 const struct fs_object fat =
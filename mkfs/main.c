@@ -28,8 +28,11 @@
 #include "rootdir.h"
 #include <exfat.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
@@ -156,7 +159,7 @@ static uint32_t setup_volume_serial(uint32_t user_defined)
 
 static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
 		const char* volume_label, uint32_t volume_serial,
-		uint64_t first_sector)
+		uint64_t first_sector, bool sparse)
 {
 	param.sector_bits = sector_bits;
 	param.first_sector = first_sector;
@@ -173,7 +176,7 @@ static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
 	if (param.volume_serial == 0)
 		return 1;
 
-	return mkfs(dev, param.volume_size);
+	return mkfs(dev, param.volume_size, sparse);
 }
 
 static int logarithm2(int n)
@@ -186,11 +189,71 @@ static int logarithm2(int n)
 	return -1;
 }
 
+static off_t parse_size(const char* s)
+{
+	char* end;
+	off_t size = strtoll(s, &end, 10);
+
+	switch (*end)
+	{
+	case 'T': case 't':
+		size <<= 10;
+		/* fall through */
+	case 'G': case 'g':
+		size <<= 10;
+		/* fall through */
+	case 'M': case 'm':
+		size <<= 10;
+		/* fall through */
+	case 'K': case 'k':
+		size <<= 10;
+		end++;
+		break;
+	}
+	if (end == s || *end != '\0' || size <= 0)
+		return -1;
+	return size;
+}
+
+/*
+	Makes spec a regular file of the given size that is one big hole. Then
+	nothing but the metadata mkfs writes takes up space, and there is no need
+	to erase anything.
+*/
+static int create_sparse_image(const char* spec, off_t size)
+{
+	struct stat stbuf;
+	int fd;
+
+	if (stat(spec, &stbuf) == 0 && !S_ISREG(stbuf.st_mode))
+	{
+		exfat_error("'%s' is not a regular file, sparse image not created",
+				spec);
+		return 1;
+	}
+	fd = open(spec, O_RDWR | O_CREAT, 0666);
+	if (fd == -1)
+	{
+		exfat_error("failed to create '%s': %s", spec, strerror(errno));
+		return 1;
+	}
+	/* drop whatever was there before */
+	if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+	{
+		exfat_error("failed to resize '%s' to %"PRIu64" bytes: %s", spec,
+				size, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	return close(fd) == 0 ? 0 : 1;
+}
+
 static void usage(const char* prog)
 {
 	fprintf(stderr, "Usage: %s [-i volume-id] [-n label] "
 			"[-p partition-first-sector] "
-			"[-s sectors-per-cluster] [-V] <device>\n", prog);
+			"[-s sectors-per-cluster] [-S image-size] [-V] <device>\n",
+			prog);
 	exit(1);
 }
 
@@ -202,11 +265,12 @@ int main(int argc, char* argv[])
 	const char* volume_label = NULL;
 	uint32_t volume_serial = 0;
 	uint64_t first_sector = 0;
+	off_t sparse_size = 0;
 	struct exfat_dev* dev;
 
 	printf("mkexfatfs %s\n", VERSION);
 
-	while ((opt = getopt(argc, argv, "i:n:p:s:V")) != -1)
+	while ((opt = getopt(argc, argv, "i:n:p:s:S:V")) != -1)
 	{
 		switch (opt)
 		{
@@ -227,6 +291,14 @@ int main(int argc, char* argv[])
 				return 1;
 			}
 			break;
+		case 'S':
+			sparse_size = parse_size(optarg);
+			if (sparse_size < 0)
+			{
+				exfat_error("invalid option value: '%s'", optarg);
+				return 1;
+			}
+			break;
 		case 'V':
 			puts("Copyright (C) 2011-2018  Andrew Nayenko");
 			return 0;
@@ -239,11 +311,13 @@ int main(int argc, char* argv[])
 		usage(argv[0]);
 	spec = argv[optind];
 
+	if (sparse_size != 0 && create_sparse_image(spec, sparse_size) != 0)
+		return 1;
 	dev = exfat_open(spec, EXFAT_MODE_RW);
 	if (dev == NULL)
 		return 1;
 	if (setup(dev, 9, spc_bits, volume_label, volume_serial,
-				first_sector) != 0)
+				first_sector, sparse_size != 0) != 0)
 	{
 		exfat_close(dev);
 		return 1;
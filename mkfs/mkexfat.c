@@ -52,11 +52,16 @@ static int check_size(off_t volume_size)
 }
 
 static int erase_object(struct exfat_dev* dev, const void* block,
-		size_t block_size, off_t start, off_t size)
+		size_t block_size, off_t start, off_t size,
+		enum exfat_zero_method* method)
 {
 	const off_t block_count = DIV_ROUND_UP(size, block_size);
 	off_t i;
 
+	*method = exfat_zero_range(dev, start, size);
+	if (*method != EXFAT_ZERO_UNSUPPORTED)
+		return 0;
+
 	if (exfat_seek(dev, start, SEEK_SET) == (off_t) -1)
 	{
 		exfat_error("seek to 0x%"PRIx64" failed", start);
@@ -74,7 +79,12 @@ static int erase_object(struct exfat_dev* dev, const void* block,
 	return 0;
 }
 
-static int erase(struct exfat_dev* dev)
+/*
+	Zeroes every object, leaving it to the device or the file system below
+	where possible and writing zeroes where not. Sets a bit in *methods for
+	each way that was used.
+*/
+static int erase(struct exfat_dev* dev, unsigned* methods)
 {
 	const struct fs_object** pp;
 	off_t position = 0;
@@ -88,15 +98,21 @@ static int erase(struct exfat_dev* dev)
 	}
 	memset(block, 0, block_size);
 
+	*methods = 0;
 	for (pp = objects; *pp; pp++)
 	{
+		enum exfat_zero_method method;
+
 		position = ROUND_UP(position, (*pp)->get_alignment());
+		if ((*pp)->get_size() == 0)
+			continue;
 		if (erase_object(dev, block, block_size, position,
-				(*pp)->get_size()) != 0)
+				(*pp)->get_size(), &method) != 0)
 		{
 			free(block);
 			return 1;
 		}
+		*methods |= 1u << method;
 		position += (*pp)->get_size();
 	}
 
@@ -104,6 +120,28 @@ static int erase(struct exfat_dev* dev)
 	return 0;
 }
 
+static void print_erase_methods(unsigned methods)
+{
+	static const char* const names[] =
+	{
+		[EXFAT_ZERO_UNSUPPORTED] = "written",
+		[EXFAT_ZERO_FILE_RANGE] = "marked unwritten",
+		[EXFAT_ZERO_FILE_HOLE] = "deallocated",
+		[EXFAT_ZERO_DEVICE] = "zeroed by device",
+	};
+	const char* separator = " (";
+	size_t i;
+
+	fputs("done", stdout);
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+		if (methods & (1u << i))
+		{
+			printf("%s%s", separator, names[i]);
+			separator = ", ";
+		}
+	puts(methods != 0 ? ")." : ".");
+}
+
 static int create(struct exfat_dev* dev)
 {
 	const struct fs_object** pp;
@@ -124,15 +162,25 @@ static int create(struct exfat_dev* dev)
 	return 0;
 }
 
-int mkfs(struct exfat_dev* dev, off_t volume_size)
+int mkfs(struct exfat_dev* dev, off_t volume_size, bool sparse)
 {
+	unsigned methods;
+
 	if (check_size(volume_size) != 0)
 		return 1;
 
+	/* a sparse image is a hole already, only the metadata gets written */
+	if (!sparse)
+	{
+		fputs("Erasing... ", stdout);
+		fflush(stdout);
+		if (erase(dev, &methods) != 0)
+			return 1;
+		print_erase_methods(methods);
+	}
+
 	fputs("Creating... ", stdout);
 	fflush(stdout);
-	if (erase(dev) != 0)
-		return 1;
 	if (create(dev) != 0)
 		return 1;
 	puts("done.");
@@ -60,15 +60,9 @@ static void init_bitmap_entry(struct exfat_entry_bitmap* bitmap_entry)
 
 static void init_upcase_entry(struct exfat_entry_upcase* upcase_entry)
 {
-	size_t i;
-	uint32_t sum = 0;
-
-	for (i = 0; i < sizeof(upcase_table); i++)
-		sum = ((sum << 31) | (sum >> 1)) + upcase_table[i];
-
 	memset(upcase_entry, 0, sizeof(struct exfat_entry_upcase));
 	upcase_entry->type = EXFAT_ENTRY_UPCASE;
-	upcase_entry->checksum = cpu_to_le32(sum);
+	upcase_entry->checksum = cpu_to_le32(UPCASE_TABLE_CHECKSUM);
 	upcase_entry->start_cluster = cpu_to_le32(
 			(get_position(&uct) - get_position(&cbm)) / get_cluster_size() +
 			EXFAT_FIRST_DATA_CLUSTER);
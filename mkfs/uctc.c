@@ -22,7 +22,7 @@
 
 #include "uctc.h"
 
-uint8_t upcase_table[5836] =
+const uint8_t upcase_table[5836] =
 {
 	0x00, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00,
 	0x04, 0x00, 0x05, 0x00, 0x06, 0x00, 0x07, 0x00,
@@ -25,6 +25,13 @@
 
 #include <stdint.h>
 
-extern uint8_t upcase_table[5836];
+/* The table is stored compressed the way exFAT keeps it on disk: runs of
+   characters that map to themselves are a 0xffff mark and a run length. */
+extern const uint8_t upcase_table[5836];
+
+/* Checksum of upcase_table as it goes into the upcase table entry. It is
+   the one the specification gives for its recommended table, which this
+   is, so it never has to be computed. */
+#define UPCASE_TABLE_CHECKSUM 0xe619d30d
 
 #endif /* ifndef MKFS_UCTC_H_INCLUDED */
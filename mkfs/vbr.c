@@ -79,64 +79,50 @@ static void init_sb(struct exfat_super_block* sb)
 	sb->boot_signature = cpu_to_le16(0xaa55);
 }
 
+/*
+	The boot region is built in memory: the super block, 8 sectors ending
+	with the boot signature, 2 empty ones (OEM parameters and reserved) and
+	the checksum sector. Then it is summed in one go and written at once.
+*/
 static int vbr_write(struct exfat_dev* dev)
 {
-	struct exfat_super_block sb;
+	const size_t sector_size = get_sector_size();
+	const size_t region_size = vbr_size();
+	uint8_t* region = malloc(region_size);
+	le32_t* checksum_sector;
 	uint32_t checksum;
-	le32_t* sector = malloc(get_sector_size());
 	size_t i;
 
-	if (sector == NULL)
+	if (region == NULL)
 	{
-		exfat_error("failed to allocate sector-sized block of memory");
+		exfat_error("failed to allocate %zu bytes for the boot region",
+				region_size);
 		return 1;
 	}
+	memset(region, 0, region_size);
 
-	init_sb(&sb);
-	if (exfat_write(dev, &sb, sizeof(struct exfat_super_block)) < 0)
+	init_sb((struct exfat_super_block*) region);
+	for (i = 1; i <= 8; i++)
 	{
-		free(sector);
-		exfat_error("failed to write super block sector");
-		return 1;
-	}
-	checksum = exfat_vbr_start_checksum(&sb, sizeof(struct exfat_super_block));
+		le32_t* sector = (le32_t*) (region + i * sector_size);
 
-	memset(sector, 0, get_sector_size());
-	sector[get_sector_size() / sizeof(sector[0]) - 1] =
-			cpu_to_le32(0xaa550000);
-	for (i = 0; i < 8; i++)
-	{
-		if (exfat_write(dev, sector, get_sector_size()) < 0)
-		{
-			free(sector);
-			exfat_error("failed to write a sector with boot signature");
-			return 1;
-		}
-		checksum = exfat_vbr_add_checksum(sector, get_sector_size(), checksum);
+		sector[sector_size / sizeof(sector[0]) - 1] = cpu_to_le32(0xaa550000);
 	}
 
-	memset(sector, 0, get_sector_size());
-	for (i = 0; i < 2; i++)
-	{
-		if (exfat_write(dev, sector, get_sector_size()) < 0)
-		{
-			free(sector);
-			exfat_error("failed to write an empty sector");
-			return 1;
-		}
-		checksum = exfat_vbr_add_checksum(sector, get_sector_size(), checksum);
-	}
+	checksum = exfat_vbr_start_checksum(region, sector_size);
+	checksum = exfat_vbr_add_checksum(region + sector_size,
+			10 * sector_size, checksum);
+	checksum_sector = (le32_t*) (region + 11 * sector_size);
+	for (i = 0; i < sector_size / sizeof(checksum_sector[0]); i++)
+		checksum_sector[i] = cpu_to_le32(checksum);
 
-	for (i = 0; i < get_sector_size() / sizeof(sector[0]); i++)
-		sector[i] = cpu_to_le32(checksum);
-	if (exfat_write(dev, sector, get_sector_size()) < 0)
+	if (exfat_write(dev, region, region_size) < 0)
 	{
-		free(sector);
-		exfat_error("failed to write checksum sector");
+		free(region);
+		exfat_error("failed to write boot region");
 		return 1;
 	}
-
-	free(sector);
+	free(region);
 	return 0;
 }
 
@@ -23,30 +23,13 @@
 
 #include <exfat.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 
-static const size_t sector_size_bytes = 512; // bytes 0x0200
-static const size_t sectors_per_cluster = 512; // 0x0200
-static const size_t cluster_size_bytes =
-	sector_size_bytes * sectors_per_cluster; // 0x040000
-static const size_t disk_size_bytes = 0x000003a352944000; // 0x0000040000000000; // 4TB
-static const size_t cluster_heap_disk_start_sector = 0x8c400;
-static const size_t cluster_heap_partition_start_sector = 0x283D8;
-static const size_t partition_start_sector = 0x64028;
-
-static const cluster_t start_offset_cluster = 0x00adb000;
-static const size_t start_offset_bytes = start_offset_cluster * cluster_size_bytes;
-static const size_t start_offset_sector = start_offset_bytes / sector_size_bytes;
-
-// byte offset 0x458af40000 = cluster 0x115e5b
-// 0x115e5b * 0x40000 = 0x45796c0000
-// 0x458af40000 - 0x45796c0000 = 0x11880000 (start offset bytes) 0x8C400 (sector)
-// cluster 0 = byte offset 0x1181c000 = sector 0x8c0e0
-
 void cluster_search_file_directory_entries(uint8_t *cluster_buf, size_t cluster_size, size_t cluster_ofs_begin) {
     //fprintf(stderr, "cluster_search_file_directory_entries 0x%016zx, 0x%08zx\n", cluster_ofs_begin, cluster_size);
     uint8_t *cluster_ptr = cluster_buf, *cluster_end = cluster_buf + cluster_size;
@@ -54,7 +37,7 @@ void cluster_search_file_directory_entries(uint8_t *cluster_buf, size_t cluster_
     struct exfat_entry_meta1 *file_directory_entry = NULL;
     int subcount = 0;
     while (cluster_ptr < cluster_end - sizeof(struct exfat_entry)*2) {
-        size_t cluster_ofs = (cluster_ptr - cluster_end) + cluster_ofs_begin;
+        size_t cluster_ofs = (cluster_ptr - cluster_buf) + cluster_ofs_begin;
         // File Directory Entry. starts file entry set.
         //followed by stream extension directory entry (0xC0) and then
         // from 1 to 17 of the file name extension directory entry (0xC1)
@@ -157,19 +140,39 @@ void cluster_search_file_directory_entries(uint8_t *cluster_buf, size_t cluster_
     }
 }
 
-int log_dir_entries(struct exfat_dev *dev) {
-    uint8_t cluster_buf[cluster_size_bytes];
-    cluster_t c = start_offset_cluster;
-    exfat_seek(dev, start_offset_bytes, SEEK_SET);
-    for (;;) {
-        const size_t cluster_ofs = c * cluster_size_bytes;
-        ssize_t rd = exfat_read(dev, cluster_buf, sizeof(cluster_buf));
+// Pre-scan: the device is split into regions and a few clusters of each are
+// sampled, counting checksum-verified entry sets. Directory clusters tend to
+// be packed together, so the full scan visits the densest regions first and
+// most of the file tree is in the log long before the scan is over.
+#define PRESCAN_REGION_BYTES ((size_t) 64 * 1024 * 1024)
+#define PRESCAN_SAMPLES_PER_REGION 8
+#define PRESCAN_SAMPLE_BYTES ((size_t) 64 * 1024)
+
+struct scan_region {
+    cluster_t first;
+    cluster_t count;
+    uint32_t hits;
+};
+
+static int compare_regions(const void *a, const void *b) {
+    const struct scan_region *x = a, *y = b;
+    if (x->hits != y->hits) {
+        return x->hits > y->hits ? -1 : 1;
+    }
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+static void scan_clusters(struct exfat_dev *dev, const struct exfat_geometry *geo,
+                          uint8_t *cluster_buf, cluster_t first, cluster_t end) {
+    const size_t cluster_size_bytes = GEOMETRY_CLUSTER_SIZE(*geo);
+    for (cluster_t c = first; c < end; ++c) {
+        const size_t cluster_ofs = exfat_geometry_c2o(geo, c);
+        ssize_t rd = exfat_pread(dev, cluster_buf, cluster_size_bytes, cluster_ofs);
         if (rd == 0) { // eof
             break;
         } else if (rd == -1) {
             fprintf(stderr, "error reading cluster %08x at offset %016zx: %s\n", c, cluster_ofs, strerror(errno));
             printf("BAD_CLUSTER %08x OFFSET %016zx\n", c, cluster_ofs);
-            exfat_seek(dev, cluster_ofs + sizeof(cluster_buf), SEEK_SET);
         } else {
             cluster_search_file_directory_entries(cluster_buf, rd, cluster_ofs);
             if ((c & 0xFFF) == 0) {
@@ -177,15 +180,92 @@ int log_dir_entries(struct exfat_dev *dev) {
             }
         }
         fflush(stdout);
-        ++c;
     }
+}
+
+static size_t make_priority_map(struct exfat_dev *dev, const struct exfat_geometry *geo,
+                                cluster_t start_cluster, uint8_t *buf,
+                                struct scan_region **pregions) {
+    const size_t cluster_size_bytes = GEOMETRY_CLUSTER_SIZE(*geo);
+    const cluster_t end_cluster = geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    const cluster_t region_clusters = MAX(PRESCAN_REGION_BYTES / cluster_size_bytes, 1);
+    const size_t sample_bytes = MIN(cluster_size_bytes, PRESCAN_SAMPLE_BYTES);
+    const size_t region_count = DIV_ROUND_UP((size_t) (end_cluster - start_cluster), region_clusters);
+    struct scan_region *regions = calloc(region_count, sizeof(struct scan_region));
+    size_t dense = 0;
+
+    if (regions == NULL) {
+        return 0;
+    }
+    for (size_t r = 0; r < region_count; ++r) {
+        struct scan_region *region = &regions[r];
+        region->first = start_cluster + r * region_clusters;
+        region->count = MIN(region_clusters, end_cluster - region->first);
+        for (int i = 0; i < PRESCAN_SAMPLES_PER_REGION; ++i) {
+            const cluster_t c = region->first + (cluster_t) ((uint64_t) region->count * i / PRESCAN_SAMPLES_PER_REGION);
+            ssize_t rd = exfat_pread(dev, buf, sample_bytes, exfat_geometry_c2o(geo, c));
+            if (rd > 0) {
+                region->hits += exfat_scan_entry_sets(buf, rd, 0, NULL, NULL);
+            }
+            if (region->count < PRESCAN_SAMPLES_PER_REGION) {
+                break;
+            }
+        }
+        if (region->hits != 0) {
+            ++dense;
+        }
+    }
+    qsort(regions, region_count, sizeof(struct scan_region), compare_regions);
+
+    fprintf(stderr, "pre-scan: %zu of %zu regions of %u clusters contain entry sets\n",
+            dense, region_count, region_clusters);
+    for (size_t r = 0; r < dense; ++r) {
+        fprintf(stderr, "pre-scan: clusters %08x-%08x density %u\n",
+                regions[r].first, regions[r].first + regions[r].count - 1, regions[r].hits);
+    }
+    *pregions = regions;
+    return region_count;
+}
+
+int log_dir_entries(struct exfat_dev *dev, const struct exfat_geometry *geo, cluster_t start_cluster, bool prescan) {
+    const cluster_t end_cluster = geo->cluster_count + EXFAT_FIRST_DATA_CLUSTER;
+    struct scan_region *regions = NULL;
+    size_t region_count = 0;
+    uint8_t *cluster_buf = malloc(GEOMETRY_CLUSTER_SIZE(*geo));
+    if (cluster_buf == NULL) {
+        return ENOMEM;
+    }
+    if (prescan) {
+        region_count = make_priority_map(dev, geo, start_cluster, cluster_buf, &regions);
+    }
+    if (region_count != 0) {
+        for (size_t r = 0; r < region_count; ++r) {
+            scan_clusters(dev, geo, cluster_buf, regions[r].first, regions[r].first + regions[r].count);
+        }
+    } else {
+        scan_clusters(dev, geo, cluster_buf, start_cluster, end_cluster);
+    }
+    free(regions);
+    free(cluster_buf);
     return 0;
 }
 
-static int scan(struct exfat_dev *dev) {
+static int scan(struct exfat_dev *dev, cluster_t start_cluster, bool prescan) {
 	// run through every cluster, check for directories, write to log
+    struct exfat_geometry geo;
 
-    int ret = log_dir_entries(dev);
+    int ret = exfat_probe_geometry(dev, &geo);
+    if (ret != 0) {
+        return -ret;
+    }
+    exfat_print_geometry(&geo);
+    if (start_cluster < EXFAT_FIRST_DATA_CLUSTER) {
+        start_cluster = EXFAT_FIRST_DATA_CLUSTER;
+    }
+    if (start_cluster >= geo.cluster_count + EXFAT_FIRST_DATA_CLUSTER) {
+        return EINVAL;
+    }
+    ret = log_dir_entries(dev, &geo, start_cluster, prescan);
     return ret;
 }
 
@@ -196,7 +276,7 @@ static int scan(struct exfat_dev *dev) {
 
 static void usage(const char* prog)
 {
-    fprintf(stderr, "Usage: %s <device>\n", prog);
+    fprintf(stderr, "Usage: %s [-l] [-c start-cluster] <device>\n", prog);
     fprintf(stderr, "       %s -V\n", prog);
     exit(1);
 }
@@ -207,13 +287,21 @@ int main(int argc, char* argv[])
 	const char* options;
 	const char* spec = NULL;
     struct exfat_dev *dev;
+    cluster_t start_cluster = EXFAT_FIRST_DATA_CLUSTER;
+    bool prescan = true;
 
 	fprintf(stderr, "%s %s\n", argv[0], VERSION);
 
-	while ((opt = getopt(argc, argv, "V")) != -1)
+	while ((opt = getopt(argc, argv, "c:lV")) != -1)
 	{
 		switch (opt)
 		{
+			case 'c':
+				start_cluster = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				prescan = false;
+				break;
 			case 'V':
 				fprintf(stderr, "Copyright (C) 2011-2018  Andrew Nayenko\n");
 				fprintf(stderr, "Copyright (C) 2018-2019  Paul Ciarlo\n");
@@ -230,7 +318,7 @@ int main(int argc, char* argv[])
 	fprintf(stderr, "Reconstructing nuked file system on %s.\n", spec);
     dev = exfat_open(spec, EXFAT_MODE_RO);
     if (dev != NULL) {
-        ret = scan(dev);
+        ret = scan(dev, start_cluster, prescan);
         if (ret != 0) {
 			fprintf(stderr, "reconstruct() returned error: %s\n", strerror(ret));
             return ret;